@@ -0,0 +1,167 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#include <Windows.h>
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "bindings.h"
+#include "public_definitions.h"
+#include "ts3_functions.h"
+#include "plugin.h"
+
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <algorithm>
+
+BindingTable::BindingTable(void)
+	: actions(1), bindings(BINDING_MODES << BINDING_KEYS, 0), references(1)
+{
+	memset(&lastWrite, 0, sizeof(lastWrite));
+	memset(chordKeys, 0, sizeof(chordKeys));
+}
+
+BindingTable::~BindingTable(void)
+{
+}
+
+void BindingTable::AddRef()
+{
+	InterlockedIncrement(&references);
+}
+
+void BindingTable::Release()
+{
+	if(InterlockedDecrement(&references) == 0) delete this;
+}
+
+bool BindingTable::Load(const char* path)
+{
+	actions.assign(1, Action());
+	bindings.assign(BINDING_MODES << BINDING_KEYS, 0);
+	gestures.clear();
+	memset(chordKeys, 0, sizeof(chordKeys));
+
+	// A missing file leaves all keys unbound
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+	{
+		memset(&lastWrite, 0, sizeof(lastWrite));
+		return false;
+	}
+	lastWrite = attributes.ftLastWriteTime;
+
+	std::ifstream file(path);
+	if(!file.is_open()) return false;
+
+	// Keys can't have both gesture bindings and key bindings
+	unsigned long gestureKeys = 0;
+	unsigned long boundKeys = 0;
+
+	std::string line;
+	for(int number = 1; std::getline(file, line); number++)
+	{
+		// Skip empty lines and comments
+		size_t first = line.find_first_not_of(" \t\r");
+		if(first == std::string::npos || line[first] == '#') continue;
+
+		std::stringstream error;
+		error << "Invalid binding on line " << number << " of gkey_bindings.conf";
+
+		size_t separator = line.find('=');
+		if(separator == std::string::npos)
+		{
+			ts3Functions.logMessage(error.str().c_str(), LogLevel_WARNING, "G-Key Plugin", 0);
+			continue;
+		}
+
+		// A gesture binding names a single key and its gesture, the engine returns its compiled action
+		std::string keys = line.substr(0, separator);
+		size_t underscore = keys.find('_');
+		if(underscore != std::string::npos)
+		{
+			std::stringstream identifiers(keys);
+			std::string identifier, extra;
+			identifiers >> identifier;
+
+			GestureBinding binding;
+			underscore = identifier.find('_');
+			binding.key = ParseBindingNumber(identifier.substr(1, underscore != std::string::npos ? underscore-1 : std::string::npos).c_str(), BINDING_KEYS);
+			binding.gesture = underscore != std::string::npos ? GestureEngine::GetGesture(identifier.c_str()+underscore+1) : GESTURE_COUNT;
+			if((identifier[0] != 'G' && identifier[0] != 'g') || binding.key == 0 || binding.gesture == GESTURE_COUNT
+				|| identifiers >> extra || (boundKeys & (1UL << (binding.key-1)))
+				|| !CompileAction(line.substr(separator+1), binding.action) || binding.action.commands.empty())
+			{
+				ts3Functions.logMessage(error.str().c_str(), LogLevel_WARNING, "G-Key Plugin", 0);
+				continue;
+			}
+
+			gestureKeys |= 1UL << (binding.key-1);
+			gestures.push_back(binding);
+			continue;
+		}
+
+		// Read the mode and the keys of the chord
+		std::replace(keys.begin(), keys.end(), '+', ' ');
+		std::stringstream identifiers(keys);
+		std::string identifier;
+		unsigned int mode = 1;
+		unsigned long chord = 0;
+		bool valid = true;
+		while(identifiers >> identifier)
+		{
+			unsigned int value;
+			if((identifier[0] == 'M' || identifier[0] == 'm') && (value = ParseBindingNumber(identifier.c_str()+1, BINDING_MODES)) != 0) mode = value;
+			else if((identifier[0] == 'G' || identifier[0] == 'g') && (value = ParseBindingNumber(identifier.c_str()+1, BINDING_KEYS)) != 0) chord |= 1UL << (value-1);
+			else valid = false;
+		}
+
+		Action action;
+		if(!valid || chord == 0 || (chord & gestureKeys) || actions.size() > USHRT_MAX || !CompileAction(line.substr(separator+1), action) || action.commands.empty())
+		{
+			ts3Functions.logMessage(error.str().c_str(), LogLevel_WARNING, "G-Key Plugin", 0);
+			continue;
+		}
+
+		boundKeys |= chord;
+
+		bindings[GetIndex(mode, chord)] = (unsigned short)actions.size();
+		actions.push_back(action);
+		if(chord & (chord-1)) chordKeys[mode-1] |= chord;
+	}
+
+	return true;
+}
+
+// Parses the number of a key or mode identifier, returns 0 unless the whole string is a number from 1 to max
+unsigned int ParseBindingNumber(const char* str, unsigned int max)
+{
+	if(*str < '0' || *str > '9') return 0;
+
+	char* end;
+	unsigned long value = strtoul(str, &end, 10);
+	return *end == (char)NULL && value >= 1 && value <= max ? (unsigned int)value : 0;
+}
+
+bool BindingTable::HasChanged(const char* path) const
+{
+	WIN32_FILE_ATTRIBUTE_DATA attributes;
+	if(!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+		memset(&attributes.ftLastWriteTime, 0, sizeof(FILETIME));
+	return CompareFileTime(&attributes.ftLastWriteTime, &lastWrite) != 0;
+}
+
+const Action* BindingTable::GetAction(unsigned int mode, unsigned long keys) const
+{
+	if(mode < 1 || mode > BINDING_MODES || keys == 0 || keys >= (1UL << BINDING_KEYS)) return NULL;
+
+	unsigned short action = bindings[GetIndex(mode, keys)];
+	return action != 0 ? &actions[action] : NULL;
+}
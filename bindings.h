@@ -0,0 +1,77 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef BINDINGS_H
+#define BINDINGS_H
+
+#include <Windows.h>
+
+#include "commands.h"
+#include "gestures.h"
+
+#include <vector>
+#include <string>
+
+#define BINDING_MODES 3
+#define BINDING_KEYS 18 // Chords are stored as a bitmask of these keys
+
+typedef struct
+{
+	unsigned int key;
+	Gesture gesture;
+	Action action;
+} GestureBinding;
+/*
+ * Key bindings compiled from gkey_bindings.conf.
+ *
+ * Each line binds a key or a chord of keys, optionally in a mode, to a command or a batch:
+ *   G5 = TS3_PTT_TOGGLE
+ *   M2 G5 = TS3_BATCH TS3_WHISPER_CLEAR ; TS3_WHISPER_CHANNEL Lobby ; TS3_WHISPER_ACTIVATE
+ *   M2 G6 = TS3_BATCH TS3_AWAY_ZZZ brb;; food ; TS3_OUTPUT_MUTE
+ *   G1+G2 = TS3_WHISPERGROUP_ACTIVATE squad
+ *   G6_hold = TS3_PTT_ACTIVATE
+ * Lines starting with # are comments. The commands are parsed once when the file is
+ * loaded, looking up a binding is a single index into a dense [mode][key bitmask] matrix.
+ * Gesture bindings, a key followed by _press, _double_tap, _hold, _long_press or _release,
+ * don't depend on the mode and are handed to the gesture engine instead. A key with gesture
+ * bindings can't also be bound on its own or in a chord, the later line is rejected.
+ *
+ * A loaded table is never modified, a reload builds a new table and swaps the pointer. The
+ * table is reference counted, so an action can still be used after the table was replaced.
+ */
+class BindingTable
+{
+private:
+	std::vector<Action> actions; // The first action is empty, it is used by unbound keys
+	std::vector<unsigned short> bindings; // Action for each mode and chord, see GetIndex
+	std::vector<GestureBinding> gestures;
+	unsigned long chordKeys[BINDING_MODES]; // Keys that are part of a bound chord in each mode
+	FILETIME lastWrite;
+	volatile LONG references;
+
+	static inline size_t GetIndex(unsigned int mode, unsigned long keys) { return ((size_t)(mode-1) << BINDING_KEYS) | keys; }
+
+	// Tables are shared by reference, never copied
+	BindingTable(const BindingTable&);
+	BindingTable& operator=(const BindingTable&);
+	~BindingTable(void);
+public:
+	BindingTable(void); // Starts with a single reference
+
+	void AddRef();
+	void Release(); // Deletes the table with the last reference
+
+	bool Load(const char* path);
+	bool HasChanged(const char* path) const;
+	const Action* GetAction(unsigned int mode, unsigned long keys) const;
+	inline const std::vector<GestureBinding>& GetGestures() const { return gestures; }
+	inline unsigned long GetChordKeys(unsigned int mode) const { return mode >= 1 && mode <= BINDING_MODES ? chordKeys[mode-1] : 0; }
+};
+
+unsigned int ParseBindingNumber(const char* str, unsigned int max);
+
+#endif
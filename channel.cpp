@@ -1,8 +1,10 @@
 #include "Channel.h"
 #include "public_definitions.h"
+#include "public_rare_definitions.h"
 #include "public_errors.h"
 #include "ts3_functions.h"
 #include "plugin.h"
+#include <string.h>
 #include <list>
 #include <vector>
 #include <stack>
@@ -169,3 +171,364 @@ int Channel::GetChannelHierarchy(uint64 scHandlerID, Channel* root)
 	ts3Functions.freeMemory(channels);
 	return 0;
 }
+
+ChannelModel::ChannelModel(void)
+	: references(1), generation(0), occupancy(0), subscriptions(0)
+{
+}
+
+ChannelModel::ChannelModel(const ChannelModel& model)
+	: index(model.index), references(1), generation(model.generation), occupancy(model.occupancy), subscriptions(model.subscriptions), channels(model.channels)
+{
+	for(int i=0; i<CHANNEL_ATTR_COUNT; i++) attributes[i] = model.attributes[i];
+}
+
+ChannelModel::~ChannelModel(void)
+{
+}
+
+void ChannelModel::AddRef()
+{
+	InterlockedIncrement(&references);
+}
+
+void ChannelModel::Release()
+{
+	if(InterlockedDecrement(&references) == 0) delete this;
+}
+
+ChannelModel* ChannelModel::Copy() const
+{
+	return new ChannelModel(*this);
+}
+
+typedef struct
+{
+	const char* name;
+	unsigned int mask;
+} FilterName;
+
+static const FilterName filterNames[] =
+{
+	{ "password", CHANNEL_FILTER(CHANNEL_ATTR_PASSWORD) },
+	{ "full", CHANNEL_FILTER(CHANNEL_ATTR_FULL) },
+	{ "familyfull", CHANNEL_FILTER(CHANNEL_ATTR_FAMILY_FULL) },
+	{ "permanent", CHANNEL_FILTER(CHANNEL_ATTR_PERMANENT) },
+	{ "semipermanent", CHANNEL_FILTER(CHANNEL_ATTR_SEMI_PERMANENT) },
+	{ "spacer", CHANNEL_FILTER(CHANNEL_ATTR_SPACER) },
+	{ "subscribed", CHANNEL_FILTER(CHANNEL_ATTR_SUBSCRIBED) },
+	{ "subtree", CHANNEL_FILTER_SUBTREE },
+};
+
+/*
+ * Parses a filter of the form "password,full,spacer", names may also be separated by spaces.
+ * Returns false if any of the names is not recognized.
+ */
+bool ChannelModel::ParseFilter(const char* str, unsigned int& result)
+{
+	result = 0;
+	while(*str != (char)NULL)
+	{
+		// Find the end of the name
+		size_t length = strcspn(str, ", ");
+		if(length > 0)
+		{
+			size_t i;
+			for(i=0; i<sizeof(filterNames)/sizeof(FilterName); i++)
+				if(strlen(filterNames[i].name) == length && !_strnicmp(str, filterNames[i].name, length)) break;
+			if(i == sizeof(filterNames)/sizeof(FilterName)) return false;
+			result |= filterNames[i].mask;
+		}
+
+		str += length;
+		if(*str != (char)NULL) str++;
+	}
+	return true;
+}
+
+bool ChannelModel::Build(uint64 scHandlerID)
+{
+	channels.clear();
+	index.clear();
+	for(int i=0; i<CHANNEL_ATTR_COUNT; i++) attributes[i].clear();
+
+	Channel root;
+	if(Channel::GetChannelHierarchy(scHandlerID, &root) != 0) return false;
+
+	Flatten(scHandlerID, root, NO_CHANNEL);
+	ReadSubscriptions(scHandlerID);
+	ReadOccupancy(scHandlerID);
+	return true;
+}
+
+/*
+ * Reads which channels we're subscribed to, the caller keeps the subscription generation to know when they changed since.
+ * The occupancy has to be read again afterwards, clients are only known in subscribed channels.
+ */
+void ChannelModel::ReadSubscriptions(uint64 scHandlerID)
+{
+	ClearAttribute(CHANNEL_ATTR_SUBSCRIBED);
+
+	int value;
+	for(size_t i=0; i<channels.size(); i++)
+		if(ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_FLAG_ARE_SUBSCRIBED, &value) == ERROR_ok && value)
+			SetAttribute(i, CHANNEL_ATTR_SUBSCRIBED);
+}
+
+/*
+ * Reads which channels are full, the caller keeps the occupancy generation to know when clients moved since.
+ * Clients are only known in subscribed channels, so channels and families holding unsubscribed channels are never full.
+ */
+void ChannelModel::ReadOccupancy(uint64 scHandlerID)
+{
+	ClearAttribute(CHANNEL_ATTR_FULL);
+	ClearAttribute(CHANNEL_ATTR_FAMILY_FULL);
+
+	// Count the clients, a count of -1 is unknown
+	std::vector<int> clients(channels.size(), -1);
+	for(size_t i=0; i<channels.size(); i++)
+	{
+		if(!HasAttribute(i, CHANNEL_ATTR_SUBSCRIBED)) continue;
+
+		anyID* list;
+		int count = 0;
+		if(ts3Functions.getChannelClientList(scHandlerID, channels[i].id, &list) != ERROR_ok) continue;
+		while(list[count] != (anyID)NULL) count++;
+		ts3Functions.freeMemory(list);
+		clients[i] = count;
+
+		int unlimited = 1, maxClients;
+		ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_FLAG_MAXCLIENTS_UNLIMITED, &unlimited);
+		if(!unlimited && ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_MAXCLIENTS, &maxClients) == ERROR_ok && count >= maxClients)
+			SetAttribute(i, CHANNEL_ATTR_FULL);
+	}
+
+	// A family holds the clients of the channel and all of its subchannels
+	for(size_t i=0; i<channels.size(); i++)
+	{
+		int unlimited = 1, inherited = 1, maxFamily;
+		ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_FLAG_MAXFAMILYCLIENTS_UNLIMITED, &unlimited);
+		ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_FLAG_MAXFAMILYCLIENTS_INHERITED, &inherited);
+		if(unlimited || inherited) continue;
+		if(ts3Functions.getChannelVariableAsInt(scHandlerID, channels[i].id, CHANNEL_MAXFAMILYCLIENTS, &maxFamily) != ERROR_ok) continue;
+
+		int family = 0;
+		size_t j;
+		for(j=i; j<channels[i].end && clients[j] >= 0; j++) family += clients[j];
+		if(j == channels[i].end && family >= maxFamily) SetAttribute(i, CHANNEL_ATTR_FAMILY_FULL);
+	}
+}
+
+void ChannelModel::Flatten(uint64 scHandlerID, Channel& channel, size_t parent)
+{
+	for(std::list<Channel>::iterator it = channel.subchannels.begin(); it != channel.subchannels.end(); ++it)
+	{
+		size_t i = channels.size();
+		ChannelEntry entry;
+		entry.id = it->id;
+		entry.parent = parent;
+		index[entry.id] = i;
+		channels.push_back(entry);
+		for(int j=0; j<CHANNEL_ATTR_COUNT; j++)
+			attributes[j].resize(channels.size() / CHANNEL_WORD_BITS + 1, 0);
+
+		// Read the attributes now, so walking the model doesn't have to
+		int value;
+		if(ts3Functions.getChannelVariableAsInt(scHandlerID, entry.id, CHANNEL_FLAG_PASSWORD, &value) == ERROR_ok && value)
+			SetAttribute(i, CHANNEL_ATTR_PASSWORD);
+		if(ts3Functions.getChannelVariableAsInt(scHandlerID, entry.id, CHANNEL_FLAG_PERMANENT, &value) == ERROR_ok && value)
+			SetAttribute(i, CHANNEL_ATTR_PERMANENT);
+		if(ts3Functions.getChannelVariableAsInt(scHandlerID, entry.id, CHANNEL_FLAG_SEMI_PERMANENT, &value) == ERROR_ok && value)
+			SetAttribute(i, CHANNEL_ATTR_SEMI_PERMANENT);
+
+		// Spacers are top-level channels named like "[spacer]", "[*spacer]" or "[cspacer0]"
+		char* name;
+		if(parent == NO_CHANNEL && ts3Functions.getChannelVariableAsString(scHandlerID, entry.id, CHANNEL_NAME, &name) == ERROR_ok)
+		{
+			char* spacer = strstr(name, "spacer");
+			char* close = strchr(name, ']');
+			if(name[0] == '[' && spacer != NULL && close != NULL && spacer < close && spacer - name <= 2)
+				SetAttribute(i, CHANNEL_ATTR_SPACER);
+			ts3Functions.freeMemory(name);
+		}
+
+		// Subchannels follow their parent
+		Flatten(scHandlerID, *it, i);
+		channels[i].end = channels.size();
+	}
+}
+
+void ChannelModel::SetAttribute(size_t channel, ChannelAttribute attribute)
+{
+	attributes[attribute][channel / CHANNEL_WORD_BITS] |= 1UL << (channel % CHANNEL_WORD_BITS);
+}
+
+void ChannelModel::ClearAttribute(ChannelAttribute attribute)
+{
+	attributes[attribute].assign(attributes[attribute].size(), 0);
+}
+
+bool ChannelModel::HasAttribute(size_t channel, ChannelAttribute attribute)
+{
+	return (attributes[attribute][channel / CHANNEL_WORD_BITS] & (1UL << (channel % CHANNEL_WORD_BITS))) != 0;
+}
+
+size_t ChannelModel::Find(uint64 id)
+{
+	std::map<uint64, size_t>::iterator it = index.find(id);
+	if(it == index.end()) return NO_CHANNEL;
+	return it->second;
+}
+
+/*
+ * Finds the first channel after or before a channel, within [begin, end), that has none of the attributes in the mask.
+ * The bitsets of the masked attributes are combined a word at a time, so each word covers CHANNEL_WORD_BITS channels.
+ */
+size_t ChannelModel::Scan(size_t from, bool next, unsigned int mask, size_t begin, size_t end)
+{
+	if(next ? from+1 >= end : from <= begin) return NO_CHANNEL;
+
+	size_t i = next ? from+1 : from-1;
+	for(;;)
+	{
+		size_t word = i / CHANNEL_WORD_BITS;
+		unsigned long excluded = 0;
+		for(int j=0; j<CHANNEL_ATTR_COUNT; j++)
+			if(mask & CHANNEL_FILTER(j)) excluded |= attributes[j][word];
+
+		// Only consider the channels from i onwards in the direction given
+		size_t bit = i % CHANNEL_WORD_BITS;
+		unsigned long candidates = ~excluded & (next ? 0xFFFFFFFFUL << bit : 0xFFFFFFFFUL >> (CHANNEL_WORD_BITS-1 - bit));
+		if(candidates != 0)
+		{
+			if(next) for(bit = 0; !(candidates & (1UL << bit)); bit++);
+			else for(bit = CHANNEL_WORD_BITS-1; !(candidates & (1UL << bit)); bit--);
+
+			size_t found = word * CHANNEL_WORD_BITS + bit;
+			return (found >= begin && found < end) ? found : NO_CHANNEL;
+		}
+
+		// Continue with the next word
+		if(next)
+		{
+			i = (word+1) * CHANNEL_WORD_BITS;
+			if(i >= end) return NO_CHANNEL;
+		}
+		else
+		{
+			if(word * CHANNEL_WORD_BITS <= begin) return NO_CHANNEL;
+			i = word * CHANNEL_WORD_BITS - 1;
+		}
+	}
+}
+
+/*
+ * Finds the channel count channels away in the direction given that passes the filter,
+ * stops at the last channel that passes if there are fewer. Returns NULL if there is none.
+ */
+uint64 ChannelModel::FindNext(uint64 id, bool next, unsigned int filter, unsigned int count)
+{
+	size_t i = Find(id);
+	if(i == NO_CHANNEL) return (uint64)NULL;
+
+	// Stay below the parent channel, top-level channels may go anywhere
+	size_t begin = 0, end = channels.size();
+	if((filter & CHANNEL_FILTER_SUBTREE) && channels[i].parent != NO_CHANNEL)
+	{
+		begin = channels[i].parent + 1;
+		end = channels[channels[i].parent].end;
+	}
+
+	// Without attributes to skip every channel passes, so the jump is plain index arithmetic
+	unsigned int mask = filter & ~CHANNEL_FILTER_SUBTREE;
+	if(mask == 0)
+	{
+		if(next ? i+1 >= end : i <= begin) return (uint64)NULL;
+		if(next) i = (count < end-i) ? i+count : end-1;
+		else i = (count < i-begin) ? i-count : begin;
+		return channels[i].id;
+	}
+
+	size_t found = NO_CHANNEL;
+	for(unsigned int j=0; j<count; j++)
+	{
+		size_t step = Scan(i, next, mask, begin, end);
+		if(step == NO_CHANNEL) break;
+		found = i = step;
+	}
+	return found != NO_CHANNEL ? channels[found].id : (uint64)NULL;
+}
+
+uint64 ChannelModel::FindParent(uint64 id)
+{
+	size_t i = Find(id);
+	if(i == NO_CHANNEL || channels[i].parent == NO_CHANNEL) return (uint64)NULL;
+	return channels[channels[i].parent].id;
+}
+
+uint64 ChannelModel::FindFirstChild(uint64 id)
+{
+	// Subchannels directly follow their parent
+	size_t i = Find(id);
+	if(i == NO_CHANNEL || channels[i].end == i+1) return (uint64)NULL;
+	return channels[i+1].id;
+}
+
+uint64 ChannelModel::FindNextSibling(uint64 id)
+{
+	// The next sibling follows the subtree, unless the subtree ends the parent's subtree
+	size_t i = Find(id);
+	if(i == NO_CHANNEL) return (uint64)NULL;
+	size_t end = channels[i].parent != NO_CHANNEL ? channels[channels[i].parent].end : channels.size();
+	if(channels[i].end >= end) return (uint64)NULL;
+	return channels[channels[i].end].id;
+}
+
+/*
+ * Appends a channel and all its subchannels to the result, the subtree is a contiguous range of the model.
+ * Returns false if the channel is unknown.
+ */
+bool ChannelModel::FindSubtree(uint64 id, std::vector<uint64>& result)
+{
+	size_t i = Find(id);
+	if(i == NO_CHANNEL) return false;
+
+	result.reserve(result.size() + channels[i].end - i);
+	for(size_t j=i; j<channels[i].end; j++)
+		result.push_back(channels[j].id);
+	return true;
+}
+
+/*
+ * Finds the subscriptions needed to only be subscribed to the neighborhood of a channel,
+ * which holds its ancestors, its siblings and its subchannels. Returns false if the channel is unknown.
+ */
+bool ChannelModel::FindSubscriptionChanges(uint64 id, std::vector<uint64>& subscribe, std::vector<uint64>& unsubscribe)
+{
+	size_t i = Find(id);
+	if(i == NO_CHANNEL) return false;
+
+	std::vector<bool> wanted(channels.size(), false);
+
+	// Ancestors
+	for(size_t j=channels[i].parent; j!=NO_CHANNEL; j=channels[j].parent)
+		wanted[j] = true;
+
+	// Siblings, including the channel itself, skipping their subtrees
+	size_t parent = channels[i].parent;
+	size_t end = parent != NO_CHANNEL ? channels[parent].end : channels.size();
+	for(size_t j=(parent != NO_CHANNEL ? parent+1 : 0); j<end; j=channels[j].end)
+		wanted[j] = true;
+
+	// Subchannels
+	for(size_t j=i+1; j<channels[i].end; j=channels[j].end)
+		wanted[j] = true;
+
+	for(size_t j=0; j<channels.size(); j++)
+	{
+		bool subscribed = HasAttribute(j, CHANNEL_ATTR_SUBSCRIBED);
+		if(wanted[j] && !subscribed) subscribe.push_back(channels[j].id);
+		else if(!wanted[j] && subscribed) unsubscribe.push_back(channels[j].id);
+	}
+	return true;
+}
@@ -1,8 +1,14 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <Windows.h>
+
 #include "public_definitions.h"
 #include <list>
+#include <vector>
+#include <map>
+
+#define NO_CHANNEL ((size_t)-1)
 
 class Channel
 {
@@ -24,4 +30,84 @@ public:
 	Channel* prev(void);
 };
 
+// Channel attributes, stored as one packed bitset per attribute
+enum ChannelAttribute
+{
+	CHANNEL_ATTR_PASSWORD = 0,
+	CHANNEL_ATTR_FULL, // Max clients reached
+	CHANNEL_ATTR_FAMILY_FULL, // Max family clients reached
+	CHANNEL_ATTR_PERMANENT,
+	CHANNEL_ATTR_SEMI_PERMANENT,
+	CHANNEL_ATTR_SPACER,
+	CHANNEL_ATTR_SUBSCRIBED,
+	CHANNEL_ATTR_COUNT
+};
+
+// Filter masks hold a bit for each attribute to skip, the subtree bit keeps the traversal below the parent channel
+#define CHANNEL_FILTER(attribute) (1U << (attribute))
+#define CHANNEL_FILTER_SUBTREE (1U << CHANNEL_ATTR_COUNT)
+#define CHANNEL_FILTER_OCCUPANCY (CHANNEL_FILTER(CHANNEL_ATTR_FULL) | CHANNEL_FILTER(CHANNEL_ATTR_FAMILY_FULL)) // Change whenever clients move
+#define CHANNEL_FILTER_SUBSCRIBED CHANNEL_FILTER(CHANNEL_ATTR_SUBSCRIBED) // Changes whenever a subscription request finishes
+#define CHANNEL_FILTER_DEFAULT CHANNEL_FILTER(CHANNEL_ATTR_PASSWORD)
+#define CHANNEL_FILTER_SETTING ((unsigned int)-1) // Use the filter from the plugin settings
+
+#define CHANNEL_WORD_BITS 32
+
+typedef struct
+{
+	uint64 id;
+	size_t parent; // Index of the parent channel, NO_CHANNEL for top-level channels
+	size_t end; // Index following the last channel of the subtree
+} ChannelEntry;
+
+/*
+ * Flat copy of the channel tree in preorder, the channel after a channel is its first subchannel
+ * or the channel following its subtree. Built off the key path, so lookups don't query the client.
+ *
+ * A published model is never modified, a rebuild creates a new model and swaps the pointer. The
+ * model is reference counted, so a lookup can still walk it after it was replaced.
+ */
+class ChannelModel
+{
+private:
+	std::map<uint64, size_t> index;
+	std::vector<unsigned long> attributes[CHANNEL_ATTR_COUNT]; // One bit per channel, CHANNEL_WORD_BITS channels per word
+	volatile LONG references;
+
+	// Models are shared by reference, only copied to read the subscriptions and occupancy again
+	ChannelModel(const ChannelModel& model);
+	ChannelModel& operator=(const ChannelModel&);
+	~ChannelModel(void);
+
+	void Flatten(uint64 scHandlerID, Channel& channel, size_t parent);
+	void ClearAttribute(ChannelAttribute attribute);
+	void SetAttribute(size_t channel, ChannelAttribute attribute);
+	size_t Scan(size_t from, bool next, unsigned int mask, size_t begin, size_t end);
+public:
+	unsigned long generation; // Channel generation the model was built against
+	unsigned long occupancy; // Occupancy generation the full channels were read against
+	unsigned long subscriptions; // Subscription generation the subscribed channels were read against
+	std::vector<ChannelEntry> channels;
+
+	ChannelModel(void); // Starts with a single reference
+
+	void AddRef();
+	void Release(); // Deletes the model with the last reference
+	ChannelModel* Copy() const; // Starts with a single reference
+
+	static bool ParseFilter(const char* str, unsigned int& result);
+
+	bool Build(uint64 scHandlerID);
+	void ReadSubscriptions(uint64 scHandlerID);
+	void ReadOccupancy(uint64 scHandlerID);
+	size_t Find(uint64 id);
+	bool HasAttribute(size_t channel, ChannelAttribute attribute);
+	uint64 FindNext(uint64 id, bool next, unsigned int filter, unsigned int count = 1);
+	uint64 FindParent(uint64 id);
+	uint64 FindFirstChild(uint64 id);
+	uint64 FindNextSibling(uint64 id);
+	bool FindSubtree(uint64 id, std::vector<uint64>& result);
+	bool FindSubscriptionChanges(uint64 id, std::vector<uint64>& subscribe, std::vector<uint64>& unsubscribe);
+};
+
 #endif
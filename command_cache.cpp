@@ -0,0 +1,86 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#include <string.h>
+
+#include "command_cache.h"
+
+#include <vector>
+#include <list>
+#include <map>
+#include <string>
+
+CommandCache::CommandCache(void)
+	: hits(0), misses(0)
+{
+}
+
+CommandCache::~CommandCache(void)
+{
+}
+
+unsigned long CommandCache::Hash(const char* str)
+{
+	// 32-bit FNV-1a
+	unsigned long hash = 2166136261UL;
+	for(; *str != (char)NULL; str++)
+	{
+		hash ^= (unsigned char)*str;
+		hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+	}
+	return hash;
+}
+
+CachedCommand* CommandCache::Get(const char* str)
+{
+	std::map<unsigned long, std::list<CachedCommand>::iterator>::iterator found = index.find(Hash(str));
+	if(found == index.end() || found->second->str != str)
+	{
+		misses++;
+		return NULL;
+	}
+
+	// Move the entry to the front, it is now the most recently used
+	entries.splice(entries.begin(), entries, found->second);
+	hits++;
+	return &entries.front();
+}
+
+CachedCommand* CommandCache::Add(const char* str, const Action& action)
+{
+	// Replace a colliding entry, or evict the least recently used one when full
+	unsigned long hash = Hash(str);
+	std::map<unsigned long, std::list<CachedCommand>::iterator>::iterator found = index.find(hash);
+	if(found != index.end())
+	{
+		entries.erase(found->second);
+		index.erase(found);
+	}
+	else if(entries.size() >= COMMAND_CACHE_SIZE)
+	{
+		index.erase(entries.back().hash);
+		entries.pop_back();
+	}
+
+	CachedCommand entry;
+	entry.str = str;
+	entry.hash = hash;
+	entry.action = action;
+	ResolvedTarget unresolved;
+	memset(&unresolved, 0, sizeof(unresolved));
+	entry.targets.assign(action.commands.size(), unresolved);
+
+	entries.push_front(entry);
+	index[hash] = entries.begin();
+	return &entries.front();
+}
+
+void CommandCache::Clear()
+{
+	entries.clear();
+	index.clear();
+}
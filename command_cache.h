@@ -0,0 +1,55 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef COMMAND_CACHE_H
+#define COMMAND_CACHE_H
+
+#include "commands.h"
+
+#include <vector>
+#include <list>
+#include <map>
+#include <string>
+
+#define COMMAND_CACHE_SIZE 64
+
+typedef struct
+{
+	std::string str;
+	unsigned long hash;
+	Action action;
+	std::vector<ResolvedTarget> targets; // One per command of the action
+} CachedCommand;
+
+/*
+ * Least recently used cache of compiled command strings.
+ *
+ * The Logitech software sends the same literal strings over and over, a cached string
+ * skips parsing and keeps the targets its commands resolved, so a repeat only resolves
+ * them again if the channels or clients changed since. Not thread-safe, it is only used
+ * by the command thread.
+ */
+class CommandCache
+{
+private:
+	std::list<CachedCommand> entries; // Most recently used first
+	std::map<unsigned long, std::list<CachedCommand>::iterator> index;
+
+	static unsigned long Hash(const char* str);
+public:
+	unsigned long hits;
+	unsigned long misses;
+
+	CommandCache(void);
+	~CommandCache(void);
+
+	CachedCommand* Get(const char* str);
+	CachedCommand* Add(const char* str, const Action& action);
+	void Clear();
+};
+
+#endif
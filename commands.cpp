@@ -0,0 +1,529 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ * Copyright (c) 2008-2012 TeamSpeak Systems GmbH
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include <limits.h>
+
+#include "commands.h"
+#include "channel.h"
+#include "public_definitions.h"
+#include "ts3_functions.h"
+#include "plugin.h"
+
+#include <vector>
+#include <string>
+
+typedef struct
+{
+	const char* name;
+	CommandOpcode opcode;
+	int argument; // ArgumentType, optionally combined with ARG_OPTIONAL
+} CommandName;
+
+static const CommandName commandNames[] =
+{
+	/* Communication */
+	{ "TS3_PTT_ACTIVATE", CMD_PTT_ACTIVATE, ARG_NONE },
+	{ "TS3_PTT_DEACTIVATE", CMD_PTT_DEACTIVATE, ARG_NONE },
+	{ "TS3_PTT_TOGGLE", CMD_PTT_TOGGLE, ARG_NONE },
+	{ "TS3_PTT_ACTIVATE_ALL", CMD_PTT_ACTIVATE_ALL, ARG_NONE },
+	{ "TS3_PTT_DEACTIVATE_ALL", CMD_PTT_DEACTIVATE_ALL, ARG_NONE },
+	{ "TS3_VAD_ACTIVATE", CMD_VAD_ACTIVATE, ARG_NONE },
+	{ "TS3_VAD_DEACTIVATE", CMD_VAD_DEACTIVATE, ARG_NONE },
+	{ "TS3_VAD_TOGGLE", CMD_VAD_TOGGLE, ARG_NONE },
+	{ "TS3_CT_ACTIVATE", CMD_CT_ACTIVATE, ARG_NONE },
+	{ "TS3_CT_DEACTIVATE", CMD_CT_DEACTIVATE, ARG_NONE },
+	{ "TS3_CT_TOGGLE", CMD_CT_TOGGLE, ARG_NONE },
+	{ "TS3_INPUT_MUTE", CMD_INPUT_MUTE, ARG_NONE },
+	{ "TS3_INPUT_UNMUTE", CMD_INPUT_UNMUTE, ARG_NONE },
+	{ "TS3_INPUT_TOGGLE", CMD_INPUT_TOGGLE, ARG_NONE },
+	{ "TS3_OUTPUT_MUTE", CMD_OUTPUT_MUTE, ARG_NONE },
+	{ "TS3_OUTPUT_UNMUTE", CMD_OUTPUT_UNMUTE, ARG_NONE },
+	{ "TS3_OUTPUT_TOGGLE", CMD_OUTPUT_TOGGLE, ARG_NONE },
+
+	/* Server interaction */
+	{ "TS3_AWAY_ZZZ", CMD_AWAY_ZZZ, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_AWAY_NONE", CMD_AWAY_NONE, ARG_NONE },
+	{ "TS3_AWAY_TOGGLE", CMD_AWAY_TOGGLE, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_GLOBALAWAY_ZZZ", CMD_GLOBALAWAY_ZZZ, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_GLOBALAWAY_NONE", CMD_GLOBALAWAY_NONE, ARG_NONE },
+	{ "TS3_GLOBALAWAY_TOGGLE", CMD_GLOBALAWAY_TOGGLE, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_ACTIVATE_SERVER", CMD_ACTIVATE_SERVER, ARG_TEXT },
+	{ "TS3_ACTIVATE_SERVERID", CMD_ACTIVATE_SERVERID, ARG_TEXT },
+	{ "TS3_ACTIVATE_SERVERIP", CMD_ACTIVATE_SERVERIP, ARG_TEXT },
+	{ "TS3_ACTIVATE_CURRENT", CMD_ACTIVATE_CURRENT, ARG_NONE },
+	{ "TS3_SERVER_NEXT", CMD_SERVER_NEXT, ARG_NONE },
+	{ "TS3_SERVER_PREV", CMD_SERVER_PREV, ARG_NONE },
+	{ "TS3_JOIN_CHANNEL", CMD_JOIN_CHANNEL, ARG_PATH },
+	{ "TS3_JOIN_CHANNELID", CMD_JOIN_CHANNELID, ARG_UINT64 },
+	{ "TS3_CHANNEL_NEXT", CMD_CHANNEL_NEXT, ARG_TRAVERSAL | ARG_OPTIONAL },
+	{ "TS3_CHANNEL_PREV", CMD_CHANNEL_PREV, ARG_TRAVERSAL | ARG_OPTIONAL },
+	{ "TS3_CHANNEL_PARENT", CMD_CHANNEL_PARENT, ARG_NONE },
+	{ "TS3_CHANNEL_FIRSTCHILD", CMD_CHANNEL_FIRSTCHILD, ARG_NONE },
+	{ "TS3_CHANNEL_NEXT_SIBLING", CMD_CHANNEL_NEXT_SIBLING, ARG_NONE },
+	{ "TS3_SUBSCRIBE_NEIGHBORHOOD", CMD_SUBSCRIBE_NEIGHBORHOOD, ARG_NONE },
+	{ "TS3_SUBSCRIBE_ALL", CMD_SUBSCRIBE_ALL, ARG_NONE },
+	{ "TS3_KICK_CLIENT", CMD_KICK_CLIENT, ARG_TEXT },
+	{ "TS3_KICK_CLIENTID", CMD_KICK_CLIENTID, ARG_TEXT },
+	{ "TS3_CHANKICK_CLIENT", CMD_CHANKICK_CLIENT, ARG_TEXT },
+	{ "TS3_CHANKICK_CLIENTID", CMD_CHANKICK_CLIENTID, ARG_TEXT },
+	{ "TS3_KICK_CLIENTS", CMD_KICK_CLIENTS, ARG_TEXT },
+	{ "TS3_CHANKICK_CLIENTS", CMD_CHANKICK_CLIENTS, ARG_TEXT },
+	{ "TS3_BOOKMARK_CONNECT", CMD_BOOKMARK_CONNECT, ARG_PATH },
+	{ "TS3_BOOKMARK_CONNECT_GROUP", CMD_BOOKMARK_CONNECT_GROUP, ARG_PATH },
+
+	/* Whispering */
+	{ "TS3_WHISPER_ACTIVATE", CMD_WHISPER_ACTIVATE, ARG_NONE },
+	{ "TS3_WHISPER_DEACTIVATE", CMD_WHISPER_DEACTIVATE, ARG_NONE },
+	{ "TS3_WHISPER_TOGGLE", CMD_WHISPER_TOGGLE, ARG_NONE },
+	{ "TS3_WHISPER_CLEAR", CMD_WHISPER_CLEAR, ARG_NONE },
+	{ "TS3_WHISPER_CLIENT", CMD_WHISPER_CLIENT, ARG_TEXT },
+	{ "TS3_WHISPER_CLIENTID", CMD_WHISPER_CLIENTID, ARG_TEXT },
+	{ "TS3_WHISPER_CHANNEL", CMD_WHISPER_CHANNEL, ARG_PATH },
+	{ "TS3_WHISPER_CHANNELID", CMD_WHISPER_CHANNELID, ARG_UINT64 },
+	{ "TS3_WHISPER_SUBTREE", CMD_WHISPER_SUBTREE, ARG_PATH },
+	{ "TS3_WHISPERGROUP_DEFINE", CMD_WHISPERGROUP_DEFINE, ARG_WHISPERGROUP },
+	{ "TS3_WHISPERGROUP_ACTIVATE", CMD_WHISPERGROUP_ACTIVATE, ARG_TEXT },
+	{ "TS3_REPLY_ACTIVATE", CMD_REPLY_ACTIVATE, ARG_NONE },
+	{ "TS3_REPLY_DEACTIVATE", CMD_REPLY_DEACTIVATE, ARG_NONE },
+	{ "TS3_REPLY_TOGGLE", CMD_REPLY_TOGGLE, ARG_NONE },
+	{ "TS3_REPLY_CLEAR", CMD_REPLY_CLEAR, ARG_NONE },
+
+	/* Miscellaneous */
+	{ "TS3_MUTE_CLIENT", CMD_MUTE_CLIENT, ARG_TEXT },
+	{ "TS3_MUTE_CLIENTID", CMD_MUTE_CLIENTID, ARG_TEXT },
+	{ "TS3_UNMUTE_CLIENT", CMD_UNMUTE_CLIENT, ARG_TEXT },
+	{ "TS3_UNMUTE_CLIENTID", CMD_UNMUTE_CLIENTID, ARG_TEXT },
+	{ "TS3_MUTE_TOGGLE_CLIENT", CMD_MUTE_TOGGLE_CLIENT, ARG_TEXT },
+	{ "TS3_MUTE_TOGGLE_CLIENTID", CMD_MUTE_TOGGLE_CLIENTID, ARG_TEXT },
+	{ "TS3_MUTE_CLIENTS", CMD_MUTE_CLIENTS, ARG_TEXT },
+	{ "TS3_UNMUTE_CLIENTS", CMD_UNMUTE_CLIENTS, ARG_TEXT },
+	{ "TS3_MUTE_MATCHING", CMD_MUTE_MATCHING, ARG_TEXT },
+	{ "TS3_UNMUTE_MATCHING", CMD_UNMUTE_MATCHING, ARG_TEXT },
+	{ "TS3_MUTE_CHANNEL", CMD_MUTE_CHANNEL, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_UNMUTE_CHANNEL", CMD_UNMUTE_CHANNEL, ARG_TEXT | ARG_OPTIONAL },
+	{ "TS3_VOLUME_UP", CMD_VOLUME_UP, ARG_FLOAT | ARG_OPTIONAL },
+	{ "TS3_VOLUME_DOWN", CMD_VOLUME_DOWN, ARG_FLOAT | ARG_OPTIONAL },
+	{ "TS3_VOLUME_SET", CMD_VOLUME_SET, ARG_FLOAT },
+	{ "TS3_PLUGIN_COMMAND", CMD_PLUGIN_COMMAND, ARG_PAIR },
+	{ "TS3_STATS", CMD_STATS, ARG_NONE },
+	{ "TS3_BENCHMARK_FLOOD", CMD_BENCHMARK_FLOOD, ARG_INT | ARG_OPTIONAL },
+
+	/* Key events */
+	{ "GKEY", CMD_GKEY, ARG_TEXT },
+	{ "GKEY_DOWN", CMD_GKEY_DOWN, ARG_TEXT },
+	{ "GKEY_UP", CMD_GKEY_UP, ARG_TEXT },
+};
+
+CommandOpcode GetCommandOpcode(const char* cmd)
+{
+	for(size_t i=0; i<sizeof(commandNames)/sizeof(CommandName); i++)
+		if(!strcmp(cmd, commandNames[i].name)) return commandNames[i].opcode;
+	return CMD_UNKNOWN;
+}
+
+static int GetArgumentType(CommandOpcode opcode)
+{
+	for(size_t i=0; i<sizeof(commandNames)/sizeof(CommandName); i++)
+		if(commandNames[i].opcode == opcode) return commandNames[i].argument;
+	return ARG_NONE;
+}
+
+// Parses an unsigned decimal number, fails instead of truncating numbers that don't fit in 64 bits
+static bool ParseUnsigned(const char* str, uint64& result)
+{
+	result = 0;
+	if(*str == (char)NULL) return false;
+	for(; *str != (char)NULL; str++)
+	{
+		if(*str < '0' || *str > '9') return false;
+		uint64 digit = *str - '0';
+		if(result > ((uint64)-1 - digit) / 10) return false;
+		result = result * 10 + digit;
+	}
+	return true;
+}
+
+static bool ParseFloat(const char* str, float& result)
+{
+	char* end;
+	result = (float)strtod(str, &end);
+	return end != str && *end == (char)NULL;
+}
+
+static bool ParseWhisperTarget(const std::string& str, WhisperTarget& result)
+{
+	size_t split = str.find('=');
+	if(split == std::string::npos) return false;
+
+	std::string type = str.substr(0, split);
+	result.value = str.substr(split+1);
+	result.id = 0;
+	if(type == "client") result.type = WHISPER_TARGET_CLIENT;
+	else if(type == "clientid") result.type = WHISPER_TARGET_CLIENTID;
+	else if(type == "channel") result.type = WHISPER_TARGET_CHANNEL;
+	else if(type == "channelid")
+	{
+		result.type = WHISPER_TARGET_CHANNELID;
+		return ParseUnsigned(result.value.c_str(), result.id) && result.id != (uint64)NULL;
+	}
+	else return false;
+	return true;
+}
+
+/*
+ * Parses the comma separated type=value targets of a whisper group.
+ * Returns false if a target has an unknown type or an invalid channel ID.
+ */
+bool ParseWhisperTargets(const char* str, std::vector<WhisperTarget>& result)
+{
+	std::string targets = str;
+	size_t start = 0;
+	while(start < targets.size())
+	{
+		size_t end = targets.find(',', start);
+		if(end == std::string::npos) end = targets.size();
+
+		WhisperTarget target;
+		if(!ParseWhisperTarget(targets.substr(start, end - start), target)) return false;
+		result.push_back(target);
+		start = end + 1;
+	}
+	return true;
+}
+
+/*
+ * Parses the argument of a command into its typed value, the argument is modified in place.
+ * Returns false if a required argument is missing or the argument is malformed.
+ */
+static bool ParseArgument(Command& command)
+{
+	int type = GetArgumentType(command.opcode);
+	command.value.integer = 0;
+
+	// Skip the whitespace seperating the argument from the command
+	if(command.arg != NULL)
+	{
+		while(*command.arg == ' ' || *command.arg == '\t') command.arg++;
+		if(*command.arg == (char)NULL) command.arg = NULL;
+	}
+	if((type & ~ARG_OPTIONAL) == ARG_NONE) return true;
+	if(command.arg == NULL) return (type & ARG_OPTIONAL) != 0;
+
+	switch(type & ~ARG_OPTIONAL)
+	{
+		case ARG_UINT64:
+			return ParseUnsigned(command.arg, command.value.integer);
+		case ARG_INT:
+			return ParseUnsigned(command.arg, command.value.integer) && command.value.integer <= INT_MAX;
+		case ARG_FLOAT:
+			return ParseFloat(command.arg, command.value.real);
+		case ARG_TRAVERSAL:
+		{
+			// A leading number is the count, anything after it is the filter
+			char* filter = command.arg;
+			command.value.traversal.count = 1;
+			if(*filter >= '0' && *filter <= '9')
+			{
+				// Split the count from the filter by inserting a NULL-terminator
+				char* end = filter + strspn(filter, "0123456789");
+				if(*end != ' ' && *end != (char)NULL) return false;
+				char* next = *end != (char)NULL ? end+1 : end;
+				*end = (char)NULL;
+
+				uint64 count;
+				if(!ParseUnsigned(filter, count) || count < 1 || count > UINT_MAX) return false;
+				command.value.traversal.count = (unsigned int)count;
+				filter = next;
+				while(*filter == ' ') filter++;
+			}
+
+			command.value.traversal.filter = CHANNEL_FILTER_SETTING;
+			if(*filter == (char)NULL) return true;
+			return ChannelModel::ParseFilter(filter, command.value.traversal.filter);
+		}
+		case ARG_PAIR:
+		case ARG_WHISPERGROUP:
+		{
+			char* text = strchr(command.arg, ' ');
+			if(text == NULL) return false;
+
+			// Split the string by inserting a NULL-terminator
+			*text = (char)NULL;
+			text++;
+			if(*text == (char)NULL) return false;
+			command.value.offset = text - command.arg;
+			if((type & ~ARG_OPTIONAL) == ARG_PAIR) return true;
+
+			// Reject malformed targets now, the group is only defined when the command is executed
+			std::vector<WhisperTarget> targets;
+			return ParseWhisperTargets(text, targets);
+		}
+		default:
+			return true;
+	}
+}
+
+// Voice activation commands bypass the command queue, they are latency sensitive and only touch our own client
+bool IsFastLaneCommand(CommandOpcode opcode)
+{
+	return opcode >= CMD_PTT_ACTIVATE && opcode <= CMD_CT_TOGGLE;
+}
+
+// Commands that change the server the fast lane acts on
+bool IsServerSwitchCommand(CommandOpcode opcode)
+{
+	return opcode >= CMD_ACTIVATE_SERVER && opcode <= CMD_SERVER_PREV;
+}
+
+// Commands that leave the same state no matter how often they are repeated
+bool IsIdempotentCommand(CommandOpcode opcode)
+{
+	switch(opcode)
+	{
+		case CMD_PTT_ACTIVATE:
+		case CMD_PTT_DEACTIVATE:
+		case CMD_PTT_ACTIVATE_ALL:
+		case CMD_PTT_DEACTIVATE_ALL:
+		case CMD_VAD_ACTIVATE:
+		case CMD_VAD_DEACTIVATE:
+		case CMD_CT_ACTIVATE:
+		case CMD_CT_DEACTIVATE:
+		case CMD_INPUT_MUTE:
+		case CMD_INPUT_UNMUTE:
+		case CMD_OUTPUT_MUTE:
+		case CMD_OUTPUT_UNMUTE:
+		case CMD_AWAY_ZZZ:
+		case CMD_AWAY_NONE:
+		case CMD_GLOBALAWAY_ZZZ:
+		case CMD_GLOBALAWAY_NONE:
+		case CMD_WHISPER_ACTIVATE:
+		case CMD_WHISPER_DEACTIVATE:
+		case CMD_REPLY_ACTIVATE:
+		case CMD_REPLY_DEACTIVATE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+// Commands that are undone by repeating them
+bool IsToggleCommand(CommandOpcode opcode)
+{
+	switch(opcode)
+	{
+		case CMD_PTT_TOGGLE:
+		case CMD_VAD_TOGGLE:
+		case CMD_CT_TOGGLE:
+		case CMD_INPUT_TOGGLE:
+		case CMD_OUTPUT_TOGGLE:
+		case CMD_AWAY_TOGGLE:
+		case CMD_GLOBALAWAY_TOGGLE:
+		case CMD_WHISPER_TOGGLE:
+		case CMD_REPLY_TOGGLE:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Returns the opcode of a string holding a single command without modifying the string,
+ * the trimmed command including its argument is stored in result.
+ * Returns CMD_UNKNOWN if the string holds several commands.
+ */
+CommandOpcode PeekCommand(const char* str, std::string& result)
+{
+	result = str;
+	size_t first = result.find_first_not_of(" \t\r\n");
+	size_t last = result.find_last_not_of(" \t\r\n");
+	if(first == std::string::npos)
+	{
+		result.clear();
+		return CMD_UNKNOWN;
+	}
+	result = result.substr(first, last - first + 1);
+	if(result.find('\n') != std::string::npos) return CMD_UNKNOWN;
+
+	std::string cmd = result.substr(0, result.find(' '));
+	return GetCommandOpcode(cmd.c_str());
+}
+
+static char* TrimCommand(char* str)
+{
+	// Skip leading whitespace and cut off trailing whitespace
+	while(*str == ' ' || *str == '\t' || *str == '\r' || *str == '\n') str++;
+	char* end = str + strlen(str);
+	while(end != str && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r' || end[-1] == '\n')) end--;
+	*end = (char)NULL;
+	return str;
+}
+
+static void SplitCommand(char* str, std::vector<Command>& result)
+{
+	str = TrimCommand(str);
+	if(*str == (char)NULL) return; // Skip empty commands
+
+	Command command;
+	command.cmd = str;
+	command.target = NULL;
+
+	// Seperate the argument from the command
+	command.arg = strchr(str, ' ');
+	if(command.arg != NULL)
+	{
+		// Split the string by inserting a NULL-terminator
+		*command.arg = (char)NULL;
+		command.arg++;
+	}
+
+	command.opcode = GetCommandOpcode(command.cmd);
+	result.push_back(command);
+}
+
+static void SplitBatch(char* batch, std::vector<Command>& result)
+{
+	// Commands are separated by a semicolon, a doubled semicolon is a literal one. The
+	// escapes are removed in place, the string only gets shorter.
+	char* command = batch;
+	char* out = batch;
+	for(char* in = batch; ; in++)
+	{
+		if(*in == ';' && in[1] == ';')
+		{
+			*out++ = ';';
+			in++;
+		}
+		else if(*in == ';' || *in == (char)NULL)
+		{
+			bool last = *in == (char)NULL;
+			*out = (char)NULL;
+			SplitCommand(command, result);
+			if(last) break;
+			command = out = in + 1;
+		}
+		else *out++ = *in;
+	}
+}
+
+/*
+ * A string may contain one command per line, or a batch of the form "TS3_BATCH cmd1 ; cmd2 ; cmd3".
+ * An argument in a batch writes a semicolon as ";;", e.g. "TS3_BATCH TS3_AWAY_ZZZ brb;; food ; TS3_OUTPUT_MUTE".
+ */
+static void SplitCommands(char* str, std::vector<Command>& result)
+{
+	char* line = str;
+	while(line != NULL)
+	{
+		// Seperate the next line
+		char* next = strchr(line, '\n');
+		if(next != NULL)
+		{
+			*next = (char)NULL;
+			next++;
+		}
+
+		// Split batches into their commands
+		line = TrimCommand(line);
+		if(!strncmp(line, "TS3_BATCH", 9) && (line[9] == ' ' || line[9] == (char)NULL))
+			SplitBatch(line + 9, result);
+		else SplitCommand(line, result);
+
+		line = next;
+	}
+}
+
+/*
+ * Returns the opcodes of the commands in a string without modifying it, the arguments are neither parsed nor validated.
+ */
+void PeekCommands(const char* str, std::vector<CommandOpcode>& result)
+{
+	std::vector<char> text(str, str + strlen(str) + 1);
+	std::vector<Command> commands;
+	SplitCommands(&text[0], commands);
+	for(std::vector<Command>::iterator it=commands.begin(); it!=commands.end(); it++)
+		result.push_back(it->opcode);
+}
+
+/*
+ * Splits a command string into commands, the string is modified in place and must outlive the result.
+ * Returns false if any of the commands is not recognized or has an invalid argument,
+ * in which case none of them should be executed.
+ */
+bool ParseCommands(char* str, std::vector<Command>& result)
+{
+	SplitCommands(str, result);
+
+	// Validate all commands up front
+	bool valid = true;
+	for(std::vector<Command>::iterator it=result.begin(); it!=result.end(); it++)
+	{
+		if(it->opcode == CMD_UNKNOWN)
+		{
+			ts3Functions.logMessage("Command not recognized:", LogLevel_WARNING, "G-Key Plugin", 0);
+			ts3Functions.logMessage(it->cmd, LogLevel_WARNING, "G-Key Plugin", 0);
+			valid = false;
+		}
+		else if(!ParseArgument(*it))
+		{
+			ts3Functions.logMessage("Missing or invalid argument:", LogLevel_WARNING, "G-Key Plugin", 0);
+			ts3Functions.logMessage(it->cmd, LogLevel_WARNING, "G-Key Plugin", 0);
+			valid = false;
+		}
+	}
+	return valid;
+}
+
+/*
+ * Parses a command string into an action that can be copied and executed without parsing it again.
+ * Returns false if any of the commands is not recognized or has an invalid argument.
+ */
+bool CompileAction(const std::string& str, Action& result)
+{
+	// Parse the commands in place, then store their positions so the action can be copied
+	result.text.assign(str.begin(), str.end());
+	result.text.push_back((char)NULL);
+	result.commands.clear();
+
+	std::vector<Command> commands;
+	if(!ParseCommands(&result.text[0], commands)) return false;
+
+	char* base = &result.text[0];
+	for(std::vector<Command>::iterator it=commands.begin(); it!=commands.end(); it++)
+	{
+		CompiledCommand command;
+		command.opcode = it->opcode;
+		command.cmd = it->cmd - base;
+		command.arg = it->arg != NULL ? it->arg - base : NO_ARGUMENT;
+		command.value = it->value;
+		result.commands.push_back(command);
+	}
+	return true;
+}
+
+/*
+ * Creates the commands of an action, pointing into a copy of its text so commands may modify their arguments.
+ * The text must outlive the result, the optional targets hold one cached target per command.
+ */
+void ExpandAction(const Action& action, std::vector<char>& text, std::vector<Command>& result, ResolvedTarget* targets)
+{
+	text = action.text;
+	char* base = &text[0];
+	for(size_t i=0; i<action.commands.size(); i++)
+	{
+		const CompiledCommand& compiled = action.commands[i];
+		Command command;
+		command.opcode = compiled.opcode;
+		command.cmd = base + compiled.cmd;
+		command.arg = compiled.arg != NO_ARGUMENT ? base + compiled.arg : NULL;
+		command.value = compiled.value;
+		command.target = targets != NULL ? &targets[i] : NULL;
+		result.push_back(command);
+	}
+}
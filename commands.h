@@ -0,0 +1,200 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef COMMANDS_H
+#define COMMANDS_H
+
+#include "public_definitions.h"
+
+#include <vector>
+#include <string>
+
+enum CommandOpcode
+{
+	CMD_UNKNOWN = 0,
+
+	/* Communication */
+	CMD_PTT_ACTIVATE,
+	CMD_PTT_DEACTIVATE,
+	CMD_PTT_TOGGLE,
+	CMD_PTT_ACTIVATE_ALL,
+	CMD_PTT_DEACTIVATE_ALL,
+	CMD_VAD_ACTIVATE,
+	CMD_VAD_DEACTIVATE,
+	CMD_VAD_TOGGLE,
+	CMD_CT_ACTIVATE,
+	CMD_CT_DEACTIVATE,
+	CMD_CT_TOGGLE,
+	CMD_INPUT_MUTE,
+	CMD_INPUT_UNMUTE,
+	CMD_INPUT_TOGGLE,
+	CMD_OUTPUT_MUTE,
+	CMD_OUTPUT_UNMUTE,
+	CMD_OUTPUT_TOGGLE,
+
+	/* Server interaction */
+	CMD_AWAY_ZZZ,
+	CMD_AWAY_NONE,
+	CMD_AWAY_TOGGLE,
+	CMD_GLOBALAWAY_ZZZ,
+	CMD_GLOBALAWAY_NONE,
+	CMD_GLOBALAWAY_TOGGLE,
+	CMD_ACTIVATE_SERVER,
+	CMD_ACTIVATE_SERVERID,
+	CMD_ACTIVATE_SERVERIP,
+	CMD_ACTIVATE_CURRENT,
+	CMD_SERVER_NEXT,
+	CMD_SERVER_PREV,
+	CMD_JOIN_CHANNEL,
+	CMD_JOIN_CHANNELID,
+	CMD_CHANNEL_NEXT,
+	CMD_CHANNEL_PREV,
+	CMD_CHANNEL_PARENT,
+	CMD_CHANNEL_FIRSTCHILD,
+	CMD_CHANNEL_NEXT_SIBLING,
+	CMD_SUBSCRIBE_NEIGHBORHOOD,
+	CMD_SUBSCRIBE_ALL,
+	CMD_KICK_CLIENT,
+	CMD_KICK_CLIENTID,
+	CMD_CHANKICK_CLIENT,
+	CMD_CHANKICK_CLIENTID,
+	CMD_KICK_CLIENTS,
+	CMD_CHANKICK_CLIENTS,
+	CMD_BOOKMARK_CONNECT,
+	CMD_BOOKMARK_CONNECT_GROUP,
+
+	/* Whispering */
+	CMD_WHISPER_ACTIVATE,
+	CMD_WHISPER_DEACTIVATE,
+	CMD_WHISPER_TOGGLE,
+	CMD_WHISPER_CLEAR,
+	CMD_WHISPER_CLIENT,
+	CMD_WHISPER_CLIENTID,
+	CMD_WHISPER_CHANNEL,
+	CMD_WHISPER_CHANNELID,
+	CMD_WHISPER_SUBTREE,
+	CMD_WHISPERGROUP_DEFINE,
+	CMD_WHISPERGROUP_ACTIVATE,
+	CMD_REPLY_ACTIVATE,
+	CMD_REPLY_DEACTIVATE,
+	CMD_REPLY_TOGGLE,
+	CMD_REPLY_CLEAR,
+
+	/* Miscellaneous */
+	CMD_MUTE_CLIENT,
+	CMD_MUTE_CLIENTID,
+	CMD_UNMUTE_CLIENT,
+	CMD_UNMUTE_CLIENTID,
+	CMD_MUTE_TOGGLE_CLIENT,
+	CMD_MUTE_TOGGLE_CLIENTID,
+	CMD_MUTE_CLIENTS,
+	CMD_UNMUTE_CLIENTS,
+	CMD_MUTE_MATCHING,
+	CMD_UNMUTE_MATCHING,
+	CMD_MUTE_CHANNEL,
+	CMD_UNMUTE_CHANNEL,
+	CMD_VOLUME_UP,
+	CMD_VOLUME_DOWN,
+	CMD_VOLUME_SET,
+	CMD_PLUGIN_COMMAND,
+	CMD_STATS,
+	CMD_BENCHMARK_FLOOD,
+
+	/* Key events */
+	CMD_GKEY,
+	CMD_GKEY_DOWN,
+	CMD_GKEY_UP,
+
+	CMD_COUNT
+};
+
+// Argument types, parsed and validated before a command is executed
+enum ArgumentType
+{
+	ARG_NONE = 0, // Any argument is ignored
+	ARG_TEXT, // Free text
+	ARG_PATH, // Channel or bookmark path, or a name
+	ARG_PAIR, // A word followed by free text, split at the first space
+	ARG_UINT64, // Unsigned decimal number
+	ARG_INT, // Unsigned decimal number that fits in an int
+	ARG_FLOAT, // Decimal number
+	ARG_TRAVERSAL, // Channel count followed by a channel filter, both optional
+	ARG_WHISPERGROUP, // Group name followed by a comma separated list of type=value targets
+
+	ARG_OPTIONAL = 0x100 // Combined with a type if the argument may be left out
+};
+
+typedef struct
+{
+	unsigned int count; // Channels to move
+	unsigned int filter; // Filter mask, CHANNEL_FILTER_SETTING if no filter was given
+} TraversalArgument;
+// Whisper group target types
+enum WhisperTargetType
+{
+	WHISPER_TARGET_CLIENT = 0, // client=nickname
+	WHISPER_TARGET_CLIENTID, // clientid=unique identifier
+	WHISPER_TARGET_CHANNEL, // channel=path or name
+	WHISPER_TARGET_CHANNELID // channelid=channel ID
+};
+
+typedef struct
+{
+	WhisperTargetType type;
+	std::string value;
+	uint64 id; // Parsed channel ID of a channelid target
+} WhisperTarget;
+typedef union
+{
+	uint64 integer; // ARG_UINT64 and ARG_INT
+	float real; // ARG_FLOAT
+	size_t offset; // ARG_PAIR and ARG_WHISPERGROUP, offset of the text from the argument
+	TraversalArgument traversal; // ARG_TRAVERSAL
+} ArgumentValue;
+
+#define NO_ARGUMENT ((size_t)-1)
+
+typedef struct
+{
+	uint64 scHandlerID;
+	unsigned long generation; // Generation of the channel or client model the target was resolved against
+	uint64 id; // NULL if not resolved
+} ResolvedTarget;
+typedef struct
+{
+	CommandOpcode opcode;
+	char* cmd;
+	char* arg; // NULL if the command has no argument
+	ArgumentValue value; // Parsed form of the argument
+	ResolvedTarget* target; // Target resolved by an earlier execution of this command, NULL if not cached
+} Command;
+typedef struct
+{
+	CommandOpcode opcode;
+	size_t cmd; // Offset of the command in the action text
+	size_t arg; // Offset of the argument in the action text, NO_ARGUMENT if it has none
+	ArgumentValue value;
+} CompiledCommand;
+typedef struct
+{
+	std::vector<char> text; // NULL-terminated command and argument strings
+	std::vector<CompiledCommand> commands;
+} Action;
+
+CommandOpcode GetCommandOpcode(const char* cmd);
+bool IsFastLaneCommand(CommandOpcode opcode);
+bool IsServerSwitchCommand(CommandOpcode opcode);
+bool IsIdempotentCommand(CommandOpcode opcode);
+bool IsToggleCommand(CommandOpcode opcode);
+CommandOpcode PeekCommand(const char* str, std::string& result);
+void PeekCommands(const char* str, std::vector<CommandOpcode>& result);
+bool ParseWhisperTargets(const char* str, std::vector<WhisperTarget>& result);
+bool ParseCommands(char* str, std::vector<Command>& result);
+bool CompileAction(const std::string& str, Action& result);
+void ExpandAction(const Action& action, std::vector<char>& text, std::vector<Command>& result, ResolvedTarget* targets = NULL);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#include <string.h>
+
+#include "gestures.h"
+
+#include <vector>
+#include <map>
+#include <string>
+
+static const char* gestureNames[GESTURE_COUNT] = { "press", "double_tap", "hold", "long_press", "release" };
+
+GestureEngine::GestureEngine(void)
+	: holdTime(300000),
+	longPressTime(1000000),
+	doubleTapTime(250000)
+{
+	memset(fired, 0, sizeof(fired));
+}
+
+GestureEngine::~GestureEngine(void)
+{
+}
+
+Gesture GestureEngine::GetGesture(const char* name)
+{
+	for(int i=0; i<GESTURE_COUNT; i++)
+		if(!strcmp(name, gestureNames[i])) return (Gesture)i;
+	return GESTURE_COUNT;
+}
+
+const char* GestureEngine::GetGestureName(Gesture gesture)
+{
+	return gesture < GESTURE_COUNT ? gestureNames[gesture] : NULL;
+}
+
+void GestureEngine::Bind(unsigned int key, Gesture gesture, const Action* action)
+{
+	std::map<unsigned int, GestureKey>::iterator it = keys.find(key);
+	if(it == keys.end())
+	{
+		// New key, start from a released state
+		GestureKey state;
+		state.down = state.consumed = state.holdFired = state.longPressFired = state.tapPending = false;
+		state.downTime = state.upTime = 0;
+		for(int i=0; i<GESTURE_COUNT; i++) state.bindings[i] = NULL;
+		it = keys.insert(std::pair<unsigned int, GestureKey>(key, state)).first;
+	}
+	it->second.bindings[gesture] = action;
+}
+
+void GestureEngine::ClearBindings()
+{
+	keys.clear();
+}
+
+void GestureEngine::Fire(GestureKey& key, Gesture gesture, std::vector<const Action*>& actions)
+{
+	fired[gesture]++;
+	if(key.bindings[gesture] != NULL) actions.push_back(key.bindings[gesture]);
+}
+
+void GestureEngine::KeyDown(unsigned int key, long long now, std::vector<const Action*>& actions)
+{
+	std::map<unsigned int, GestureKey>::iterator it = keys.find(key);
+	if(it == keys.end()) return; // Unbound key
+
+	// Ignore auto-repeat
+	GestureKey& state = it->second;
+	if(state.down) return;
+
+	state.down = true;
+	state.downTime = now;
+	state.holdFired = false;
+	state.longPressFired = false;
+
+	// A second tap within the window fires right away, the release is consumed
+	if(state.tapPending && now - state.upTime <= doubleTapTime)
+	{
+		state.tapPending = false;
+		state.consumed = true;
+		Fire(state, GESTURE_DOUBLE_TAP, actions);
+	}
+}
+
+void GestureEngine::KeyUp(unsigned int key, long long now, std::vector<const Action*>& actions)
+{
+	std::map<unsigned int, GestureKey>::iterator it = keys.find(key);
+	if(it == keys.end()) return; // Unbound key
+
+	GestureKey& state = it->second;
+	if(!state.down) return;
+	state.down = false;
+
+	if(state.consumed)
+	{
+		state.consumed = false;
+		return;
+	}
+
+	// End a hold or long-press
+	if(state.holdFired || state.longPressFired)
+	{
+		Fire(state, GESTURE_RELEASE, actions);
+		return;
+	}
+
+	// A short press, wait for a second tap only if one is bound
+	if(state.bindings[GESTURE_DOUBLE_TAP] == NULL) Fire(state, GESTURE_PRESS, actions);
+	else
+	{
+		state.tapPending = true;
+		state.upTime = now;
+	}
+}
+
+void GestureEngine::Update(long long now, std::vector<const Action*>& actions)
+{
+	for(std::map<unsigned int, GestureKey>::iterator it=keys.begin(); it!=keys.end(); it++)
+	{
+		GestureKey& state = it->second;
+		if(state.down && !state.consumed)
+		{
+			// Holds only fire when bound, otherwise the press length doesn't matter
+			if(!state.holdFired && state.bindings[GESTURE_HOLD] != NULL && now - state.downTime >= holdTime)
+			{
+				state.holdFired = true;
+				Fire(state, GESTURE_HOLD, actions);
+			}
+			if(!state.longPressFired && state.bindings[GESTURE_LONG_PRESS] != NULL && now - state.downTime >= longPressTime)
+			{
+				state.longPressFired = true;
+				Fire(state, GESTURE_LONG_PRESS, actions);
+			}
+		}
+		else if(state.tapPending && now - state.upTime > doubleTapTime)
+		{
+			// No second tap followed
+			state.tapPending = false;
+			Fire(state, GESTURE_PRESS, actions);
+		}
+	}
+}
+
+bool GestureEngine::GetNextDeadline(long long& deadline)
+{
+	bool found = false;
+	for(std::map<unsigned int, GestureKey>::iterator it=keys.begin(); it!=keys.end(); it++)
+	{
+		GestureKey& state = it->second;
+		long long due[3];
+		int count = 0;
+
+		if(state.down && !state.consumed)
+		{
+			if(!state.holdFired && state.bindings[GESTURE_HOLD] != NULL) due[count++] = state.downTime + holdTime;
+			if(!state.longPressFired && state.bindings[GESTURE_LONG_PRESS] != NULL) due[count++] = state.downTime + longPressTime;
+		}
+		else if(state.tapPending) due[count++] = state.upTime + doubleTapTime + 1;
+
+		for(int i=0; i<count; i++)
+		{
+			if(!found || due[i] < deadline) deadline = due[i];
+			found = true;
+		}
+	}
+	return found;
+}
@@ -0,0 +1,75 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef GESTURES_H
+#define GESTURES_H
+
+#include "commands.h"
+
+#include <vector>
+#include <map>
+#include <string>
+
+enum Gesture
+{
+	GESTURE_PRESS = 0,
+	GESTURE_DOUBLE_TAP,
+	GESTURE_HOLD,
+	GESTURE_LONG_PRESS,
+	GESTURE_RELEASE, // Key released after a hold or long-press
+
+	GESTURE_COUNT
+};
+
+typedef struct
+{
+	bool down;
+	bool consumed; // The current press already fired a double-tap
+	bool holdFired;
+	bool longPressFired;
+	bool tapPending; // A press waits to see whether a second tap follows
+	long long downTime;
+	long long upTime;
+	const Action* bindings[GESTURE_COUNT]; // NULL if the gesture is not bound
+} GestureKey;
+
+/*
+ * Classifies raw key down and up events into gestures and returns the actions bound to them.
+ * The actions are owned by the caller and must outlive the bindings.
+ *
+ * All times are in microseconds. Gestures that depend on a key not changing, like a hold or
+ * a single press that could still become a double-tap, are fired by Update once their
+ * deadline has passed, the caller schedules it using GetNextDeadline.
+ */
+class GestureEngine
+{
+private:
+	std::map<unsigned int, GestureKey> keys;
+
+	void Fire(GestureKey& key, Gesture gesture, std::vector<const Action*>& actions);
+public:
+	long long holdTime;
+	long long longPressTime;
+	long long doubleTapTime;
+	unsigned long fired[GESTURE_COUNT];
+
+	GestureEngine(void);
+	~GestureEngine(void);
+
+	static Gesture GetGesture(const char* name);
+	static const char* GetGestureName(Gesture gesture);
+
+	void Bind(unsigned int key, Gesture gesture, const Action* action);
+	void ClearBindings();
+
+	void KeyDown(unsigned int key, long long now, std::vector<const Action*>& actions);
+	void KeyUp(unsigned int key, long long now, std::vector<const Action*>& actions);
+	void Update(long long now, std::vector<const Action*>& actions);
+	bool GetNextDeadline(long long& deadline);
+};
+
+#endif
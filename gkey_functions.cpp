@@ -13,20 +13,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <ctype.h>
 
 #include "gkey_functions.h"
+#include "commands.h"
 #include "public_errors.h"
 #include "public_errors_rare.h"
 #include "public_definitions.h"
 #include "public_rare_definitions.h"
 #include "ts3_functions.h"
 #include "plugin.h"
-#include "channel.h"
 
 #include <vector>
 #include <map>
 #include <string>
 #include <sstream>
+#include <algorithm>
+
+// Holds a critical section for the lifetime of the object
+class StateLock
+{
+private:
+	CRITICAL_SECTION* lock;
+public:
+	StateLock(CRITICAL_SECTION* lock) : lock(lock) { EnterCriticalSection(lock); }
+	~StateLock() { LeaveCriticalSection(lock); }
+};
 
 bool GKeyFunctions::CheckAndLog(unsigned int returnCode, char* message)
 {
@@ -45,16 +57,442 @@ bool GKeyFunctions::CheckAndLog(unsigned int returnCode, char* message)
 }
 
 GKeyFunctions::GKeyFunctions(void) : 
-	pttActive(false),
-	vadActive(false),
-	inputActive(false),
 	whisperActive(false),
-	replyActive(false)
+	replyActive(false),
+	replyServer((uint64)NULL),
+	whisperDelay(0),
+	replyExpiry(0),
+	batchActive(false),
+	batchThread(0),
+	activeServer((uint64)NULL),
+	activeServerValid(FALSE),
+	serversValid(FALSE),
+	bookmarksValid(false)
 {
+	InitializeCriticalSection(&stateLock);
+	InitializeCriticalSection(&generationLock);
+	InitializeCriticalSection(&serversLock);
+	memset(&selfStats, 0, sizeof(selfStats));
 }
 
 GKeyFunctions::~GKeyFunctions(void)
 {
+	DeleteCriticalSection(&stateLock);
+	DeleteCriticalSection(&generationLock);
+	DeleteCriticalSection(&serversLock);
+}
+
+bool GKeyFunctions::FlushSelfUpdates(uint64 scHandlerID)
+{
+	StateLock lock(&stateLock);
+
+	// During a batch the flush is deferred until the batch ends, the fast lane always flushes right away
+	if(batchActive && GetCurrentThreadId() == batchThread)
+	{
+		if(std::find(flushPending.begin(), flushPending.end(), scHandlerID) == flushPending.end())
+			flushPending.push_back(scHandlerID);
+		return true;
+	}
+
+	// Nothing changed, so there is nothing to send to the server
+	SelfState& state = selfStates[scHandlerID];
+	if(!state.dirty)
+	{
+		selfStats.suppressedFlushes++;
+		return true;
+	}
+
+	state.dirty = false;
+	selfStats.flushes++;
+	return !CheckAndLog(ts3Functions.flushClientSelfUpdates(scHandlerID, NULL), "Error flushing client updates");
+}
+
+ServerGeneration& GKeyFunctions::GetGeneration(uint64 scHandlerID)
+{
+	// Entries are never removed, so the counters can be used after the lock is released
+	StateLock lock(&generationLock);
+	return generations[scHandlerID];
+}
+
+void GKeyFunctions::InvalidateSelfState(uint64 scHandlerID)
+{
+	// The known values are compared with the client when the self state is used again
+	InterlockedIncrement(&GetGeneration(scHandlerID).self);
+}
+
+void GKeyFunctions::InvalidateConnection(uint64 scHandlerID)
+{
+	// The self and transmission state are forgotten when they're used again
+	InterlockedIncrement(&GetGeneration(scHandlerID).connection);
+}
+
+SelfState& GKeyFunctions::GetSelfState(uint64 scHandlerID)
+{
+	SelfState& state = selfStates[scHandlerID];
+
+	// Catch up with the changes reported by the client callbacks
+	ServerGeneration& generation = GetGeneration(scHandlerID);
+	LONG connection = generation.connection;
+	LONG self = generation.self;
+	if(state.connection != connection)
+	{
+		// Forget the known values, they are read from the client again on the next write
+		state.variables.clear();
+		state.strings.clear();
+	}
+	else if(state.self != self) RefreshSelfState(scHandlerID, state);
+
+	state.connection = connection;
+	state.self = self;
+	return state;
+}
+
+void GKeyFunctions::RefreshSelfState(uint64 scHandlerID, SelfState& state)
+{
+	// Our own flushes also cause update events, so only forget the values that actually changed
+	for(std::map<size_t, int>::iterator it=state.variables.begin(); it!=state.variables.end();)
+	{
+		int value;
+		if(ts3Functions.getClientSelfVariableAsInt(scHandlerID, it->first, &value) != ERROR_ok || value != it->second)
+			state.variables.erase(it++);
+		else it++;
+	}
+
+	for(std::map<size_t, std::string>::iterator it=state.strings.begin(); it!=state.strings.end();)
+	{
+		char* value;
+		if(ts3Functions.getClientSelfVariableAsString(scHandlerID, it->first, &value) != ERROR_ok)
+		{
+			state.strings.erase(it++);
+			continue;
+		}
+
+		bool changed = it->second != value;
+		ts3Functions.freeMemory(value);
+		if(changed) state.strings.erase(it++);
+		else it++;
+	}
+}
+
+bool GKeyFunctions::GetSelfVariableAsInt(uint64 scHandlerID, size_t flag, int& result)
+{
+	StateLock lock(&stateLock);
+	SelfState& state = GetSelfState(scHandlerID);
+	std::map<size_t, int>::iterator known = state.variables.find(flag);
+	if(known != state.variables.end())
+	{
+		result = known->second;
+		return true;
+	}
+
+	if(CheckAndLog(ts3Functions.getClientSelfVariableAsInt(scHandlerID, flag, &result), "Error retrieving client variable"))
+		return false;
+
+	state.variables[flag] = result;
+	return true;
+}
+
+bool GKeyFunctions::SetSelfVariableAsInt(uint64 scHandlerID, size_t flag, int value, char* message)
+{
+	StateLock lock(&stateLock);
+
+	// Skip the write if the client already has this value
+	int current;
+	if(GetSelfVariableAsInt(scHandlerID, flag, current) && current == value)
+	{
+		selfStats.suppressedWrites++;
+		return true;
+	}
+
+	return WriteSelfVariableAsInt(scHandlerID, flag, value, message);
+}
+
+bool GKeyFunctions::WriteSelfVariableAsInt(uint64 scHandlerID, size_t flag, int value, char* message)
+{
+	StateLock lock(&stateLock);
+	SelfState& state = GetSelfState(scHandlerID);
+	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, flag, value), message))
+	{
+		state.variables.erase(flag);
+		return false;
+	}
+
+	state.variables[flag] = value;
+	state.dirty = true;
+	selfStats.writes++;
+	return true;
+}
+
+bool GKeyFunctions::SetSelfVariableAsString(uint64 scHandlerID, size_t flag, const char* value, char* message)
+{
+	StateLock lock(&stateLock);
+	SelfState& state = GetSelfState(scHandlerID);
+	std::map<size_t, std::string>::iterator known = state.strings.find(flag);
+	if(known == state.strings.end())
+	{
+		char* current;
+		if(!CheckAndLog(ts3Functions.getClientSelfVariableAsString(scHandlerID, flag, &current), "Error retrieving client variable"))
+		{
+			known = state.strings.insert(std::pair<size_t,std::string>(flag, current)).first;
+			ts3Functions.freeMemory(current);
+		}
+	}
+
+	// Skip the write if the client already has this value
+	if(known != state.strings.end() && known->second == value)
+	{
+		selfStats.suppressedWrites++;
+		return true;
+	}
+
+	if(CheckAndLog(ts3Functions.setClientSelfVariableAsString(scHandlerID, flag, value), message))
+	{
+		state.strings.erase(flag);
+		return false;
+	}
+
+	state.strings[flag] = value;
+	state.dirty = true;
+	selfStats.writes++;
+	return true;
+}
+
+bool GKeyFunctions::GetPreProcessorValue(uint64 scHandlerID, const char* ident, std::string& result)
+{
+	// The preprocessor has no change events, so its values are never cached
+	char* value;
+	if(CheckAndLog(ts3Functions.getPreProcessorConfigValue(scHandlerID, ident, &value), "Error retrieving preprocessor setting"))
+		return false;
+
+	result = value;
+	ts3Functions.freeMemory(value);
+	return true;
+}
+
+bool GKeyFunctions::SetPreProcessorValue(uint64 scHandlerID, const char* ident, const char* value, char* message)
+{
+	StateLock lock(&stateLock);
+
+	// Skip the write if the preprocessor already has this value
+	std::string current;
+	if(GetPreProcessorValue(scHandlerID, ident, current) && current == value)
+	{
+		selfStats.suppressedWrites++;
+		return true;
+	}
+
+	return WritePreProcessorValue(scHandlerID, ident, value, message);
+}
+
+bool GKeyFunctions::WritePreProcessorValue(uint64 scHandlerID, const char* ident, const char* value, char* message)
+{
+	StateLock lock(&stateLock);
+
+	// The preprocessor is local to the client, it does not need to be flushed
+	if(CheckAndLog(ts3Functions.setPreProcessorConfigValue(scHandlerID, ident, value), message))
+		return false;
+
+	selfStats.writes++;
+	return true;
+}
+
+TransmitState& GKeyFunctions::GetTransmitState(uint64 scHandlerID)
+{
+	std::vector<TransmitState>::iterator it;
+	for(it=transmitStates.begin(); it!=transmitStates.end() && it->scHandlerID != scHandlerID; it++);
+	if(it == transmitStates.end())
+	{
+		TransmitState state;
+		memset(&state, 0, sizeof(state));
+		state.scHandlerID = scHandlerID;
+		transmitStates.push_back(state);
+		it = transmitStates.end() - 1;
+	}
+
+	// Catch up with the changes reported by the client callbacks
+	TransmitState& state = *it;
+	ServerGeneration& generation = GetGeneration(scHandlerID);
+	LONG connection = generation.connection;
+	LONG self = generation.self;
+	if(state.connection != connection)
+	{
+		// The connection was lost, start over with an unknown baseline
+		memset(&state, 0, sizeof(state));
+		state.scHandlerID = scHandlerID;
+		state.connection = connection;
+		state.self = self;
+	}
+	else if(state.self != self && !state.ptt)
+	{
+		// While PTT is held the client doesn't have the baseline, keep the one we know until it's released
+		state.known = false;
+		state.self = self;
+	}
+	return state;
+}
+
+bool GKeyFunctions::LoadTransmitState(TransmitState& state)
+{
+	// Get the current VAD setting
+	std::string vad;
+	if(!GetPreProcessorValue(state.scHandlerID, "vad", vad))
+		return false;
+
+	// Get the current input setting, this will indicate whether VAD is being used in combination with PTT
+	int input;
+	if(!GetSelfVariableAsInt(state.scHandlerID, CLIENT_INPUT_DEACTIVATED, input))
+		return false;
+
+	state.vad = vad == "true";
+	state.input = !input; // We want to know when it is active, not when it is inactive
+	state.ptt = false;
+	state.applied.vad = state.vad;
+	state.applied.input = state.input;
+	state.known = true;
+	ComputeTransmitWrites(state);
+	return true;
+}
+
+void GKeyFunctions::ComputeTransmitWrites(TransmitState& state)
+{
+	TransmitWrite* writes = state.writes;
+
+	// If VAD is active and the input is active, disable VAD while talking, restore the baseline afterwards
+	writes[TRANSMIT_PTT_PRESS].vad = state.vad && !state.input;
+	writes[TRANSMIT_PTT_PRESS].input = true;
+	writes[TRANSMIT_PTT_RELEASE].vad = state.vad;
+	writes[TRANSMIT_PTT_RELEASE].input = state.input;
+
+	// VAD stays disabled while PTT is held
+	writes[TRANSMIT_VAD_ON].vad = !state.ptt;
+	writes[TRANSMIT_VAD_ON].input = true;
+	writes[TRANSMIT_VAD_OFF].vad = false;
+	writes[TRANSMIT_VAD_OFF].input = false;
+
+	// CT only changes the input, which stays active while PTT is held
+	writes[TRANSMIT_CT_ON].vad = state.applied.vad;
+	writes[TRANSMIT_CT_ON].input = true;
+	writes[TRANSMIT_CT_OFF].vad = state.applied.vad;
+	writes[TRANSMIT_CT_OFF].input = state.ptt;
+}
+
+bool GKeyFunctions::ApplyTransmitWrite(TransmitState& state, TransmitTransition transition)
+{
+	// Only the values that change are written, the client is never queried here
+	const TransmitWrite& write = state.writes[transition];
+	if(write.vad != state.applied.vad)
+	{
+		if(!WritePreProcessorValue(state.scHandlerID, "vad", write.vad ? "true" : "false", "Error toggling vad"))
+		{
+			state.known = false;
+			return false;
+		}
+		state.applied.vad = write.vad;
+	}
+	else selfStats.suppressedWrites++;
+
+	if(write.input != state.applied.input)
+	{
+		if(!WriteSelfVariableAsInt(state.scHandlerID, CLIENT_INPUT_DEACTIVATED, write.input ? INPUT_ACTIVE : INPUT_DEACTIVATED, "Error toggling input"))
+		{
+			state.known = false;
+			return false;
+		}
+		state.applied.input = write.input;
+	}
+	else selfStats.suppressedWrites++;
+
+	// Update the client
+	FlushSelfUpdates(state.scHandlerID);
+	return true;
+}
+
+void GKeyFunctions::RefreshTransmitState(uint64 scHandlerID)
+{
+	StateLock lock(&stateLock);
+
+	// While PTT is held the client doesn't have the baseline, keep the one we know
+	TransmitState& state = GetTransmitState(scHandlerID);
+	if(state.ptt) return;
+
+	state.known = false;
+	LoadTransmitState(state);
+}
+
+bool GKeyFunctions::IsPushToTalkActive(uint64 scHandlerID)
+{
+	StateLock lock(&stateLock);
+	return GetTransmitState(scHandlerID).ptt;
+}
+
+bool GKeyFunctions::IsVoiceActivationActive(uint64 scHandlerID)
+{
+	StateLock lock(&stateLock);
+	return GetTransmitState(scHandlerID).vad;
+}
+
+bool GKeyFunctions::IsInputActive(uint64 scHandlerID)
+{
+	StateLock lock(&stateLock);
+	return GetTransmitState(scHandlerID).input;
+}
+
+unsigned long GKeyFunctions::GetChannelGeneration(uint64 scHandlerID)
+{
+	return (unsigned long)GetGeneration(scHandlerID).channels;
+}
+
+unsigned long GKeyFunctions::GetClientGeneration(uint64 scHandlerID)
+{
+	return (unsigned long)GetGeneration(scHandlerID).clients;
+}
+
+unsigned long GKeyFunctions::GetOccupancyGeneration(uint64 scHandlerID)
+{
+	return (unsigned long)GetGeneration(scHandlerID).occupancy;
+}
+
+unsigned long GKeyFunctions::GetSubscriptionGeneration(uint64 scHandlerID)
+{
+	return (unsigned long)GetGeneration(scHandlerID).subscriptions;
+}
+
+void GKeyFunctions::InvalidateChannels(uint64 scHandlerID)
+{
+	InterlockedIncrement(&GetGeneration(scHandlerID).channels);
+}
+
+void GKeyFunctions::InvalidateClients(uint64 scHandlerID)
+{
+	InterlockedIncrement(&GetGeneration(scHandlerID).clients);
+}
+
+void GKeyFunctions::InvalidateOccupancy(uint64 scHandlerID)
+{
+	InterlockedIncrement(&GetGeneration(scHandlerID).occupancy);
+}
+
+void GKeyFunctions::InvalidateSubscriptions(uint64 scHandlerID)
+{
+	InterlockedIncrement(&GetGeneration(scHandlerID).subscriptions);
+}
+
+void GKeyFunctions::BeginBatch()
+{
+	StateLock lock(&stateLock);
+	batchActive = true;
+	batchThread = GetCurrentThreadId();
+}
+
+void GKeyFunctions::EndBatch()
+{
+	StateLock lock(&stateLock);
+	batchActive = false;
+
+	// Send the collected self updates, one flush per server
+	for(std::vector<uint64>::iterator it=flushPending.begin(); it!=flushPending.end(); it++)
+		FlushSelfUpdates(*it);
+	flushPending.clear();
 }
 
 void GKeyFunctions::ErrorMessage(uint64 scHandlerID, char* message)
@@ -90,9 +528,16 @@ uint64 GKeyFunctions::GetActiveServerConnectionHandlerID()
 	uint64* servers;
 	uint64* server;
 	uint64 handle = NULL;
+
+	// Use the cached server if it is still known, an invalidation during the lookup is picked up by the next call
+	StateLock lock(&stateLock);
+	if(InterlockedExchange(&activeServerValid, TRUE)) return activeServer;
 	
 	if(CheckAndLog(ts3Functions.getServerConnectionHandlerList(&servers), "Error retrieving list of servers"))
+	{
+		InterlockedExchange(&activeServerValid, FALSE);
 		return NULL;
+	}
 	
 	// Find the first server that matches the criteria
 	for(server = servers; *server != (uint64)NULL && handle == NULL; server++)
@@ -105,32 +550,111 @@ uint64 GKeyFunctions::GetActiveServerConnectionHandlerID()
 	}
 	
 	ts3Functions.freeMemory(servers);
+	activeServer = handle;
+	if(handle == (uint64)NULL) InterlockedExchange(&activeServerValid, FALSE);
 	return handle;
 }
 
+void GKeyFunctions::InvalidateActiveServer()
+{
+	InterlockedExchange(&activeServerValid, FALSE);
+}
+
 uint64 GKeyFunctions::GetServerHandleByVariable(char* value, size_t flag)
+{
+	if(!RefreshServers()) return (uint64)NULL;
+	StateLock lock(&stateLock);
+
+	// Look the server up in the index of the variable
+	std::map<std::string, uint64>* index;
+	switch(flag)
+	{
+		case VIRTUALSERVER_NAME: index = &serversByName; break;
+		case VIRTUALSERVER_UNIQUE_IDENTIFIER: index = &serversByUID; break;
+		case VIRTUALSERVER_IP: index = &serversByIP; break;
+		default: return (uint64)NULL;
+	}
+
+	std::map<std::string, uint64>::iterator it = index->find(value);
+	return it != index->end() ? it->second : (uint64)NULL;
+}
+
+bool GKeyFunctions::GetServerHandlesByVariable(const std::vector<std::string>& values, size_t flag, std::vector<uint64>& result)
+{
+	if(!RefreshServers()) return false;
+	StateLock lock(&stateLock);
+
+	// Find all connected servers that match any of the values, or all of them if no values are given
+	result.clear();
+	for(std::vector<ServerEntry>::iterator it=servers.begin(); it!=servers.end(); it++)
+	{
+		if(it->status != STATUS_CONNECTION_ESTABLISHED) continue;
+
+		const std::string& variable = flag == VIRTUALSERVER_UNIQUE_IDENTIFIER ? it->uid : (flag == VIRTUALSERVER_IP ? it->ip : it->name);
+		if(values.empty() || std::find(values.begin(), values.end(), variable) != values.end())
+			result.push_back(it->scHandlerID);
+	}
+	return true;
+}
+
+bool GKeyFunctions::GetServerVariable(uint64 scHandlerID, size_t flag, std::string& result)
 {
 	char* variable;
-	uint64* servers;
-	uint64* server;
-	uint64 result;
+	if(CheckAndLog(ts3Functions.getServerVariableAsString(scHandlerID, flag, &variable), "Error retrieving server variable"))
+		return false;
 
-	if(CheckAndLog(ts3Functions.getServerConnectionHandlerList(&servers), "Error retrieving list of servers"))
-		return (uint64)NULL;
-	
-	// Find the first server that matches the criteria
-	for(server = servers, result = (uint64)NULL; *server != (uint64)NULL && result == (uint64)NULL; server++)
+	result = variable;
+	ts3Functions.freeMemory(variable);
+	return true;
+}
+
+bool GKeyFunctions::RefreshServers()
+{
+	// Only one thread refreshes, the others wait for it instead of using the old registry
+	StateLock refresh(&serversLock);
+	if(InterlockedExchange(&serversValid, TRUE)) return true;
+
+	// Read the servers without holding the state lock, the registry is replaced afterwards
+	uint64* list;
+	if(CheckAndLog(ts3Functions.getServerConnectionHandlerList(&list), "Error retrieving list of servers"))
 	{
-		if(!CheckAndLog(ts3Functions.getServerVariableAsString(*server, flag, &variable), "Error retrieving server variable"))
+		InterlockedExchange(&serversValid, FALSE);
+		return false;
+	}
+
+	std::vector<ServerEntry> entries;
+	std::map<std::string, uint64> byName, byUID, byIP;
+	for(uint64* server = list; *server != (uint64)NULL; server++)
+	{
+		ServerEntry entry;
+		entry.scHandlerID = *server;
+		entry.status = GetConnectionStatus(*server);
+		if(entry.status == STATUS_CONNECTION_ESTABLISHED)
 		{
-			// If the variable matches the value set the result, this will end the loop
-			if(!strcmp(value, variable)) result = *server;
-			ts3Functions.freeMemory(variable);
+			GetServerVariable(*server, VIRTUALSERVER_NAME, entry.name);
+			GetServerVariable(*server, VIRTUALSERVER_UNIQUE_IDENTIFIER, entry.uid);
+			GetServerVariable(*server, VIRTUALSERVER_IP, entry.ip);
 		}
+		entries.push_back(entry);
+
+		// If several servers share a variable the first one in tab order wins
+		if(!entry.name.empty()) byName.insert(std::pair<std::string, uint64>(entry.name, *server));
+		if(!entry.uid.empty()) byUID.insert(std::pair<std::string, uint64>(entry.uid, *server));
+		if(!entry.ip.empty()) byIP.insert(std::pair<std::string, uint64>(entry.ip, *server));
 	}
+	ts3Functions.freeMemory(list);
 
-	ts3Functions.freeMemory(servers);
-	return result;
+	StateLock lock(&stateLock);
+	servers.swap(entries);
+	serversByName.swap(byName);
+	serversByUID.swap(byUID);
+	serversByIP.swap(byIP);
+	return true;
+}
+
+void GKeyFunctions::InvalidateServers()
+{
+	InterlockedExchange(&serversValid, FALSE);
 }
 
 uint64 GKeyFunctions::GetChannelIDByVariable(uint64 scHandlerID, char* value, size_t flag)
@@ -165,116 +689,226 @@ anyID GKeyFunctions::GetClientIDByVariable(uint64 scHandlerID, char* value, size
 	anyID* client;
 	anyID result;
 
-	if(CheckAndLog(ts3Functions.getClientList(scHandlerID, &clients), "Error retrieving list of clients"))
-		return (anyID)NULL;
-	
-	// Find the first client that matches the criteria
-	for(client = clients, result = (anyID)NULL; *client != (uint64)NULL && result == (anyID)NULL; client++)
+	if(CheckAndLog(ts3Functions.getClientList(scHandlerID, &clients), "Error retrieving list of clients"))
+		return (anyID)NULL;
+	
+	// Find the first client that matches the criteria
+	for(client = clients, result = (anyID)NULL; *client != (uint64)NULL && result == (anyID)NULL; client++)
+	{
+		if(!CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, *client, flag, &variable), "Error retrieving client variable"))
+		{
+			// If the variable matches the value set the result, this will end the loop
+			if(!strcmp(value, variable)) result = *client;
+			ts3Functions.freeMemory(variable);
+		}
+	}
+	
+	ts3Functions.freeMemory(clients);
+	return result;
+}
+
+bool GKeyFunctions::GetClientIDsByVariable(uint64 scHandlerID, const std::vector<std::string>& values, size_t flag, std::vector<anyID>& result)
+{
+	char* variable;
+	anyID* clients;
+
+	if(CheckAndLog(ts3Functions.getClientList(scHandlerID, &clients), "Error retrieving list of clients"))
+		return false;
+
+	// Find all clients that match any of the values in a single pass over the client list
+	result.clear();
+	for(anyID* client = clients; *client != (anyID)NULL; client++)
+	{
+		if(!CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, *client, flag, &variable), "Error retrieving client variable"))
+		{
+			if(std::find(values.begin(), values.end(), variable) != values.end()) result.push_back(*client);
+			ts3Functions.freeMemory(variable);
+		}
+	}
+
+	ts3Functions.freeMemory(clients);
+	return true;
+}
+
+/*
+ * Matches a string against a pattern ignoring case, '*' matches any sequence of characters and '?' any single character.
+ */
+static bool MatchPattern(const char* pattern, const char* str)
+{
+	const char* star = NULL;
+	const char* retry = NULL;
+	while(*str != '\0')
+	{
+		if(*pattern == '*')
+		{
+			// Remember where the star started, so it can take more characters if the rest doesn't match
+			star = ++pattern;
+			retry = str;
+		}
+		else if(*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*str))
+		{
+			pattern++;
+			str++;
+		}
+		else if(star != NULL)
+		{
+			pattern = star;
+			str = ++retry;
+		}
+		else return false;
+	}
+
+	while(*pattern == '*') pattern++;
+	return *pattern == '\0';
+}
+
+bool GKeyFunctions::GetClientIDsByPattern(uint64 scHandlerID, const char* pattern, size_t flag, std::vector<anyID>& result)
+{
+	char* variable;
+	anyID* clients;
+
+	if(CheckAndLog(ts3Functions.getClientList(scHandlerID, &clients), "Error retrieving list of clients"))
+		return false;
+
+	result.clear();
+	for(anyID* client = clients; *client != (anyID)NULL; client++)
+	{
+		if(!CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, *client, flag, &variable), "Error retrieving client variable"))
+		{
+			if(MatchPattern(pattern, variable)) result.push_back(*client);
+			ts3Functions.freeMemory(variable);
+		}
+	}
+
+	ts3Functions.freeMemory(clients);
+	return true;
+}
+
+bool GKeyFunctions::GetChannelClientIDs(uint64 scHandlerID, const std::vector<std::string>& except, std::vector<anyID>& result)
+{
+	anyID self;
+	uint64 channel;
+	char* variable;
+	anyID* clients;
+
+	if(CheckAndLog(ts3Functions.getClientID(scHandlerID, &self), "Error getting own client id"))
+		return false;
+
+	if(CheckAndLog(ts3Functions.getChannelOfClient(scHandlerID, self, &channel), "Error getting own channel id"))
+		return false;
+
+	if(CheckAndLog(ts3Functions.getChannelClientList(scHandlerID, channel, &clients), "Error retrieving list of channel clients"))
+		return false;
+
+	// Find all other clients in our channel, skipping the excepted nicknames
+	result.clear();
+	for(anyID* client = clients; *client != (anyID)NULL; client++)
 	{
-		if(!CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, *client, flag, &variable), "Error retrieving client variable"))
+		if(*client == self) continue;
+		if(!except.empty() && !CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, *client, CLIENT_NICKNAME, &variable), "Error retrieving client variable"))
 		{
-			// If the variable matches the value set the result, this will end the loop
-			if(!strcmp(value, variable)) result = *client;
+			bool excepted = std::find(except.begin(), except.end(), variable) != except.end();
 			ts3Functions.freeMemory(variable);
+			if(excepted) continue;
 		}
+		result.push_back(*client);
 	}
-	
+
 	ts3Functions.freeMemory(clients);
-	return result;
+	return true;
 }
 
 bool GKeyFunctions::SetPushToTalk(uint64 scHandlerID, bool shouldTalk)
 {
-	// If PTT is inactive, store the current settings
-	if(!pttActive)
-	{
-		// Get the current VAD setting
-		char* vad;
-		if(CheckAndLog(ts3Functions.getPreProcessorConfigValue(scHandlerID, "vad", &vad), "Error retrieving vad setting"))
-			return false;
-		vadActive = !strcmp(vad, "true");
-		ts3Functions.freeMemory(vad);
-		
-		// Get the current input setting, this will indicate whether VAD is being used in combination with PTT
-		int input;
-		if(CheckAndLog(ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_DEACTIVATED, &input), "Error retrieving input setting"))
-			return false;
-		inputActive = !input; // We want to know when it is active, not when it is inactive 
-	}
-	
-	// If VAD is active and the input is active, disable VAD, restore VAD setting afterwards
-	if(CheckAndLog(ts3Functions.setPreProcessorConfigValue(scHandlerID, "vad",
-		(shouldTalk && (vadActive && inputActive)) ? "false" : (vadActive)?"true":"false"), "Error toggling vad"))
-		return false;
+	StateLock lock(&stateLock);
 
-	// Activate the input, restore the input setting afterwards
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_DEACTIVATED, 
-		(shouldTalk || inputActive) ? INPUT_ACTIVE : INPUT_DEACTIVATED), "Error toggling input"))
+	// The baseline is normally known ahead of time, only read it here if it isn't
+	TransmitState& state = GetTransmitState(scHandlerID);
+	if(!state.known && !LoadTransmitState(state))
 		return false;
 
-	// Update the client
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	if(!ApplyTransmitWrite(state, shouldTalk ? TRANSMIT_PTT_PRESS : TRANSMIT_PTT_RELEASE))
+		return false;
 
 	// Commit the change
-	pttActive = shouldTalk;
+	state.ptt = shouldTalk;
+	ComputeTransmitWrites(state);
 
 	return true;
 }
 
+bool GKeyFunctions::SetPushToTalk(const std::vector<uint64>& servers, bool shouldTalk)
+{
+	// Switch all servers under one lock, so they start and stop transmitting together
+	StateLock lock(&stateLock);
+	bool result = true;
+	for(std::vector<uint64>::const_iterator it=servers.begin(); it!=servers.end(); it++)
+	{
+		// Only servers with the capture device open transmit, activating the input on the others has no effect
+		int hardware;
+		if(shouldTalk && (!GetSelfVariableAsInt(*it, CLIENT_INPUT_HARDWARE, hardware) || !hardware)) continue;
+
+		// Releasing is always done, the capture device may have moved while PTT was held
+		if(!SetPushToTalk(*it, shouldTalk)) result = false;
+	}
+
+	return result;
+}
+
 bool GKeyFunctions::SetVoiceActivation(uint64 scHandlerID, bool shouldActivate)
 {
-	// Activate Voice Activity Detection
-	if(CheckAndLog(ts3Functions.setPreProcessorConfigValue(scHandlerID, "vad", (shouldActivate && !pttActive)?"true":"false"), "Error toggling vad"))
-		return false;
+	StateLock lock(&stateLock);
 
-	// Activate the input, restore the input setting afterwards
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_DEACTIVATED, 
-		(shouldActivate) ? INPUT_ACTIVE : INPUT_DEACTIVATED), "Error toggling input"))
+	TransmitState& state = GetTransmitState(scHandlerID);
+	if(!state.known && !LoadTransmitState(state))
 		return false;
 
-	// Update the client
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	if(!ApplyTransmitWrite(state, shouldActivate ? TRANSMIT_VAD_ON : TRANSMIT_VAD_OFF))
+		return false;
 
 	// Commit the change
-	vadActive = shouldActivate;
-	inputActive = shouldActivate;
+	state.vad = shouldActivate;
+	state.input = shouldActivate;
+	ComputeTransmitWrites(state);
 
 	return true;
 }
 
 bool GKeyFunctions::SetContinuousTransmission(uint64 scHandlerID, bool shouldActivate)
 {
-	// Activate the input, restore the input setting afterwards
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_DEACTIVATED, 
-		(shouldActivate || pttActive) ? INPUT_ACTIVE : INPUT_DEACTIVATED), "Error toggling input"))
+	StateLock lock(&stateLock);
+
+	TransmitState& state = GetTransmitState(scHandlerID);
+	if(!state.known && !LoadTransmitState(state))
 		return false;
 
-	// Update the client
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	if(!ApplyTransmitWrite(state, shouldActivate ? TRANSMIT_CT_ON : TRANSMIT_CT_OFF))
+		return false;
 
 	// Commit the change
-	inputActive = shouldActivate;
+	state.input = shouldActivate;
+	ComputeTransmitWrites(state);
 
 	return true;
 }
 
 bool GKeyFunctions::SetInputMute(uint64 scHandlerID, bool shouldMute)
 {
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_MUTED, 
-		shouldMute ? INPUT_DEACTIVATED : INPUT_ACTIVE), "Error toggling input mute"))
+	if(!SetSelfVariableAsInt(scHandlerID, CLIENT_INPUT_MUTED, 
+		shouldMute ? INPUT_DEACTIVATED : INPUT_ACTIVE, "Error toggling input mute"))
 		return false;
 	
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	FlushSelfUpdates(scHandlerID);
 	return true;
 }
 
 bool GKeyFunctions::SetOutputMute(uint64 scHandlerID, bool shouldMute)
 {
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_OUTPUT_MUTED, 
-		shouldMute ? INPUT_DEACTIVATED : INPUT_ACTIVE), "Error toggling output mute"))
+	if(!SetSelfVariableAsInt(scHandlerID, CLIENT_OUTPUT_MUTED, 
+		shouldMute ? INPUT_DEACTIVATED : INPUT_ACTIVE, "Error toggling output mute"))
 		return false;
 	
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	FlushSelfUpdates(scHandlerID);
 	return true;
 }
 
@@ -300,64 +934,113 @@ bool GKeyFunctions::SetGlobalAway(bool isAway, char* msg)
 
 bool GKeyFunctions::SetAway(uint64 scHandlerID, bool isAway, char* msg)
 {
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsInt(scHandlerID, CLIENT_AWAY, 
-		isAway ? AWAY_ZZZ : AWAY_NONE), "Error setting away status"))
+	if(!SetSelfVariableAsInt(scHandlerID, CLIENT_AWAY, 
+		isAway ? AWAY_ZZZ : AWAY_NONE, "Error setting away status"))
 		return false;
 
-	if(CheckAndLog(ts3Functions.setClientSelfVariableAsString(scHandlerID, CLIENT_AWAY_MESSAGE, isAway && msg != NULL ? msg : ""), "Error setting away message"))
+	if(!SetSelfVariableAsString(scHandlerID, CLIENT_AWAY_MESSAGE, isAway && msg != NULL ? msg : "", "Error setting away message"))
 		return false;
 
-	return CheckAndLog(ts3Functions.flushClientSelfUpdates(scHandlerID, NULL), "Error flushing after setting away status");
+	return FlushSelfUpdates(scHandlerID);
 }
 
-bool GKeyFunctions::JoinChannel(uint64 scHandlerID, uint64 channel)
+bool GKeyFunctions::JoinChannel(uint64 scHandlerID, uint64 channel, const char* returnCode)
 {
 	anyID self;
 
 	if(CheckAndLog(ts3Functions.getClientID(scHandlerID, &self), "Error getting own client id"))
 		return false;
 	
-	if(CheckAndLog(ts3Functions.requestClientMove(scHandlerID, self, channel, "", NULL), "Error joining channel"))
+	if(CheckAndLog(ts3Functions.requestClientMove(scHandlerID, self, channel, "", returnCode), "Error joining channel"))
 		return false;
 
 	return true;
 }
 
-bool GKeyFunctions::SetWhisperList(uint64 scHandlerID, bool shouldWhisper)
+bool GKeyFunctions::RequestWhisperList(uint64 scHandlerID, WhisperList targets)
 {
-	WhisperIterator list;
+	// Materialize the target set, the server does not care about the order of the targets
+	std::sort(targets.clients.begin(), targets.clients.end());
+	std::sort(targets.channels.begin(), targets.channels.end());
+
+	// Skip the request if the server already has this exact target set, no entry means no whisper list was sent
+	WhisperIterator sent = whisperSent.find(scHandlerID);
+	if(sent != whisperSent.end())
+	{
+		if(sent->second.clients == targets.clients && sent->second.channels == targets.channels)
+			return true;
+	}
+	else if(targets.clients.empty() && targets.channels.empty()) return true;
 
+	// An empty target set clears the whisper list
+	bool shouldWhisper = !targets.clients.empty() || !targets.channels.empty();
 	if(shouldWhisper)
 	{
-		list = whisperLists.find(scHandlerID);
-		if(list == whisperLists.end()) shouldWhisper = false;
-		else
-		{
-			// Add the NULL-terminator
-			list->second.clients.push_back((anyID)NULL);
-			list->second.channels.push_back((uint64)NULL);
-		}
+		// Add the NULL-terminator
+		targets.clients.push_back((anyID)NULL);
+		targets.channels.push_back((uint64)NULL);
 	}
 
 	/*
 	 * For efficiency purposes I will violate the vector abstraction and give a direct pointer to its internal C array
 	 */
-	if(CheckAndLog(ts3Functions.requestClientSetWhisperList(scHandlerID, (anyID)NULL, shouldWhisper?&list->second.channels[0]:(uint64*)NULL, shouldWhisper?&list->second.clients[0]:(anyID*)NULL, NULL), "Error setting whisper list"))
+	if(CheckAndLog(ts3Functions.requestClientSetWhisperList(scHandlerID, (anyID)NULL, shouldWhisper?&targets.channels[0]:(uint64*)NULL, shouldWhisper?&targets.clients[0]:(anyID*)NULL, NULL), "Error setting whisper list"))
 		return false;
 
+	FlushSelfUpdates(scHandlerID);
+
+	// Remember what the server received
 	if(shouldWhisper)
 	{
 		// Remove the NULL-terminator
-		list->second.clients.pop_back();
-		list->second.channels.pop_back();
+		targets.clients.pop_back();
+		targets.channels.pop_back();
+		whisperSent[scHandlerID] = targets;
 	}
+	else whisperSent.erase(scHandlerID);
 
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
+	return true;
+}
+
+bool GKeyFunctions::SetWhisperList(uint64 scHandlerID, bool shouldWhisper)
+{
+	WhisperList targets;
+
+	if(shouldWhisper)
+	{
+		WhisperIterator list = whisperLists.find(scHandlerID);
+		if(list == whisperLists.end()) shouldWhisper = false;
+		else targets = list->second;
+	}
+
+	// The list is about to be sent, it is no longer pending
+	whisperPending.erase(std::remove(whisperPending.begin(), whisperPending.end(), scHandlerID), whisperPending.end());
+
+	if(!RequestWhisperList(scHandlerID, targets))
+		return false;
+
+	// The plain whisper list replaces any active whisper group
+	activeGroups.erase(scHandlerID);
 	whisperActive = shouldWhisper;
 
 	return true;
 }
 
+bool GKeyFunctions::RestoreWhisperList(uint64 scHandlerID)
+{
+	// Restore the active whisper group if there is one, otherwise the plain whisper list
+	std::map<uint64, std::string>::iterator group = activeGroups.find(scHandlerID);
+	if(group != activeGroups.end()) return WhisperGroupActivate(scHandlerID, group->second);
+	return SetWhisperList(scHandlerID, true);
+}
+
+void GKeyFunctions::QueueWhisperList(uint64 scHandlerID)
+{
+	// Defer the update so consecutive changes are sent as one request
+	if(whisperActive && std::find(whisperPending.begin(), whisperPending.end(), scHandlerID) == whisperPending.end())
+		whisperPending.push_back(scHandlerID);
+}
+
 void GKeyFunctions::WhisperListClear(uint64 scHandlerID)
 {
 	SetWhisperList(scHandlerID, false);
@@ -379,7 +1062,7 @@ void GKeyFunctions::WhisperAddClient(uint64 scHandlerID, anyID client)
 		if(*it == client) return;
 
 	list->second.clients.push_back(client);
-	if(whisperActive) SetWhisperList(scHandlerID, true);
+	QueueWhisperList(scHandlerID);
 }
 
 void GKeyFunctions::WhisperAddChannel(uint64 scHandlerID, uint64 channel)
@@ -397,96 +1080,328 @@ void GKeyFunctions::WhisperAddChannel(uint64 scHandlerID, uint64 channel)
 		if(*it == channel) return;
 
 	list->second.channels.push_back(channel);
-	if(whisperActive) SetWhisperList(scHandlerID, true);
+	QueueWhisperList(scHandlerID);
 }
 
-bool GKeyFunctions::SetReplyList(uint64 scHandlerID, bool shouldReply)
+void GKeyFunctions::WhisperAddChannels(uint64 scHandlerID, std::vector<uint64>& channels)
+{
+	// Find the whisperlist, create it if it doesn't exist
+	std::pair<WhisperIterator,bool> result = whisperLists.insert(std::pair<uint64,WhisperList>(scHandlerID, WhisperList()));
+	WhisperIterator list = result.first;
+
+	// Check for duplicates against a sorted copy, instead of scanning the list for every channel
+	std::vector<uint64> existing(list->second.channels);
+	std::sort(existing.begin(), existing.end());
+	for(std::vector<uint64>::iterator it=channels.begin(); it!=channels.end(); it++)
+		if(!std::binary_search(existing.begin(), existing.end(), *it)) list->second.channels.push_back(*it);
+
+	// All channels are sent in a single request
+	QueueWhisperList(scHandlerID);
+}
+
+void GKeyFunctions::FlushWhisperLists()
+{
+	// Swap the pending list out first, SetWhisperList removes entries from it
+	std::vector<uint64> pending;
+	pending.swap(whisperPending);
+
+	// The reply list takes precedence, it restores the whisper list when it is deactivated
+	for(std::vector<uint64>::iterator it=pending.begin(); it!=pending.end(); it++)
+		if(whisperActive && !replyActive) RestoreWhisperList(*it);
+}
+
+void GKeyFunctions::WhisperReset(uint64 scHandlerID)
+{
+	// The server forgets the whisper list when the connection is lost
+	whisperSent.erase(scHandlerID);
+	whisperPending.erase(std::remove(whisperPending.begin(), whisperPending.end(), scHandlerID), whisperPending.end());
+
+	// Client IDs are no longer valid, whisper groups are resolved again after reconnecting
+	replyList.Clear(scHandlerID);
+	activeGroups.erase(scHandlerID);
+	for(WhisperGroupIterator it=whisperGroups.begin(); it!=whisperGroups.end(); it++)
+		it->second.resolved.erase(scHandlerID);
+}
+
+bool GKeyFunctions::IsWhisperGroupMember(uint64 scHandlerID, WhisperGroup& group, anyID client)
 {
-	ReplyIterator list;
+	char* variable;
+	bool found = false;
 
-	if(shouldReply)
+	if(!group.clientNames.empty() && !CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, client, CLIENT_NICKNAME, &variable), "Error retrieving client variable"))
 	{
-		list = replyLists.find(scHandlerID);
-		if(list == replyLists.end()) shouldReply = false;
-		else
+		found = std::find(group.clientNames.begin(), group.clientNames.end(), variable) != group.clientNames.end();
+		ts3Functions.freeMemory(variable);
+	}
+
+	if(!found && !group.clientUIDs.empty() && !CheckAndLog(ts3Functions.getClientVariableAsString(scHandlerID, client, CLIENT_UNIQUE_IDENTIFIER, &variable), "Error retrieving client variable"))
+	{
+		found = std::find(group.clientUIDs.begin(), group.clientUIDs.end(), variable) != group.clientUIDs.end();
+		ts3Functions.freeMemory(variable);
+	}
+
+	return found;
+}
+
+bool GKeyFunctions::ResolveWhisperGroup(uint64 scHandlerID, WhisperGroup& group)
+{
+	WhisperList targets;
+
+	// Resolve all clients in a single pass over the client list
+	if(!group.clientNames.empty() || !group.clientUIDs.empty())
+	{
+		anyID* clients;
+		if(CheckAndLog(ts3Functions.getClientList(scHandlerID, &clients), "Error retrieving list of clients"))
+			return false;
+
+		for(anyID* client = clients; *client != (anyID)NULL; client++)
+			if(IsWhisperGroupMember(scHandlerID, group, *client)) targets.clients.push_back(*client);
+
+		ts3Functions.freeMemory(clients);
+	}
+
+	// Resolve the channel paths, falling back to the channel name
+	for(std::vector<std::string>::iterator it=group.channelPaths.begin(); it!=group.channelPaths.end(); it++)
+	{
+		// The path is split in place, so work on a copy
+		std::vector<char> path(it->begin(), it->end());
+		path.push_back('\0');
+		uint64 id = GetChannelIDFromPath(scHandlerID, &path[0]);
+		if(id == (uint64)NULL)
 		{
-			// Add the NULL-terminator
-			list->second.push_back((anyID)NULL);
+			std::vector<char> name(it->begin(), it->end());
+			name.push_back('\0');
+			id = GetChannelIDByVariable(scHandlerID, &name[0], CHANNEL_NAME);
 		}
+		if(id != (uint64)NULL && std::find(targets.channels.begin(), targets.channels.end(), id) == targets.channels.end())
+			targets.channels.push_back(id);
 	}
 
-	/*
-	 * For efficiency I will violate the vector abstraction and give a direct pointer to its internal C array
-	 */
-	if(CheckAndLog(ts3Functions.requestClientSetWhisperList(scHandlerID, (anyID)NULL, NULL, shouldReply?&list->second[0]:(anyID*)NULL, NULL), "Error setting reply list"))
+	// Channels that were deleted are left out
+	for(std::vector<uint64>::iterator it=group.channelIDs.begin(); it!=group.channelIDs.end(); it++)
+	{
+		uint64 parent;
+		if(ts3Functions.getParentChannelOfChannel(scHandlerID, *it, &parent) != ERROR_ok) continue;
+		if(std::find(targets.channels.begin(), targets.channels.end(), *it) == targets.channels.end())
+			targets.channels.push_back(*it);
+	}
+
+	group.resolved[scHandlerID] = targets;
+	return true;
+}
+
+bool GKeyFunctions::WhisperGroupDefine(uint64 scHandlerID, std::string name, char* targets)
+{
+	WhisperGroup group;
+
+	// The targets were validated when the command was parsed
+	std::vector<WhisperTarget> parsed;
+	if(!ParseWhisperTargets(targets, parsed)) return false;
+	for(std::vector<WhisperTarget>::iterator it=parsed.begin(); it!=parsed.end(); it++)
+	{
+		switch(it->type)
+		{
+			case WHISPER_TARGET_CLIENT: group.clientNames.push_back(it->value); break;
+			case WHISPER_TARGET_CLIENTID: group.clientUIDs.push_back(it->value); break;
+			case WHISPER_TARGET_CHANNEL: group.channelPaths.push_back(it->value); break;
+			case WHISPER_TARGET_CHANNELID: group.channelIDs.push_back(it->id); break;
+		}
+	}
+
+	// Resolve the group for this server right away, the previous definition is kept if that fails
+	if(!ResolveWhisperGroup(scHandlerID, group))
 		return false;
+	std::swap(whisperGroups[name], group);
+
+	// Servers on which the group is active need the new targets
+	for(std::map<uint64, std::string>::iterator it=activeGroups.begin(); it!=activeGroups.end(); it++)
+		if(it->second == name) QueueWhisperList(it->first);
 
-	if(shouldReply)
+	return true;
+}
+
+bool GKeyFunctions::WhisperGroupActivate(uint64 scHandlerID, std::string name)
+{
+	WhisperGroupIterator group = whisperGroups.find(name);
+	if(group == whisperGroups.end()) return false;
+
+	// The group is only resolved once per server, after that the client events keep it up to date
+	WhisperIterator targets = group->second.resolved.find(scHandlerID);
+	if(targets == group->second.resolved.end())
 	{
-		// Remove the NULL-terminator
-		list->second.pop_back();
+		if(!ResolveWhisperGroup(scHandlerID, group->second))
+			return false;
+		targets = group->second.resolved.find(scHandlerID);
+	}
+
+	// The group is about to be sent, it is no longer pending
+	whisperPending.erase(std::remove(whisperPending.begin(), whisperPending.end(), scHandlerID), whisperPending.end());
+
+	if(!RequestWhisperList(scHandlerID, targets->second))
+		return false;
+
+	activeGroups[scHandlerID] = name;
+	whisperActive = true;
+
+	return true;
+}
+
+void GKeyFunctions::WhisperGroupRefresh(uint64 scHandlerID)
+{
+	for(WhisperGroupIterator group=whisperGroups.begin(); group!=whisperGroups.end(); group++)
+	{
+		// Groups that were never resolved on this server are resolved on activation
+		WhisperIterator targets = group->second.resolved.find(scHandlerID);
+		if(targets == group->second.resolved.end()) continue;
+
+		// Only touch the group if the targets actually changed, a failed resolve keeps the old ones
+		WhisperList previous = targets->second;
+		if(!ResolveWhisperGroup(scHandlerID, group->second)) continue;
+		WhisperList& current = group->second.resolved[scHandlerID];
+		if(current.clients == previous.clients && current.channels == previous.channels) continue;
+
+		// Send the new targets if the group is active on this server
+		std::map<uint64, std::string>::iterator active = activeGroups.find(scHandlerID);
+		if(active != activeGroups.end() && active->second == group->first) QueueWhisperList(scHandlerID);
+	}
+}
+
+bool GKeyFunctions::SetReplyList(uint64 scHandlerID, bool shouldReply)
+{
+	// Restore the whisper list when the reply list is deactivated
+	if(!shouldReply)
+	{
+		replyActive = false;
+		return RestoreWhisperList(scHandlerID);
 	}
 
-	ts3Functions.flushClientSelfUpdates(scHandlerID, NULL);
-	replyActive = shouldReply;
+	// Materialize the clients that whispered to us recently
+	WhisperList targets;
+	replyList.GetClients(scHandlerID, replyExpiry, targets.clients);
+	if(targets.clients.empty()) return SetReplyList(scHandlerID, false);
+
+	if(!RequestWhisperList(scHandlerID, targets))
+		return false;
+
+	replyActive = true;
+	replyServer = scHandlerID;
 
-	if(!shouldReply) return SetWhisperList(scHandlerID, true);
 	return true;
 }
 
 void GKeyFunctions::ReplyListClear(uint64 scHandlerID)
 {
 	SetReplyList(scHandlerID, false);
-	replyLists.erase(scHandlerID);
+	replyList.Clear(scHandlerID);
 }
 
-void GKeyFunctions::ReplyAddClient(uint64 scHandlerID, anyID client)
+bool GKeyFunctions::ReplyAddClient(uint64 scHandlerID, anyID client)
 {
-	// Find the whisperlist, create it if it doesn't exist
-	std::pair<ReplyIterator,bool> result = replyLists.insert(std::pair<uint64,std::vector<anyID>>(scHandlerID, std::vector<anyID>()));
-	ReplyIterator list = result.first;
-	
-	/*
-	 * Do not add if duplicate. I could use a set, but that would be inefficient as
-	 * ordering is unimportant and it would require me to convert to C arrays when
-	 * activating the whisper list.
-	 */
-	for(std::vector<anyID>::iterator it=list->second.begin(); it!=list->second.end(); it++)
-		if(*it == client) return;
+	// Returns true only if the client was not in the list yet, a refresh does not change the targets
+	return replyList.Add(scHandlerID, client);
+}
 
-	list->second.push_back(client);
-	if(replyActive) SetReplyList(scHandlerID, true);
+unsigned long GKeyFunctions::GetReplyExpiry()
+{
+	// Time until a client drops out of the active reply list, 0 if the list doesn't change by itself
+	if(!replyActive) return 0;
+	return replyList.GetNextExpiry(replyServer, replyExpiry);
 }
 
 bool GKeyFunctions::SetActiveServer(uint64 handle)
 {
-	return CheckAndLog(ts3Functions.activateCaptureDevice(handle), "Error activating server");
+	StateLock lock(&stateLock);
+	if(CheckAndLog(ts3Functions.activateCaptureDevice(handle), "Error activating server"))
+	{
+		// The server may have been closed without the registry noticing
+		InterlockedExchange(&activeServerValid, FALSE);
+		InterlockedExchange(&serversValid, FALSE);
+		return false;
+	}
+
+	activeServer = handle;
+	InterlockedExchange(&activeServerValid, TRUE);
+
+	// The capture device is open on this server now, read its transmission baseline ahead of PTT
+	if(!GetTransmitState(handle).known) RefreshTransmitState(handle);
+	return true;
+}
+
+MuteState& GKeyFunctions::GetMuteState(uint64 scHandlerID)
+{
+	// Forget the states recorded before the client IDs may have been reused
+	MuteState& state = muteStates[scHandlerID];
+	unsigned long generation = GetClientGeneration(scHandlerID);
+	if(state.generation != generation)
+	{
+		state.clients.clear();
+		state.generation = generation;
+	}
+	return state;
 }
 
-bool GKeyFunctions::MuteClient(uint64 scHandlerID, anyID client)
+bool GKeyFunctions::IsClientMuted(uint64 scHandlerID, anyID client)
 {
-	if(CheckAndLog(ts3Functions.requestMuteClients(scHandlerID, &client, NULL), "Error muting client"))
+	MuteState& state = GetMuteState(scHandlerID);
+
+	// Our own mutes are known without asking the client to refresh its variables
+	std::map<anyID, bool>::iterator it = state.clients.find(client);
+	if(it != state.clients.end()) return it->second;
+
+	int muted;
+	if(CheckAndLog(ts3Functions.getClientVariableAsInt(scHandlerID, client, CLIENT_IS_MUTED, &muted), "Error retrieving client variable"))
 		return false;
-	
-	return CheckAndLog(ts3Functions.requestClientVariables(scHandlerID, client, NULL), "Error flushing after muting client");
+	state.clients[client] = muted != 0;
+	return muted != 0;
 }
 
-bool GKeyFunctions::UnmuteClient(uint64 scHandlerID, anyID client)
+bool GKeyFunctions::MuteClients(uint64 scHandlerID, std::vector<anyID>& clients, bool mute)
 {
-	if(CheckAndLog(ts3Functions.requestUnmuteClients(scHandlerID, &client, NULL), "Error unmuting client"))
-		return false;
-	
-	return CheckAndLog(ts3Functions.requestClientVariables(scHandlerID, client, NULL), "Error flushing after unmuting client");
+	if(clients.empty()) return true;
+
+	// Send all clients in a single request, the array is terminated by a zero
+	clients.push_back((anyID)NULL);
+	bool result = mute ?
+		!CheckAndLog(ts3Functions.requestMuteClients(scHandlerID, &clients[0], NULL), "Error muting clients") :
+		!CheckAndLog(ts3Functions.requestUnmuteClients(scHandlerID, &clients[0], NULL), "Error unmuting clients");
+	clients.pop_back();
+
+	// Record the new states for the toggles
+	if(result)
+	{
+		MuteState& state = GetMuteState(scHandlerID);
+		for(std::vector<anyID>::iterator it=clients.begin(); it!=clients.end(); it++)
+			state.clients[*it] = mute;
+	}
+	return result;
+}
+
+bool GKeyFunctions::ServerKickClient(uint64 scHandlerID, anyID client, const char* returnCode)
+{
+	return !CheckAndLog(ts3Functions.requestClientKickFromServer(scHandlerID, client, "", returnCode), "Error kicking client from server");
+}
+
+bool GKeyFunctions::ChannelKickClient(uint64 scHandlerID, anyID client, const char* returnCode)
+{
+	return !CheckAndLog(ts3Functions.requestClientKickFromChannel(scHandlerID, client, "", returnCode), "Error kicking client from channel");
 }
 
-bool GKeyFunctions::ServerKickClient(uint64 scHandlerID, anyID client)
+bool GKeyFunctions::SubscribeChannels(uint64 scHandlerID, std::vector<uint64>& channels, bool subscribe)
 {
-	return CheckAndLog(ts3Functions.requestClientKickFromServer(scHandlerID, client, "", NULL), "Error kicking client from server");
+	if(channels.empty()) return true;
+
+	// Send all channels in a single request, the array is terminated by a zero
+	channels.push_back((uint64)NULL);
+	bool result = subscribe ?
+		!CheckAndLog(ts3Functions.requestChannelSubscribe(scHandlerID, &channels[0], NULL), "Error subscribing to channels") :
+		!CheckAndLog(ts3Functions.requestChannelUnsubscribe(scHandlerID, &channels[0], NULL), "Error unsubscribing from channels");
+	channels.pop_back();
+	return result;
 }
 
-bool GKeyFunctions::ChannelKickClient(uint64 scHandlerID, anyID client)
+bool GKeyFunctions::SubscribeAll(uint64 scHandlerID)
 {
-	return CheckAndLog(ts3Functions.requestClientKickFromChannel(scHandlerID, client, "", NULL), "Error kicking client from channel");
+	return !CheckAndLog(ts3Functions.requestChannelSubscribeAll(scHandlerID, NULL), "Error subscribing to all channels");
 }
 
 bool GKeyFunctions::SetMasterVolume(uint64 scHandlerID, float value)
@@ -500,83 +1415,33 @@ bool GKeyFunctions::SetMasterVolume(uint64 scHandlerID, float value)
 	return CheckAndLog(ts3Functions.setPlaybackConfigValue(scHandlerID, "volume_modifier", str), "Error setting master volume");
 }
 
-bool GKeyFunctions::JoinChannelRelative(uint64 scHandlerID, bool next)
-{
-	anyID self;
-	uint64 ownId;
-	Channel root;
-
-	// Get channel hierarchy
-	if(Channel::GetChannelHierarchy(scHandlerID, &root) != 0) return false;
-
-	// Get own channel
-	if(CheckAndLog(ts3Functions.getClientID(scHandlerID, &self), "Error getting own client id"))
-		return false;
-	
-	if(CheckAndLog(ts3Functions.getChannelOfClient(scHandlerID, self, &ownId), "Error getting own channel id"))
-		return false;
-	
-	// Find own channel in hierarchy
-	Channel* channel = root.find(ownId);
-	
-	// Find a joinable channel
-	bool found = false;
-	while(channel != NULL && !found)
-	{
-		if(next)
-		{
-			// If the channel has subchannels, go deeper
-			if(!channel->subchannels.empty()) channel = channel->first();
-			else channel = channel->next();
-		}
-		else channel = channel->prev();
-			
-		// If this channel is passworded, join the next
-		int pswd;
-		CheckAndLog(ts3Functions.getChannelVariableAsInt(scHandlerID, channel->id, CHANNEL_FLAG_PASSWORD, &pswd), "Error getting channel info");
-		if(!pswd) found = true;
-	}
-	if(!found) return false;
-
-	// If a joinable channel was found, attempt to join it
-	return CheckAndLog(ts3Functions.requestClientMove(scHandlerID, self, channel->id, "", NULL), "Error joining channel");
-}
-
 bool GKeyFunctions::SetActiveServerRelative(uint64 scHandlerID, bool next)
 {
-	uint64* servers;
-	uint64* server;
-	int result;
+	// A tab closed since the registry was built fails to activate, the registry is then rebuilt and tried once more
+	for(int attempt=0; attempt<2; attempt++)
+	{
+		if(!RefreshServers()) return false;
 
-	// Get server list
-	if(CheckAndLog(ts3Functions.getServerConnectionHandlerList(&servers), "Error retrieving list of servers"))
-		return false;
+		uint64 server;
+		{
+			StateLock lock(&stateLock);
+			if(servers.empty()) return false;
 
-	// Find active server in the list
-	for(server = servers; *server != (uint64)NULL && *server!=scHandlerID; server++);
+			// Find active server in the list
+			size_t i;
+			for(i=0; i<servers.size() && servers[i].scHandlerID != scHandlerID; i++);
 
-	// Find the server in the direction given
-	if(next)
-	{
-		if(*(server+1) != NULL) server++;
-		else server = servers; // Wrap around to first server
-	}
-	else
-	{
-		if(server != servers) server--;
-		else
-		{
-			for(server = servers; *server != (uint64)NULL; server++);
-			server--;
+			// Find the server in the direction given, wrapping around at the ends
+			if(next) i = (i+1 < servers.size()) ? i+1 : 0;
+			else i = (i > 0) ? i-1 : servers.size()-1;
+			server = servers[i].scHandlerID;
 		}
-	}
 
-	// Check if already active
-	bool ret = !CheckAndLog(ts3Functions.getClientSelfVariableAsInt(*server, CLIENT_INPUT_HARDWARE, &result), "Error retrieving client variable");
-	if(!result) SetActiveServer(*server);
-
-	ts3Functions.freeMemory(servers);
-	return ret;
+		// Check if already active
+		if(server == scHandlerID) return true;
+		if(SetActiveServer(server)) return true;
+	}
+	return false;
 }
 
 uint64 GKeyFunctions::GetChannelIDFromPath(uint64 scHandlerID, char* path)
@@ -609,33 +1474,89 @@ uint64 GKeyFunctions::GetChannelIDFromPath(uint64 scHandlerID, char* path)
 	return parent;
 }
 
-bool GKeyFunctions::ConnectToBookmark(char* label, PluginConnectTab connectTab, uint64* scHandlerID)
+bool GKeyFunctions::RefreshBookmarks()
 {
+	// Only rebuild the index if the bookmarks may have changed since it was built
+	{
+		StateLock lock(&stateLock);
+		if(bookmarksValid) return true;
+		bookmarksValid = true;
+	}
+
 	// Get the bookmark list
 	PluginBookmarkList* bookmarks;
 	if(CheckAndLog(ts3Functions.getBookmarkList(&bookmarks), "Error getting bookmark list"))
+	{
+		InvalidateBookmarks();
 		return false;
+	}
 
-	// Find the bookmark
-	bool ret = true;
-	for(int i=0; i<bookmarks->itemcount; i++)
+	bookmarkIndex.clear();
+	bookmarkFolders.clear();
+	std::vector<std::string> contents;
+	IndexBookmarks(bookmarks, "", contents);
+	ts3Functions.freeMemory(bookmarks);
+	return true;
+}
+
+void GKeyFunctions::IndexBookmarks(PluginBookmarkList* list, const std::string& folder, std::vector<std::string>& contents)
+{
+	for(int i=0; i<list->itemcount; i++)
 	{
-		PluginBookmarkItem item = bookmarks->items[i];
-		
-		// Seems pretty useless to try to connect to a folder, skip it
-		if(!item.isFolder)
+		PluginBookmarkItem& item = list->items[i];
+		std::string path = folder.empty() ? item.name : folder + "/" + item.name;
+
+		// Descend into folders, bookmarks and folders are indexed by both their label and their path
+		if(item.isFolder)
 		{
-			// If the name matches the label we're looking for
-			if(!strcmp(item.name, label))
-			{
-				// Connect to the bookmark
-				ret = !CheckAndLog(ts3Functions.guiConnectBookmark(connectTab, item.uuid, scHandlerID), "Failed to connect to bookmark");
-			}
+			std::vector<std::string> folderContents;
+			if(item.folder != NULL) IndexBookmarks(item.folder, path, folderContents);
+			bookmarkFolders.insert(std::pair<std::string, std::vector<std::string> >(item.name, folderContents));
+			bookmarkFolders.insert(std::pair<std::string, std::vector<std::string> >(path, folderContents));
+		}
+		else
+		{
+			// If several bookmarks share a label the first one wins, the path tells them apart
+			bookmarkIndex.insert(std::pair<std::string, std::string>(item.name, item.uuid));
+			bookmarkIndex.insert(std::pair<std::string, std::string>(path, item.uuid));
+			contents.push_back(item.uuid);
 		}
 	}
-	
-	ts3Functions.freeMemory(bookmarks);
-	return ret;
+}
+
+void GKeyFunctions::InvalidateBookmarks()
+{
+	StateLock lock(&stateLock);
+	bookmarksValid = false;
+}
+
+bool GKeyFunctions::ConnectToBookmark(const char* label, PluginConnectTab connectTab, uint64* scHandlerID)
+{
+	// Find the bookmark
+	RefreshBookmarks();
+	std::map<std::string, std::string>::iterator it = bookmarkIndex.find(label);
+	if(it == bookmarkIndex.end())
+	{
+		ErrorMessage(*scHandlerID, "Bookmark not found");
+		return false;
+	}
+
+	return ConnectToBookmarkID(it->second, connectTab, scHandlerID);
+}
+
+bool GKeyFunctions::ConnectToBookmarkID(const std::string& uuid, PluginConnectTab connectTab, uint64* scHandlerID)
+{
+	return !CheckAndLog(ts3Functions.guiConnectBookmark(connectTab, uuid.c_str(), scHandlerID), "Failed to connect to bookmark");
+}
+
+bool GKeyFunctions::GetBookmarkFolder(const char* folder, std::vector<std::string>& result)
+{
+	RefreshBookmarks();
+	std::map<std::string, std::vector<std::string> >::iterator it = bookmarkFolders.find(folder);
+	if(it == bookmarkFolders.end()) return false;
+
+	result = it->second;
+	return true;
 }
 
 std::string GKeyFunctions::GetDefaultPlaybackProfile()
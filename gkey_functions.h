@@ -8,8 +8,11 @@
 #ifndef FUNCTIONS_H
 #define FUNCTIONS_H
 
+#include <Windows.h>
+
 #include "public_definitions.h"
 #include "plugin_definitions.h"
+#include "reply_list.h"
 
 #include <vector>
 #include <map>
@@ -20,29 +23,178 @@ typedef struct
 	std::vector<anyID> clients;
 	std::vector<uint64> channels;
 } WhisperList;
-typedef std::map<uint64, std::vector<anyID>>::iterator ReplyIterator;
+typedef struct
+{
+	// Target definitions
+	std::vector<std::string> clientNames;
+	std::vector<std::string> clientUIDs;
+	std::vector<std::string> channelPaths;
+	std::vector<uint64> channelIDs;
+
+	// Targets resolved per server
+	std::map<uint64, WhisperList> resolved;
+} WhisperGroup;
+typedef struct
+{
+	// Values the client is known to have, a missing entry is read from the client on first use
+	std::map<size_t, int> variables;
+	std::map<size_t, std::string> strings;
+
+	bool dirty; // Self variables were written since the last flush
+
+	// Server generations the values were read in
+	LONG self;
+	LONG connection;
+} SelfState;
+enum TransmitTransition
+{
+	TRANSMIT_PTT_PRESS = 0,
+	TRANSMIT_PTT_RELEASE,
+	TRANSMIT_VAD_ON,
+	TRANSMIT_VAD_OFF,
+	TRANSMIT_CT_ON,
+	TRANSMIT_CT_OFF,
+
+	TRANSMIT_COUNT
+};
+typedef struct
+{
+	bool vad;
+	bool input;
+} TransmitWrite;
+typedef struct
+{
+	uint64 scHandlerID;
+	bool known; // The baseline has been read from the client
+
+	// Baseline set by VAD and CT, restored when PTT is released
+	bool vad;
+	bool input;
+	bool ptt;
+
+	TransmitWrite applied; // Values the client currently has
+	TransmitWrite writes[TRANSMIT_COUNT]; // Values written by each transition from the current state
+
+	// Server generations the baseline was read in
+	LONG self;
+	LONG connection;
+} TransmitState;
+typedef struct
+{
+	volatile LONG channels; // Names may resolve to different channel IDs
+	volatile LONG clients; // Names may resolve to different client IDs
+	volatile LONG occupancy; // Clients moved between channels, channels may have filled up or emptied
+	volatile LONG subscriptions; // Channels were subscribed or unsubscribed, the tree itself is unchanged
+	volatile LONG self; // Our own variables may have been changed outside of the plugin
+	volatile LONG connection; // The connection was lost, the server no longer has our state
+} ServerGeneration;
+typedef struct
+{
+	std::map<anyID, bool> clients; // Mute state per client, a missing entry is read from the client on first use
+	unsigned long generation; // Client generation the states were recorded in, client IDs may be reused after it changed
+} MuteState;
+typedef struct
+{
+	uint64 scHandlerID;
+	int status;
+
+	// Only known once the connection is established
+	std::string name;
+	std::string uid;
+	std::string ip;
+} ServerEntry;
+typedef struct
+{
+	unsigned long writes;
+	unsigned long suppressedWrites;
+	unsigned long flushes;
+	unsigned long suppressedFlushes;
+} SelfStatistics;
 typedef std::map<uint64, WhisperList>::iterator WhisperIterator;
+typedef std::map<std::string, WhisperGroup>::iterator WhisperGroupIterator;
 
 class GKeyFunctions
 {
 public:
-	/* Push-to-talk */
-	bool pttActive;
-	bool vadActive;
-	bool inputActive;
-
 	/* Whisper lists */
 	bool whisperActive;
 	bool replyActive;
+	uint64 replyServer; // Server the reply list is active on
+	unsigned int whisperDelay; // Coalescing window in milliseconds, 0 sends at the end of each command
+	unsigned int replyExpiry; // Time in milliseconds a whisperer stays in the reply list, 0 never expires
 
 	/* Resources */
 	std::string infoIcon;
 	std::string errorSound;
+
+	/* Statistics */
+	SelfStatistics selfStats;
 private:
 	std::map<uint64, WhisperList> whisperLists;
-	std::map<uint64, std::vector<anyID>> replyLists;
+	ReplyList replyList;
+	std::map<uint64, WhisperList> whisperSent; // Target set the server last received, kept sorted
+	std::vector<uint64> whisperPending; // Servers with whisper list changes that have not been sent
+	std::map<std::string, WhisperGroup> whisperGroups;
+	std::map<uint64, std::string> activeGroups; // Whisper group active on each server
+
+	/* Batches */
+	bool batchActive;
+	DWORD batchThread; // Only flushes from the batching thread are deferred
+	std::vector<uint64> flushPending; // Servers with self updates that still need to be flushed
+
+	/* Self state, shared between the command queue and the PTT fast lane, never locked by client callbacks */
+	CRITICAL_SECTION stateLock;
+	std::map<uint64, SelfState> selfStates;
+	uint64 activeServer; // Cached handle of the server with the active capture device
+	volatile LONG activeServerValid; // Cleared by client callbacks, the handle is looked up again on next use
+	std::vector<TransmitState> transmitStates; // One entry per server, searched linearly
+
+	/* Server generations, bumped by client callbacks while the state lock may be held */
+	CRITICAL_SECTION generationLock; // Only guards the lookup, entries are never removed
+	std::map<uint64, ServerGeneration> generations;
+
+	/* Server registry, guarded by the state lock and replaced as a whole */
+	CRITICAL_SECTION serversLock; // Serializes the refreshes, never taken while holding the state lock
+	volatile LONG serversValid; // Cleared when servers are opened, closed or changed
+	std::vector<ServerEntry> servers; // Open server handlers in tab order
+	std::map<std::string, uint64> serversByName;
+	std::map<std::string, uint64> serversByUID;
+	std::map<std::string, uint64> serversByIP;
+
+	/* Bookmarks, only used by the command thread */
+	bool bookmarksValid; // Guarded by the state lock, cleared when the bookmarks may have changed
+	std::map<std::string, std::string> bookmarkIndex; // Bookmark labels and folder paths, mapped to their UUID
+	std::map<std::string, std::vector<std::string> > bookmarkFolders; // Folder labels and paths, mapped to the UUIDs of their bookmarks
+
+	/* Client mute states, only used by the command thread */
+	std::map<uint64, MuteState> muteStates;
 
 	inline bool CheckAndLog(unsigned int returnCode, char* message = NULL);
+	bool FlushSelfUpdates(uint64 scHandlerID);
+	ServerGeneration& GetGeneration(uint64 scHandlerID);
+	SelfState& GetSelfState(uint64 scHandlerID);
+	void RefreshSelfState(uint64 scHandlerID, SelfState& state);
+	bool GetSelfVariableAsInt(uint64 scHandlerID, size_t flag, int& result);
+	bool SetSelfVariableAsInt(uint64 scHandlerID, size_t flag, int value, char* message);
+	bool WriteSelfVariableAsInt(uint64 scHandlerID, size_t flag, int value, char* message);
+	bool SetSelfVariableAsString(uint64 scHandlerID, size_t flag, const char* value, char* message);
+	bool GetPreProcessorValue(uint64 scHandlerID, const char* ident, std::string& result);
+	bool SetPreProcessorValue(uint64 scHandlerID, const char* ident, const char* value, char* message);
+	bool WritePreProcessorValue(uint64 scHandlerID, const char* ident, const char* value, char* message);
+	TransmitState& GetTransmitState(uint64 scHandlerID);
+	bool LoadTransmitState(TransmitState& state);
+	void ComputeTransmitWrites(TransmitState& state);
+	bool ApplyTransmitWrite(TransmitState& state, TransmitTransition transition);
+	bool RequestWhisperList(uint64 scHandlerID, WhisperList targets);
+	bool RestoreWhisperList(uint64 scHandlerID);
+	void QueueWhisperList(uint64 scHandlerID);
+	bool ResolveWhisperGroup(uint64 scHandlerID, WhisperGroup& group);
+	bool IsWhisperGroupMember(uint64 scHandlerID, WhisperGroup& group, anyID client);
+	MuteState& GetMuteState(uint64 scHandlerID);
+	bool RefreshServers();
+	bool GetServerVariable(uint64 scHandlerID, size_t flag, std::string& result);
+	bool RefreshBookmarks();
+	void IndexBookmarks(PluginBookmarkList* list, const std::string& folder, std::vector<std::string>& contents);
 public:
 	GKeyFunctions(void);
 	~GKeyFunctions(void);
@@ -50,11 +202,42 @@ public:
 	// Error handler
 	void ErrorMessage(uint64 scHandlerID, char* message);
 
+	// Batches
+	void BeginBatch();
+	void EndBatch();
+
+	// Self state, the invalidations are safe to call from client callbacks
+	void InvalidateSelfState(uint64 scHandlerID);
+	void InvalidateConnection(uint64 scHandlerID);
+	void InvalidateActiveServer();
+
+	// Transmission state
+	void RefreshTransmitState(uint64 scHandlerID);
+	bool IsPushToTalkActive(uint64 scHandlerID);
+	bool IsVoiceActivationActive(uint64 scHandlerID);
+	bool IsInputActive(uint64 scHandlerID);
+
+	// Server generations, the invalidations are safe to call from client callbacks
+	unsigned long GetChannelGeneration(uint64 scHandlerID);
+	unsigned long GetClientGeneration(uint64 scHandlerID);
+	unsigned long GetOccupancyGeneration(uint64 scHandlerID);
+	unsigned long GetSubscriptionGeneration(uint64 scHandlerID);
+	void InvalidateChannels(uint64 scHandlerID);
+	void InvalidateClients(uint64 scHandlerID);
+	void InvalidateOccupancy(uint64 scHandlerID);
+	void InvalidateSubscriptions(uint64 scHandlerID);
+	void InvalidateServers();
+	void InvalidateBookmarks();
+
 	// Getters
 	uint64 GetActiveServerConnectionHandlerID(void);
 	uint64 GetServerHandleByVariable(char* value, size_t flag);
+	bool GetServerHandlesByVariable(const std::vector<std::string>& values, size_t flag, std::vector<uint64>& result);
 	uint64 GetChannelIDByVariable(uint64 scHandlerID, char* value, size_t flag);
 	anyID GetClientIDByVariable(uint64 scHandlerID, char* value, size_t flag);
+	bool GetClientIDsByVariable(uint64 scHandlerID, const std::vector<std::string>& values, size_t flag, std::vector<anyID>& result);
+	bool GetClientIDsByPattern(uint64 scHandlerID, const char* pattern, size_t flag, std::vector<anyID>& result);
+	bool GetChannelClientIDs(uint64 scHandlerID, const std::vector<std::string>& except, std::vector<anyID>& result);
 	uint64 GetChannelIDFromPath(uint64 scHandlerID, char* path);
 	std::string GetDefaultPlaybackProfile();
 	std::string GetDefaultCaptureProfile();
@@ -62,6 +245,7 @@ public:
 
 	// Communication
 	bool SetPushToTalk(uint64 scHandlerID, bool shouldTalk);
+	bool SetPushToTalk(const std::vector<uint64>& servers, bool shouldTalk);
 	bool SetVoiceActivation(uint64 scHandlerID, bool shouldActivate);
 	bool SetContinuousTransmission(uint64 scHandlerID, bool shouldActivate);
 	bool SetInputMute(uint64 scHandlerID, bool shouldMute);
@@ -72,29 +256,39 @@ public:
 	void WhisperListClear(uint64 scHandlerID);
 	void WhisperAddClient(uint64 scHandlerID, anyID client);
 	void WhisperAddChannel(uint64 scHandlerID, uint64 channel);
+	void WhisperAddChannels(uint64 scHandlerID, std::vector<uint64>& channels);
+	inline bool IsWhisperPending() { return !whisperPending.empty(); }
+	void FlushWhisperLists();
+	void WhisperReset(uint64 scHandlerID);
+	bool WhisperGroupDefine(uint64 scHandlerID, std::string name, char* targets);
+	bool WhisperGroupActivate(uint64 scHandlerID, std::string name);
+	inline bool HasWhisperGroup(std::string name) { return whisperGroups.find(name) != whisperGroups.end(); }
+	void WhisperGroupRefresh(uint64 scHandlerID);
 	bool SetReplyList(uint64 scHandlerID, bool shouldReply);
 	void ReplyListClear(uint64 scHandlerID);
-	void ReplyAddClient(uint64 scHandlerID, anyID client);
+	bool ReplyAddClient(uint64 scHandlerID, anyID client); // Safe to call without holding the plugin mutex
+	unsigned long GetReplyExpiry();
 
 	// Server interaction
 	bool SetActiveServer(uint64 handle);
 	bool SetAway(uint64 scHandlerID, bool isAway, char* msg = "");
 	bool SetGlobalAway(bool isAway, char* msg = NULL);
-	bool JoinChannel(uint64 scHandlerID, uint64 channel);
-	bool ServerKickClient(uint64 scHandlerID, anyID client);
-	bool ChannelKickClient(uint64 scHandlerID, anyID client);
-	bool JoinChannelRelative(uint64 scHandlerID, bool next);
-	inline bool JoinNextChannel(uint64 scHandlerID) { return JoinChannelRelative(scHandlerID, true); }
-	inline bool JoinPrevChannel(uint64 scHandlerID) { return JoinChannelRelative(scHandlerID, false); }
+	bool JoinChannel(uint64 scHandlerID, uint64 channel, const char* returnCode = NULL);
+	bool ServerKickClient(uint64 scHandlerID, anyID client, const char* returnCode = NULL);
+	bool ChannelKickClient(uint64 scHandlerID, anyID client, const char* returnCode = NULL);
+	bool SubscribeChannels(uint64 scHandlerID, std::vector<uint64>& channels, bool subscribe);
+	bool SubscribeAll(uint64 scHandlerID);
 	bool SetActiveServerRelative(uint64 scHandlerID, bool next);
 	inline bool SetNextActiveServer(uint64 scHandlerID) { return SetActiveServerRelative(scHandlerID, true); }
 	inline bool SetPrevActiveServer(uint64 scHandlerID) { return SetActiveServerRelative(scHandlerID, false); }
-	bool ConnectToBookmark(char* label, PluginConnectTab connectTab, uint64* scHandlerID);
+	bool ConnectToBookmark(const char* label, PluginConnectTab connectTab, uint64* scHandlerID);
+	bool ConnectToBookmarkID(const std::string& uuid, PluginConnectTab connectTab, uint64* scHandlerID);
+	bool GetBookmarkFolder(const char* folder, std::vector<std::string>& result);
 
 	// Miscellaneous
 	bool SetMasterVolume(uint64 scHandlerID, float value);
-	bool MuteClient(uint64 scHandlerID, anyID client);
-	bool UnmuteClient(uint64 scHandlerID, anyID client);
+	bool IsClientMuted(uint64 scHandlerID, anyID client);
+	bool MuteClients(uint64 scHandlerID, std::vector<anyID>& clients, bool mute);
 };
 
 #endif
@@ -24,10 +24,19 @@
 #include "plugin.h"
 #include "gkey_functions.h"
 #include "ts3_settings.h"
+#include "commands.h"
+#include "channel.h"
+#include "gestures.h"
+#include "bindings.h"
+#include "command_cache.h"
+#include "request_scheduler.h"
 
 #include <sstream>
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
 
 struct TS3Functions ts3Functions;
 GKeyFunctions gkeyFunctions;
@@ -41,18 +50,17 @@ TS3Settings ts3Settings;
 #define SERVERINFO_BUFSIZE 256
 #define CHANNELINFO_BUFSIZE 512
 #define RETURNCODE_BUFSIZE 128
-#define REQUESTCLIENTMOVERETURNCODES_SLOTS 5
+#define FILTER_BUFSIZE 128
 
 #define PLUGIN_THREAD_TIMEOUT 1000
 
 #define TIMER_MSEC 10000
 
-/* Array for request client move return codes. See comments within ts3plugin_processCommand for details */
-static char requestClientMoveReturnCodes[REQUESTCLIENTMOVERETURNCODES_SLOTS][RETURNCODE_BUFSIZE];
+#define REQUEST_TIMEOUT 10000000 // Microseconds to wait for the server to answer a request
 
 // Plugin values
 char* pluginID = NULL;
-bool pluginRunning = false;
+bool pluginRunning = false; // Only set by init and shutdown, the worker threads run until the plugin is unloaded
 
 // Error codes
 enum PluginError
@@ -65,6 +73,9 @@ enum PluginError
 
 // Thread handles
 static HANDLE hDebugThread = NULL;
+static HANDLE hTimerThread = NULL;
+static HANDLE hCommandThread = NULL;
+static HANDLE hChannelThread = NULL;
 
 // Mutex handles
 static HANDLE hMutex = NULL;
@@ -73,6 +84,150 @@ static HANDLE hMutex = NULL;
 static HANDLE hPttDelayTimer = (HANDLE)NULL;
 static LARGE_INTEGER dueTime;
 
+// Whisper list coalescing timer
+static HANDLE hWhisperTimer = (HANDLE)NULL;
+static bool whisperTimerArmed = false;
+
+// Signaled when a new client is added to the reply list, the servers it was added on are pending
+static HANDLE hReplyEvent = (HANDLE)NULL;
+static CRITICAL_SECTION csReply;
+static std::vector<uint64> replyPending;
+
+// Signaled when clients join, leave or change their name or channels are deleted, the whisper groups of the changed servers are resolved again
+static HANDLE hWhisperGroupEvent = (HANDLE)NULL;
+static CRITICAL_SECTION csWhisperGroups;
+static std::vector<uint64> whisperGroupsDirty;
+
+// Signaled when a client expires from the active reply list
+static HANDLE hReplyTimer = (HANDLE)NULL;
+
+// Command queue, executed in order by the command thread
+typedef struct
+{
+	std::string str;
+	Action action; // Resumed rest of a batch, executed instead of the string if it has commands
+	const Action* bound; // Action of a key binding, executed instead of the string if not NULL
+	BindingTable* table; // Reference on the table holding the bound action
+	LONGLONG queued; // Performance counter at ingestion
+	bool holds; // Holds the fast lane back until it is executed, see HoldsFastLane
+} QueuedCommand;
+static std::deque<QueuedCommand> commandQueue;
+static CRITICAL_SECTION csCommandQueue;
+static HANDLE hCommandEvent = (HANDLE)NULL;
+static volatile LONG fastLaneHolds = 0; // Queued commands and parked batches the fast lane waits behind
+
+// PTT fast lane, serializes the voice activation commands without waiting for the command mutex
+static CRITICAL_SECTION csFastLane;
+static int pttDelayMsecs = 0; // Cached from the default capture profile
+static std::vector<uint64> pttDelayServers; // Servers on which PTT is released when the delay expires
+
+// Server set for the PTT fan-out, resolved from the configured names when connections change
+static std::vector<std::string> pttServerNames; // All connected servers if empty
+static std::vector<uint64> pttServers;
+
+// Set by the client callbacks, which must not wait for the fast lane, picked up by the next fast lane command
+static volatile LONG pttDelayDirty = FALSE;
+static volatile LONG pttServersDirty = FALSE;
+
+// Latency from ingestion until the command has been executed
+typedef struct
+{
+	unsigned int count;
+	LONGLONG total;
+	LONGLONG max;
+} LatencyStatistics;
+static LatencyStatistics fastLaneLatency;
+static LatencyStatistics queueLatency;
+static LARGE_INTEGER counterFrequency;
+
+// Ingestion debouncer, collapses key repeats and cancels toggle pairs within the window
+typedef struct
+{
+	unsigned long repeats; // Repeated idempotent commands absorbed
+	unsigned long toggles; // Toggles absorbed as cancelling pairs
+} DebounceStatistics;
+static CRITICAL_SECTION csDebounce;
+static HANDLE hDebounceTimer = (HANDLE)NULL;
+static unsigned int debounceWindow = 0; // Window in milliseconds, 0 disables the debouncer
+static std::string debounceLast; // Last idempotent command that was executed
+static DWORD debounceLastTick = 0;
+static std::string debounceToggle; // Toggle held back until the window closes, empty if none
+static DWORD debounceToggleTick = 0;
+static LONGLONG debounceToggleQueued = 0;
+static DebounceStatistics debounceStats;
+
+// Gesture engine, classifies raw key events
+static CRITICAL_SECTION csGestures;
+static HANDLE hGestureTimer = (HANDLE)NULL;
+static GestureEngine gestureEngine;
+static BindingTable* gestureTable = NULL; // Holds the actions bound in the gesture engine, guarded by csGestures
+
+// Changes to the config path, which holds the binding file and the bookmarks
+static HANDLE hConfigChange = (HANDLE)NULL;
+static bool configWatched = false;
+
+// Key bindings, compiled from the binding file and recompiled when it changes
+static CRITICAL_SECTION csBindings;
+static BindingTable* bindingTable = NULL; // Replaced as a whole, take a reference to use it outside of the lock
+static std::string bindingsPath;
+static unsigned int keyMode = 1; // Active M-key mode
+static unsigned long keysDown = 0; // Bitmask of the G-keys that are held down
+static unsigned long keysPending = 0; // Held keys whose own binding waits to see whether they become part of a chord
+static unsigned int chordWindow = 50; // Time in milliseconds to complete a chord, restarted by every press
+static HANDLE hChordTimer = (HANDLE)NULL;
+
+// Bookmark group connects, the bookmarks are connected one by one by the timer thread
+static CRITICAL_SECTION csConnect;
+static HANDLE hConnectTimer = (HANDLE)NULL;
+static unsigned int connectStagger = 250; // Delay in milliseconds between two connects, 0 connects all at once
+static std::deque<std::string> connectQueue; // UUIDs of the bookmarks that still need to be connected
+static std::vector<uint64> connectPending; // Handlers that are still connecting
+static unsigned int connectIssued = 0; // Connects started by the current group, 0 if no group is connecting
+static unsigned int connectFailed = 0;
+static LONGLONG connectStart = 0;
+
+// Moves and kicks are paced to stay below the server's flood protection
+static CRITICAL_SECTION csRequests;
+static HANDLE hRequestTimer = (HANDLE)NULL;
+static RequestScheduler requestScheduler;
+
+// Requests waiting for the server's answer, matched by their return code
+static CRITICAL_SECTION csInFlight;
+static RequestTracker requestTracker;
+static std::string awaitedRequest; // Return code of the move the rest of the batch waits for, only used by the command thread
+static HANDLE hExpiryTimer = (HANDLE)NULL; // Signaled when the oldest request the server hasn't answered expires
+
+// Channel next and previous targets, precomputed by the channel thread whenever the tree or our channel changes
+typedef struct
+{
+	unsigned long generation; // Channel generation the targets were computed against
+	unsigned long occupancy; // Occupancy generation the targets were computed against
+	unsigned long subscriptions; // Subscription generation the targets were computed against
+	uint64 channel; // Own channel the targets are relative to
+	uint64 next; // NULL if there is no joinable channel
+	uint64 prev;
+} ChannelTargets;
+static CRITICAL_SECTION csChannels;
+static HANDLE hChannelEvent = (HANDLE)NULL;
+static std::vector<uint64> channelDirty; // Servers that need their targets computed again
+static std::map<uint64, ChannelTargets> channelTargets;
+static std::map<uint64, ChannelModel*> channelModels; // Built by the channel thread, replaced by pointer
+
+// Servers only subscribed to the neighborhood of our channel, updated by the channel thread
+typedef struct
+{
+	unsigned long generation; // Channel generation the subscriptions were last updated against
+	unsigned long subscriptions; // Subscription generation the subscriptions were last updated against
+	uint64 channel; // Own channel the subscriptions were last updated for, NULL if not yet updated
+	std::vector<uint64> subscribing; // Channels requested but not yet reported by the client, so they aren't requested twice
+	std::vector<uint64> unsubscribing;
+} ChannelNeighborhood;
+static std::map<uint64, ChannelNeighborhood> channelNeighborhoods;
+static unsigned int channelFilter = CHANNEL_FILTER_DEFAULT; // Channels skipped by the traversal unless a command gives its own filter
+
+// Compiled command strings, only used by the command thread
+static CommandCache commandCache;
+
 // Module proc definitions
 typedef const char* (WINAPI *CommandKeywordProc)();
 typedef int (WINAPI *ProcessCommandProc)(uint64, const char*);
@@ -91,7 +246,7 @@ bool IsConnected(uint64 scHandlerID)
 
 inline bool IsArgumentEmpty(uint64 scHandlerID, char* arg)
 {
-	if(arg == NULL && *arg == (char)NULL)
+	if(arg == NULL || *arg == (char)NULL)
 	{
 		gkeyFunctions.ErrorMessage(scHandlerID, "Missing argument");
 		return true;
@@ -101,20 +256,132 @@ inline bool IsArgumentEmpty(uint64 scHandlerID, char* arg)
 
 /*********************************** Plugin callbacks ************************************/
 
-VOID CALLBACK PTTDelayCallback(LPVOID lpArgToCompletionRoutine,DWORD dwTimerLowValue,DWORD dwTimerHighValue)
+void PTTDelayCallback()
 {
-	// Acquire the mutex
-	WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT);
+	// Acquire the fast lane
+	EnterCriticalSection(&csFastLane);
 
 	// Turn off PTT
-	gkeyFunctions.SetPushToTalk(gkeyFunctions.GetActiveServerConnectionHandlerID(), false);
+	gkeyFunctions.SetPushToTalk(pttDelayServers, false);
 	
+	// Release the fast lane
+	LeaveCriticalSection(&csFastLane);
+}
+
+void WhisperTimerCallback()
+{
+	// Acquire the mutex, the window stays open and is retried if it is still held
+	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0)
+	{
+		LARGE_INTEGER whisperDueTime;
+		whisperDueTime.QuadPart = -((LONGLONG)gkeyFunctions.whisperDelay * TIMER_MSEC);
+		SetWaitableTimer(hWhisperTimer, &whisperDueTime, 0, NULL, NULL, FALSE);
+		return;
+	}
+
+	// Send the changes collected during the window
+	gkeyFunctions.FlushWhisperLists();
+	whisperTimerArmed = false;
+
+	// Release the mutex
+	ReleaseMutex(hMutex);
+}
+
+void ScheduleReplyExpiry()
+{
+	// Wake the timer thread when the next client drops out of the active reply list
+	unsigned long expiry = gkeyFunctions.GetReplyExpiry();
+	if(expiry == 0)
+	{
+		CancelWaitableTimer(hReplyTimer);
+		return;
+	}
+
+	LARGE_INTEGER replyDueTime;
+	replyDueTime.QuadPart = -((LONGLONG)expiry * TIMER_MSEC);
+	SetWaitableTimer(hReplyTimer, &replyDueTime, 0, NULL, NULL, FALSE);
+}
+
+void ReplyEventCallback()
+{
+	// Acquire the mutex, the pending servers stay queued for the next event if it is still held
+	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0)
+	{
+		SetEvent(hReplyEvent);
+		return;
+	}
+
+	// Take the servers that received new whisperers
+	std::vector<uint64> pending;
+	EnterCriticalSection(&csReply);
+	pending.swap(replyPending);
+	LeaveCriticalSection(&csReply);
+
+	// Add the new whisperers to the reply list if it is active on the server they whispered on
+	if(gkeyFunctions.replyActive && std::find(pending.begin(), pending.end(), gkeyFunctions.replyServer) != pending.end())
+		gkeyFunctions.SetReplyList(gkeyFunctions.replyServer, true);
+	ScheduleReplyExpiry();
+
+	// Release the mutex
+	ReleaseMutex(hMutex);
+}
+
+void ReplyTimerCallback()
+{
+	// Acquire the mutex
+	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0) return;
+
+	// Send the list without the expired clients, an empty list restores the whisper list
+	if(gkeyFunctions.replyActive)
+		gkeyFunctions.SetReplyList(gkeyFunctions.replyServer, true);
+	ScheduleReplyExpiry();
+
 	// Release the mutex
 	ReleaseMutex(hMutex);
 }
 
 /*********************************** Plugin functions ************************************/
 
+void ScheduleWhisperFlush()
+{
+	// Send the whisper list changes now, or collect them until the coalescing window closes
+	if(gkeyFunctions.IsWhisperPending())
+	{
+		if(gkeyFunctions.whisperDelay == 0) gkeyFunctions.FlushWhisperLists();
+		else if(!whisperTimerArmed)
+		{
+			LARGE_INTEGER whisperDueTime;
+			whisperDueTime.QuadPart = -((LONGLONG)gkeyFunctions.whisperDelay * TIMER_MSEC);
+			whisperTimerArmed = SetWaitableTimer(hWhisperTimer, &whisperDueTime, 0, NULL, NULL, FALSE) != FALSE;
+			if(!whisperTimerArmed) gkeyFunctions.FlushWhisperLists();
+		}
+	}
+}
+
+void WhisperGroupEventCallback()
+{
+	// Acquire the mutex, the changed servers stay queued for the next event if it is still held
+	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0)
+	{
+		SetEvent(hWhisperGroupEvent);
+		return;
+	}
+
+	// Take the servers on which the whisper group members may have changed
+	std::vector<uint64> dirty;
+	EnterCriticalSection(&csWhisperGroups);
+	dirty.swap(whisperGroupsDirty);
+	LeaveCriticalSection(&csWhisperGroups);
+
+	// Resolve the groups again and send the new targets of the active ones
+	for(std::vector<uint64>::iterator it=dirty.begin(); it!=dirty.end(); it++)
+		gkeyFunctions.WhisperGroupRefresh(*it);
+	ScheduleWhisperFlush();
+
+	// Release the mutex
+	ReleaseMutex(hMutex);
+}
+
 bool ExecutePluginCommand(uint64 scHandlerID, char* keyword, char* command)
 {
 	// Get the plugin list
@@ -166,6 +433,54 @@ bool ExecutePluginCommand(uint64 scHandlerID, char* keyword, char* command)
 	return false;
 }
 
+bool LoadSettings()
+{
+	// Find the plugin settings file
+	char path[MAX_PATH];
+	ts3Functions.getConfigPath(path, MAX_PATH);
+	_strcat(path, MAX_PATH, "gkey.ini");
+
+	// Read the settings, missing keys fall back to the defaults
+	gkeyFunctions.whisperDelay = GetPrivateProfileInt("whisper", "coalesce_msecs", 0, path);
+	gkeyFunctions.replyExpiry = GetPrivateProfileInt("reply", "expire_secs", 0, path) * 1000;
+	debounceWindow = GetPrivateProfileInt("debounce", "window_msecs", 0, path);
+	connectStagger = GetPrivateProfileInt("bookmarks", "stagger_msecs", 250, path);
+	chordWindow = GetPrivateProfileInt("bindings", "chord_msecs", 50, path);
+
+	// Read the server's flood budget, a token refills every interval up to the burst size
+	EnterCriticalSection(&csRequests);
+	requestScheduler.interval = (long long)GetPrivateProfileInt("flood", "interval_msecs", 1000, path) * 1000;
+	requestScheduler.burst = GetPrivateProfileInt("flood", "burst", 25, path);
+	LeaveCriticalSection(&csRequests);
+
+	// Read the channels skipped by the channel traversal, names are separated by commas
+	char filter[FILTER_BUFSIZE];
+	GetPrivateProfileString("channels", "skip", "password", filter, FILTER_BUFSIZE, path);
+	if(!ChannelModel::ParseFilter(filter, channelFilter))
+	{
+		ts3Functions.logMessage("Invalid channel filter in gkey.ini", LogLevel_WARNING, "G-Key Plugin", 0);
+		channelFilter = CHANNEL_FILTER_DEFAULT;
+	}
+
+	// Read the gesture timings, the gestures themselves are bound in gkey_bindings.conf
+	EnterCriticalSection(&csGestures);
+	gestureEngine.holdTime = GetPrivateProfileInt("gestures", "hold_msecs", 300, path) * 1000LL;
+	gestureEngine.longPressTime = GetPrivateProfileInt("gestures", "long_press_msecs", 1000, path) * 1000LL;
+	gestureEngine.doubleTapTime = GetPrivateProfileInt("gestures", "double_tap_msecs", 250, path) * 1000LL;
+	LeaveCriticalSection(&csGestures);
+
+	// Split the PTT server set, separated by semicolons
+	char servers[SERVERINFO_BUFSIZE];
+	GetPrivateProfileString("ptt", "servers", "", servers, SERVERINFO_BUFSIZE, path);
+	pttServerNames.clear();
+	std::stringstream ss(servers);
+	std::string name;
+	while(std::getline(ss, name, ';'))
+		if(!name.empty()) pttServerNames.push_back(name);
+
+	return true;
+}
+
 bool SetInfoIcon()
 {
 	// Find the icon pack
@@ -215,33 +530,254 @@ bool SetErrorSound()
 	return true;
 }
 
-bool PTTDelay()
+bool LoadPTTDelay()
 {
-	// Get default capture profile and preprocessor data
+	// Get default capture profile and preprocessor data, cached so releasing PTT doesn't query the database
+	pttDelayMsecs = 0;
 	std::string data;
 	if(!ts3Settings.GetPreProcessorData(gkeyFunctions.GetDefaultCaptureProfile(), data)) return false;
 	if(ts3Settings.GetValueFromData(data, "delay_ptt") != "true") return false;
-	int msecs = atoi(ts3Settings.GetValueFromData(data, "delay_ptt_msecs").c_str());
+	pttDelayMsecs = atoi(ts3Settings.GetValueFromData(data, "delay_ptt_msecs").c_str());
+
+	return true;
+}
+
+// Forgets the held keys, csBindings must be held
+void ResetKeys()
+{
+	keysDown = 0;
+	keysPending = 0;
+	CancelWaitableTimer(hChordTimer);
+}
+
+bool LoadBindings()
+{
+	// Compile outside of the lock, lookups only wait for the pointer to be replaced
+	BindingTable* table = new BindingTable();
+	bool result = table->Load(bindingsPath.c_str());
+
+	EnterCriticalSection(&csBindings);
+	BindingTable* previous = bindingTable;
+	bindingTable = table;
+	ResetKeys();
+	LeaveCriticalSection(&csBindings);
+
+	// The gesture bindings live in the same file, the engine keeps a reference to the table holding their actions
+	const std::vector<GestureBinding>& gestures = table->GetGestures();
+	table->AddRef();
+	EnterCriticalSection(&csGestures);
+	BindingTable* previousGestures = gestureTable;
+	gestureTable = table;
+	gestureEngine.ClearBindings();
+	for(std::vector<GestureBinding>::const_iterator it=gestures.begin(); it!=gestures.end(); it++)
+		gestureEngine.Bind(it->key, it->gesture, &it->action);
+	LeaveCriticalSection(&csGestures);
+	if(previousGestures != NULL) previousGestures->Release();
+
+	// Presses still using the previous table keep it alive until they're done
+	if(previous != NULL) previous->Release();
+
+	if(result) ts3Functions.logMessage("Key bindings loaded", LogLevel_INFO, "G-Key Plugin", 0);
+	return result;
+}
+
+void ConfigChangeCallback()
+{
+	// The settings database holding the bookmarks may have been written, index them again when they're used
+	FindNextChangeNotification(hConfigChange);
+	gkeyFunctions.InvalidateBookmarks();
+
+	// Only recompile the bindings if it was the binding file that was written
+	EnterCriticalSection(&csBindings);
+	bool changed = bindingTable == NULL || bindingTable->HasChanged(bindingsPath.c_str());
+	LeaveCriticalSection(&csBindings);
+
+	if(changed) LoadBindings();
+}
+
+void ResolvePTTServers()
+{
+	// Acquire the fast lane
+	EnterCriticalSection(&csFastLane);
 
+	// Resolve the server set once per change, so the fan-out doesn't have to
+	gkeyFunctions.GetServerHandlesByVariable(pttServerNames, VIRTUALSERVER_NAME, pttServers);
+
+	// Release the fast lane
+	LeaveCriticalSection(&csFastLane);
+}
+
+bool PTTDelay()
+{
 	// If a delay is configured, set the PTT delay timer
-	if(msecs > 0)
+	if(pttDelayMsecs > 0)
 	{
-		dueTime.QuadPart = -(msecs * TIMER_MSEC);
-		SetWaitableTimer(hPttDelayTimer, &dueTime, 0, PTTDelayCallback, NULL, FALSE);
-		return true;
+		dueTime.QuadPart = -((LONGLONG)pttDelayMsecs * TIMER_MSEC);
+		return SetWaitableTimer(hPttDelayTimer, &dueTime, 0, NULL, NULL, FALSE) != FALSE;
 	}
 
 	return false;
 }
 
-void ParseCommand(char* cmd, char* arg)
+void RecordLatency(LatencyStatistics& stats, LONGLONG start)
 {
-	// Acquire the mutex
-	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0)
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	LONGLONG elapsed = now.QuadPart - start;
+	stats.count++;
+	stats.total += elapsed;
+	if(elapsed > stats.max) stats.max = elapsed;
+}
+
+void PrintLatency(std::stringstream& ss, const char* name, const LatencyStatistics& stats)
+{
+	// Convert the performance counter ticks to microseconds
+	LONGLONG average = stats.count > 0 ? stats.total / stats.count : 0;
+	ss << "\n" << name << ": " << stats.count << " commands, "
+		<< average * 1000000 / counterFrequency.QuadPart << " us average, "
+		<< stats.max * 1000000 / counterFrequency.QuadPart << " us max";
+}
+
+void PrintStatistics()
+{
+	// Copy the fast lane statistics, they are updated outside of the command mutex
+	EnterCriticalSection(&csFastLane);
+	LatencyStatistics fastLane = fastLaneLatency;
+	LeaveCriticalSection(&csFastLane);
+
+	std::stringstream ss;
+	ss << "[b]G-Key statistics[/b]";
+	ss << "\nSelf updates: " << gkeyFunctions.selfStats.writes << " written, " << gkeyFunctions.selfStats.suppressedWrites << " suppressed";
+	ss << "\nFlushes: " << gkeyFunctions.selfStats.flushes << " sent, " << gkeyFunctions.selfStats.suppressedFlushes << " suppressed";
+	PrintLatency(ss, "Fast lane", fastLane);
+	PrintLatency(ss, "Command queue", queueLatency);
+
+	EnterCriticalSection(&csDebounce);
+	ss << "\nDebouncer: " << debounceStats.repeats << " repeats absorbed, " << debounceStats.toggles << " toggles cancelled";
+	LeaveCriticalSection(&csDebounce);
+
+	EnterCriticalSection(&csGestures);
+	ss << "\nGestures:";
+	for(int i=0; i<GESTURE_COUNT; i++)
+		ss << (i ? ", " : " ") << gestureEngine.fired[i] << " " << GestureEngine::GetGestureName((Gesture)i);
+	LeaveCriticalSection(&csGestures);
+
+	ss << "\nCommand cache: " << commandCache.hits << " hits, " << commandCache.misses << " misses";
+
+	EnterCriticalSection(&csRequests);
+	SchedulerStatistics& requests = requestScheduler.stats;
+	ss << "\nRequests: " << requests.sent[PRIORITY_INTERACTIVE] << " interactive, " << requests.sent[PRIORITY_BULK] << " bulk sent, "
+		<< requests.delayed << " delayed, " << requestScheduler.GetQueued() << " queued, " << requests.dropped << " dropped, "
+		<< "longest wait " << requests.maxWait / 1000 << " ms";
+	LeaveCriticalSection(&csRequests);
+
+	EnterCriticalSection(&csInFlight);
+	TrackerStatistics& answers = requestTracker.stats;
+	unsigned long answered = answers.completed + answers.failed;
+	ss << "\nServer answers: " << answers.completed << " succeeded, " << answers.failed << " failed, " << answers.expired << " expired, "
+		<< requestTracker.GetPending() << " pending, round trip " << (answered ? answers.totalRoundTrip / answered / 1000 : 0) << " ms average, "
+		<< answers.maxRoundTrip / 1000 << " ms max";
+	LeaveCriticalSection(&csInFlight);
+	ts3Functions.printMessageToCurrentTab(ss.str().c_str());
+}
+
+void BenchmarkFlood(uint64 scHandlerID, int scans)
+{
+	// Only report the fast lane commands handled during the flood
+	EnterCriticalSection(&csFastLane);
+	LatencyStatistics before = fastLaneLatency;
+	fastLaneLatency.max = 0;
+	LeaveCriticalSection(&csFastLane);
+
+	// Occupy the command thread with channel scans, use PTT meanwhile to measure its latency
+	LARGE_INTEGER start, end;
+	QueryPerformanceCounter(&start);
+	int i;
+	for(i=0; i<scans && pluginRunning; i++)
+	{
+		Channel root;
+		Channel::GetChannelHierarchy(scHandlerID, &root);
+	}
+	QueryPerformanceCounter(&end);
+
+	EnterCriticalSection(&csFastLane);
+	LatencyStatistics during = fastLaneLatency;
+	if(before.max > fastLaneLatency.max) fastLaneLatency.max = before.max;
+	LeaveCriticalSection(&csFastLane);
+	during.count -= before.count;
+	during.total -= before.total;
+
+	std::stringstream ss;
+	ss << "[b]G-Key benchmark[/b]";
+	ss << "\nFlood: " << i << " channel scans in " << (end.QuadPart - start.QuadPart) * 1000 / counterFrequency.QuadPart << " ms";
+	PrintLatency(ss, "Fast lane during flood", during);
+	ts3Functions.printMessageToCurrentTab(ss.str().c_str());
+}
+
+// Defined with the key bindings
+void ExecuteBoundAction(BindingTable* table, const Action* action, LONGLONG start);
+
+// Defined with the command queue
+void RouteCommand(const char* str, LONGLONG start);
+void PushCommand(QueuedCommand& queued, bool front = false);
+void ResumeBatch(const Action& continuation, bool success);
+
+LONGLONG GetMicroseconds()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+
+	// Split the conversion so the multiplication can't overflow
+	return (now.QuadPart / counterFrequency.QuadPart) * 1000000
+		+ (now.QuadPart % counterFrequency.QuadPart) * 1000000 / counterFrequency.QuadPart;
+}
+
+void ScheduleGestures(LONGLONG now)
+{
+	// Set the gesture timer to the next hold, long-press or double-tap deadline
+	LONGLONG deadline;
+	if(gestureEngine.GetNextDeadline(deadline))
 	{
-		ts3Functions.logMessage("Timeout while waiting for mutex", LogLevel_WARNING, "G-Key Plugin", 0);
-		return;
+		LARGE_INTEGER gestureDueTime;
+		gestureDueTime.QuadPart = deadline > now ? -((deadline - now) * 10) : -1;
+		SetWaitableTimer(hGestureTimer, &gestureDueTime, 0, NULL, NULL, FALSE);
 	}
+	else CancelWaitableTimer(hGestureTimer);
+}
+
+void GestureTimerCallback()
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	// Acquire the gesture engine
+	std::vector<const Action*> actions;
+	EnterCriticalSection(&csGestures);
+
+	// Fire the gestures whose deadline has passed, each action keeps the table alive
+	LONGLONG now = GetMicroseconds();
+	gestureEngine.Update(now, actions);
+	ScheduleGestures(now);
+	BindingTable* table = gestureTable;
+	for(size_t i=0; i<actions.size(); i++) table->AddRef();
+
+	// Release the gesture engine
+	LeaveCriticalSection(&csGestures);
+
+	// Execute the actions bound to the gestures
+	for(std::vector<const Action*>::iterator it=actions.begin(); it!=actions.end(); it++)
+		ExecuteBoundAction(table, *it, start.QuadPart);
+}
+
+void ExecuteFastLane(Command& command)
+{
+	// Acquire the fast lane
+	EnterCriticalSection(&csFastLane);
+
+	// Pick up the changes reported by the client callbacks
+	if(InterlockedExchange(&pttDelayDirty, FALSE)) LoadPTTDelay();
+	if(InterlockedExchange(&pttServersDirty, FALSE)) ResolvePTTServers();
 
 	// Get the active server
 	uint64 scHandlerID = gkeyFunctions.GetActiveServerConnectionHandlerID();
@@ -251,457 +787,1667 @@ void ParseCommand(char* cmd, char* arg)
 		scHandlerID = ts3Functions.getCurrentServerConnectionHandlerID();
 	}
 
-	/***** Communication *****/
-	if(!strcmp(cmd, "TS3_PTT_ACTIVATE"))
+	switch(command.opcode)
 	{
-		if(IsConnected(scHandlerID))
-		{
+		case CMD_PTT_ACTIVATE:
+			if(IsConnected(scHandlerID))
+			{
+				CancelWaitableTimer(hPttDelayTimer);
+				gkeyFunctions.SetPushToTalk(scHandlerID, true);
+			}
+			break;
+		case CMD_PTT_DEACTIVATE:
+			if(IsConnected(scHandlerID))
+			{
+				pttDelayServers.assign(1, scHandlerID);
+				if(!PTTDelay()) // If no delay is configured
+					gkeyFunctions.SetPushToTalk(scHandlerID, false);
+			}
+			break;
+		case CMD_PTT_ACTIVATE_ALL:
 			CancelWaitableTimer(hPttDelayTimer);
-			gkeyFunctions.SetPushToTalk(scHandlerID, true);
-		}
+			gkeyFunctions.SetPushToTalk(pttServers, true);
+			break;
+		case CMD_PTT_DEACTIVATE_ALL:
+			pttDelayServers = pttServers;
+			if(!PTTDelay()) // If no delay is configured
+				gkeyFunctions.SetPushToTalk(pttServers, false);
+			break;
+		case CMD_PTT_TOGGLE:
+			if(IsConnected(scHandlerID))
+			{
+				bool talking = gkeyFunctions.IsPushToTalkActive(scHandlerID);
+				if(talking) CancelWaitableTimer(hPttDelayTimer);
+				gkeyFunctions.SetPushToTalk(scHandlerID, !talking);
+			}
+			break;
+		case CMD_VAD_ACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetVoiceActivation(scHandlerID, true);
+			break;
+		case CMD_VAD_DEACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetVoiceActivation(scHandlerID, false);
+			break;
+		case CMD_VAD_TOGGLE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetVoiceActivation(scHandlerID, !gkeyFunctions.IsVoiceActivationActive(scHandlerID));
+			break;
+		case CMD_CT_ACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetContinuousTransmission(scHandlerID, true);
+			break;
+		case CMD_CT_DEACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetContinuousTransmission(scHandlerID, false);
+			break;
+		case CMD_CT_TOGGLE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetContinuousTransmission(scHandlerID, !gkeyFunctions.IsInputActive(scHandlerID));
+			break;
+	}
+
+	// Release the fast lane
+	LeaveCriticalSection(&csFastLane);
+}
+
+// Executes a compiled action, the caller passes on a reference to the table holding it
+void ExecuteBoundAction(BindingTable* table, const Action* action, LONGLONG start)
+{
+	// A single voice activation command runs on the fast lane, unless a command queued before it has to run first
+	if(action->commands.size() == 1 && IsFastLaneCommand(action->commands.front().opcode) && !fastLaneHolds)
+	{
+		std::vector<char> text;
+		std::vector<Command> commands;
+		ExpandAction(*action, text, commands);
+
+		EnterCriticalSection(&csFastLane);
+		ExecuteFastLane(commands.front());
+		RecordLatency(fastLaneLatency, start);
+		LeaveCriticalSection(&csFastLane);
+		table->Release();
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_PTT_DEACTIVATE"))
+
+	// Everything else is executed in order by the command thread, the reference is passed on with the action
+	QueuedCommand queued;
+	queued.bound = action;
+	queued.table = table;
+	queued.queued = start;
+	PushCommand(queued);
+}
+
+void ExecuteBinding(unsigned int mode, unsigned long keys, LONGLONG start)
+{
+	// Look up the compiled action, in the active mode if none is given
+	EnterCriticalSection(&csBindings);
+	BindingTable* table = bindingTable;
+	const Action* action = table != NULL ? table->GetAction(mode != 0 ? mode : keyMode, keys) : NULL;
+	if(action != NULL) table->AddRef();
+	LeaveCriticalSection(&csBindings);
+
+	if(action == NULL)
 	{
-		if(IsConnected(scHandlerID))
+		ts3Functions.logMessage("Key not bound", LogLevel_DEBUG, "G-Key Plugin", 0);
+		return;
+	}
+
+	ExecuteBoundAction(table, action, start);
+}
+
+void HandleBinding(const char* arg, LONGLONG start)
+{
+	// Accept "5", "G5" and "M2 G5"
+	unsigned int mode = 0;
+	if(arg == NULL) return;
+	if(*arg == 'M' || *arg == 'm')
+	{
+		const char* key = strchr(arg, ' ');
+		mode = ParseBindingNumber((key != NULL ? std::string(arg+1, key) : std::string(arg+1)).c_str(), BINDING_MODES);
+		if(key == NULL || mode == 0)
 		{
-			if(!PTTDelay()) // If query failed
-				gkeyFunctions.SetPushToTalk(scHandlerID, false);
+			ts3Functions.logMessage("Invalid key", LogLevel_WARNING, "G-Key Plugin", 0);
+			return;
 		}
+		arg = key;
+		while(*arg == ' ') arg++;
 	}
-	else if(!strcmp(cmd, "TS3_PTT_TOGGLE"))
+	if(*arg == 'G' || *arg == 'g') arg++;
+
+	unsigned int key = ParseBindingNumber(arg, BINDING_KEYS);
+	if(key != 0) ExecuteBinding(mode, 1UL << (key-1), start);
+	else ts3Functions.logMessage("Invalid key", LogLevel_WARNING, "G-Key Plugin", 0);
+}
+
+void HandleKeyEvent(CommandOpcode opcode, const char* arg)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	// M-keys switch the binding mode
+	if(arg == NULL) return;
+	if(*arg == 'M' || *arg == 'm')
 	{
-		if(IsConnected(scHandlerID))
+		unsigned int mode = ParseBindingNumber(arg+1, BINDING_MODES);
+		if(mode == 0) ts3Functions.logMessage("Invalid key", LogLevel_WARNING, "G-Key Plugin", 0);
+		else if(opcode == CMD_GKEY_DOWN)
 		{
-			if(gkeyFunctions.pttActive) CancelWaitableTimer(hPttDelayTimer);
-			gkeyFunctions.SetPushToTalk(scHandlerID, !gkeyFunctions.pttActive);
+			EnterCriticalSection(&csBindings);
+			keyMode = mode;
+			ResetKeys();
+			LeaveCriticalSection(&csBindings);
 		}
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_VAD_ACTIVATE"))
+
+	// Accept both "5" and "G5"
+	if(*arg == 'G' || *arg == 'g') arg++;
+	unsigned int key = ParseBindingNumber(arg, BINDING_KEYS);
+	if(key == 0)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetVoiceActivation(scHandlerID, true);
+		ts3Functions.logMessage("Invalid key", LogLevel_WARNING, "G-Key Plugin", 0);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_VAD_DEACTIVATE"))
+
+	// Track the held keys, a press runs the binding for the chord they form
+	unsigned long bit = 1UL << (key-1);
+	unsigned long fire = 0;
+	EnterCriticalSection(&csBindings);
+	if(opcode == CMD_GKEY_DOWN)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetVoiceActivation(scHandlerID, false);
+		// A key that is already down missed its release, so the other held keys can't be trusted either
+		if(keysDown & bit) ResetKeys();
+		keysDown |= bit;
+
+		if((keysDown & (keysDown-1)) && bindingTable != NULL && bindingTable->GetAction(keyMode, keysDown) != NULL)
+		{
+			// The chord replaces the bindings of its keys that were still waiting
+			fire = keysDown;
+			keysPending &= ~keysDown;
+		}
+		else if(chordWindow > 0 && bindingTable != NULL && (bindingTable->GetChordKeys(keyMode) & bit))
+		{
+			// The key may still become part of a chord, its own binding waits for the chord window or its release
+			LARGE_INTEGER chordDueTime;
+			chordDueTime.QuadPart = -((LONGLONG)chordWindow * TIMER_MSEC);
+			if(SetWaitableTimer(hChordTimer, &chordDueTime, 0, NULL, NULL, FALSE)) keysPending |= bit;
+			else fire = bit;
+		}
+		else fire = bit; // Also used when the held keys don't form a bound chord
 	}
-	else if(!strcmp(cmd, "TS3_VAD_TOGGLE"))
+	else
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetVoiceActivation(scHandlerID, !gkeyFunctions.vadActive);
+		// A key released within the chord window still runs its own binding
+		if(keysPending & bit) fire = bit;
+		keysDown &= ~bit;
+		keysPending &= ~bit;
 	}
-	else if(!strcmp(cmd, "TS3_CT_ACTIVATE"))
+	LeaveCriticalSection(&csBindings);
+
+	if(fire != 0) ExecuteBinding(0, fire, start.QuadPart);
+
+	// Acquire the gesture engine
+	std::vector<const Action*> actions;
+	EnterCriticalSection(&csGestures);
+
+	LONGLONG now = GetMicroseconds();
+	if(opcode == CMD_GKEY_DOWN) gestureEngine.KeyDown(key, now, actions);
+	else gestureEngine.KeyUp(key, now, actions);
+	ScheduleGestures(now);
+	BindingTable* table = gestureTable;
+	for(size_t i=0; i<actions.size(); i++) table->AddRef();
+
+	// Release the gesture engine
+	LeaveCriticalSection(&csGestures);
+
+	// Execute the actions bound to the gestures, keys with gesture bindings have no key bindings
+	for(std::vector<const Action*>::iterator it=actions.begin(); it!=actions.end(); it++)
+		ExecuteBoundAction(table, *it, start.QuadPart);
+}
+
+void ChordTimerCallback()
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	// No chord was completed in time, run the own bindings of the keys that are still held
+	EnterCriticalSection(&csBindings);
+	unsigned long pending = keysPending;
+	keysPending = 0;
+	LeaveCriticalSection(&csBindings);
+
+	for(unsigned int i=0; i<BINDING_KEYS; i++)
+		if(pending & (1UL << i)) ExecuteBinding(0, 1UL << i, start.QuadPart);
+}
+
+// Reports the time it took to connect the whole group, csConnect must be held
+void FinishBookmarkGroup()
+{
+	if(connectIssued == 0 || !connectQueue.empty() || !connectPending.empty()) return;
+
+	std::stringstream ss;
+	ss << "Bookmark group: " << connectIssued - connectFailed << " of " << connectIssued << " servers connected in "
+		<< (GetMicroseconds() - connectStart) / 1000 << " ms";
+	ts3Functions.logMessage(ss.str().c_str(), LogLevel_INFO, "G-Key Plugin", 0);
+	ts3Functions.printMessageToCurrentTab(ss.str().c_str());
+	connectIssued = 0;
+}
+
+void ConnectBookmarkGroup(const std::vector<std::string>& bookmarks)
+{
+	// Acquire the connect queue
+	EnterCriticalSection(&csConnect);
+
+	// A group that is still connecting is extended with these bookmarks
+	bool idle = connectQueue.empty();
+	if(connectIssued == 0)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetContinuousTransmission(scHandlerID, true);
+		connectStart = GetMicroseconds();
+		connectFailed = 0;
 	}
-	else if(!strcmp(cmd, "TS3_CT_DEACTIVATE"))
+	connectQueue.insert(connectQueue.end(), bookmarks.begin(), bookmarks.end());
+
+	// Let the timer thread start connecting right away, unless it is already staggering the connects
+	if(idle)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetContinuousTransmission(scHandlerID, false);
+		LARGE_INTEGER connectDueTime;
+		connectDueTime.QuadPart = -1;
+		SetWaitableTimer(hConnectTimer, &connectDueTime, 0, NULL, NULL, FALSE);
 	}
-	else if(!strcmp(cmd, "TS3_CT_TOGGLE"))
+
+	// Release the connect queue
+	LeaveCriticalSection(&csConnect);
+}
+
+void ConnectTimerCallback()
+{
+	// Acquire the connect queue
+	EnterCriticalSection(&csConnect);
+
+	while(!connectQueue.empty())
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetContinuousTransmission(scHandlerID, !gkeyFunctions.inputActive);
+		std::string uuid = connectQueue.front();
+		connectQueue.pop_front();
+		bool first = connectIssued == 0;
+		connectIssued++;
+
+		// The client reports the connect status on its own thread, don't hold the queue while connecting
+		LeaveCriticalSection(&csConnect);
+
+		// The first bookmark may use the current tab, all others need a tab of their own
+		uint64 handle = (uint64)NULL;
+		bool started = gkeyFunctions.ConnectToBookmarkID(uuid, first ? PLUGIN_CONNECT_TAB_NEW_IF_CURRENT_CONNECTED : PLUGIN_CONNECT_TAB_NEW, &handle);
+		int status = STATUS_DISCONNECTED;
+		if(started && handle != (uint64)NULL && ts3Functions.getConnectionStatus(handle, &status) != ERROR_ok)
+			status = STATUS_DISCONNECTED;
+
+		EnterCriticalSection(&csConnect);
+
+		// Wait for the handler to connect, unless it already connected or failed while the queue wasn't held
+		if(!started || handle == (uint64)NULL || status == STATUS_DISCONNECTED) connectFailed++;
+		else if(status != STATUS_CONNECTION_ESTABLISHED) connectPending.push_back(handle);
+
+		// Schedule the next connect
+		if(connectStagger > 0 && !connectQueue.empty())
+		{
+			LARGE_INTEGER connectDueTime;
+			connectDueTime.QuadPart = -((LONGLONG)connectStagger * TIMER_MSEC);
+			if(SetWaitableTimer(hConnectTimer, &connectDueTime, 0, NULL, NULL, FALSE)) break;
+		}
 	}
-	else if(!strcmp(cmd, "TS3_INPUT_MUTE"))
+	FinishBookmarkGroup();
+
+	// Release the connect queue
+	LeaveCriticalSection(&csConnect);
+}
+
+void UpdateBookmarkGroup(uint64 scHandlerID, bool connected)
+{
+	// Acquire the connect queue
+	EnterCriticalSection(&csConnect);
+
+	std::vector<uint64>::iterator it = std::find(connectPending.begin(), connectPending.end(), scHandlerID);
+	if(it != connectPending.end())
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetInputMute(scHandlerID, true);
+		connectPending.erase(it);
+		if(!connected) connectFailed++;
+		FinishBookmarkGroup();
 	}
-	else if(!strcmp(cmd, "TS3_INPUT_UNMUTE"))
+
+	// Release the connect queue
+	LeaveCriticalSection(&csConnect);
+}
+
+void ScheduleRequestExpiry()
+{
+	// Wake the timer thread when the oldest request the server hasn't answered expires
+	EnterCriticalSection(&csInFlight);
+	long long expiry = requestTracker.GetExpiry(GetMicroseconds(), REQUEST_TIMEOUT);
+	LeaveCriticalSection(&csInFlight);
+	if(expiry < 0)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetInputMute(scHandlerID, false);
+		CancelWaitableTimer(hExpiryTimer);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_INPUT_TOGGLE"))
+
+	LARGE_INTEGER expiryDueTime;
+	expiryDueTime.QuadPart = -((expiry > 0) ? (LONGLONG)expiry * (TIMER_MSEC / 1000) : 1);
+	SetWaitableTimer(hExpiryTimer, &expiryDueTime, 0, NULL, NULL, FALSE);
+}
+
+void ExpiryTimerCallback()
+{
+	// Forget the requests the server will no longer answer, the batches parked on them are skipped
+	std::vector<Action> skipped;
+	EnterCriticalSection(&csInFlight);
+	size_t expired = requestTracker.Expire(GetMicroseconds(), REQUEST_TIMEOUT, skipped);
+	LeaveCriticalSection(&csInFlight);
+
+	if(expired > 0) ts3Functions.logMessage("The server did not answer a request in time", LogLevel_WARNING, "G-Key Plugin", 0);
+	for(std::vector<Action>::iterator it=skipped.begin(); it!=skipped.end(); it++)
+		ResumeBatch(*it, false);
+	ScheduleRequestExpiry();
+}
+
+void ExecuteRequest(const ServerRequest& request, std::string* returnCode = NULL)
+{
+	// Track the request by a return code of our own, the server answers with it in onServerErrorEvent.
+	// A batch waiting for the answer is registered before sending, the answer may arrive right away.
+	char code[RETURNCODE_BUFSIZE];
+	ts3Functions.createReturnCode(pluginID, code, RETURNCODE_BUFSIZE);
+	EnterCriticalSection(&csInFlight);
+	requestTracker.Add(code, request, GetMicroseconds(), returnCode != NULL);
+	LeaveCriticalSection(&csInFlight);
+
+	bool sent = false;
+	switch(request.type)
+	{
+		case REQUEST_MOVE:
+			sent = gkeyFunctions.JoinChannel(request.scHandlerID, request.channel, code);
+			break;
+		case REQUEST_KICK_CHANNEL:
+			sent = gkeyFunctions.ChannelKickClient(request.scHandlerID, request.client, code);
+			break;
+		case REQUEST_KICK_SERVER:
+			sent = gkeyFunctions.ServerKickClient(request.scHandlerID, request.client, code);
+			break;
+	}
+
+	// A request that couldn't be sent will never be answered
+	if(!sent)
+	{
+		EnterCriticalSection(&csInFlight);
+		requestTracker.Remove(code);
+		LeaveCriticalSection(&csInFlight);
+		return;
+	}
+	if(returnCode != NULL) *returnCode = code;
+	ScheduleRequestExpiry();
+}
+
+void ScheduleRequests()
+{
+	// Wake the timer thread when the next queued request has a token, must hold the scheduler
+	long long delay = requestScheduler.GetDelay(GetMicroseconds());
+	if(delay < 0) return;
+
+	LARGE_INTEGER requestDueTime;
+	requestDueTime.QuadPart = -((delay > 0) ? (LONGLONG)delay * (TIMER_MSEC / 1000) : 1);
+	SetWaitableTimer(hRequestTimer, &requestDueTime, 0, NULL, NULL, FALSE);
+}
+
+void SubmitRequest(ServerRequest& request, RequestPriority priority, std::string* returnCode = NULL)
+{
+	// Acquire the scheduler
+	EnterCriticalSection(&csRequests);
+	bool send = requestScheduler.Submit(request, priority, GetMicroseconds());
+	if(!send) ScheduleRequests();
+	LeaveCriticalSection(&csRequests);
+
+	if(send) ExecuteRequest(request, returnCode);
+}
+
+void MoveToChannel(uint64 scHandlerID, uint64 channel)
+{
+	// The commands following a move in the same batch wait for it to succeed
+	ServerRequest request = { REQUEST_MOVE, scHandlerID, (anyID)NULL, channel, 0 };
+	SubmitRequest(request, PRIORITY_INTERACTIVE, &awaitedRequest);
+}
+
+void KickClients(uint64 scHandlerID, const std::vector<anyID>& clients, bool server, RequestPriority priority)
+{
+	for(std::vector<anyID>::const_iterator it=clients.begin(); it!=clients.end(); it++)
 	{
-		if(IsConnected(scHandlerID))
+		ServerRequest request = { server ? REQUEST_KICK_SERVER : REQUEST_KICK_CHANNEL, scHandlerID, *it, (uint64)NULL, 0 };
+
+		// Bulk kicks may be queued, remember who the ID belongs to now
+		char* uid;
+		if(priority == PRIORITY_BULK && ts3Functions.getClientVariableAsString(scHandlerID, *it, CLIENT_UNIQUE_IDENTIFIER, &uid) == ERROR_ok)
 		{
-			int muted;
-			ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_MUTED, &muted);
-			gkeyFunctions.SetInputMute(scHandlerID, !muted);
+			request.uid = uid;
+			ts3Functions.freeMemory(uid);
 		}
+		SubmitRequest(request, priority);
 	}
-	else if(!strcmp(cmd, "TS3_OUTPUT_MUTE"))
+}
+
+/*
+ * Finds the client of a queued request again, the server reuses the IDs of clients that left.
+ * Returns false if the client is gone.
+ */
+bool ResolveQueuedClient(ServerRequest& request)
+{
+	if(request.uid.empty()) return true;
+
+	// Usually the client still has the same ID
+	char* uid;
+	if(ts3Functions.getClientVariableAsString(request.scHandlerID, request.client, CLIENT_UNIQUE_IDENTIFIER, &uid) == ERROR_ok)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetOutputMute(scHandlerID, true);
+		bool same = request.uid == uid;
+		ts3Functions.freeMemory(uid);
+		if(same) return true;
 	}
-	else if(!strcmp(cmd, "TS3_OUTPUT_UNMUTE"))
+
+	// A client that reconnected is no longer in the channel, but is still on the server
+	if(request.type != REQUEST_KICK_SERVER) return false;
+	std::vector<char> value(request.uid.c_str(), request.uid.c_str() + request.uid.size() + 1);
+	request.client = gkeyFunctions.GetClientIDByVariable(request.scHandlerID, &value[0], CLIENT_UNIQUE_IDENTIFIER);
+	return request.client != (anyID)NULL;
+}
+
+void RequestTimerCallback()
+{
+	// Acquire the scheduler
+	EnterCriticalSection(&csRequests);
+
+	// Send everything the budget allows
+	ServerRequest request;
+	while(requestScheduler.Next(request, GetMicroseconds()))
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetOutputMute(scHandlerID, false);
+		// Don't hold the scheduler while the request is sent
+		LeaveCriticalSection(&csRequests);
+		bool found = ResolveQueuedClient(request);
+		if(found) ExecuteRequest(request);
+		EnterCriticalSection(&csRequests);
+		if(!found) requestScheduler.stats.dropped++;
 	}
-	else if(!strcmp(cmd, "TS3_OUTPUT_TOGGLE"))
+	ScheduleRequests();
+
+	// Release the scheduler
+	LeaveCriticalSection(&csRequests);
+}
+
+void SplitList(const char* str, std::vector<std::string>& result)
+{
+	// Split a comma separated list, ignoring the spaces around the items
+	std::stringstream ss(str);
+	std::string item;
+	while(std::getline(ss, item, ','))
 	{
-		if(IsConnected(scHandlerID))
-		{
-			int muted;
-			ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_OUTPUT_MUTED, &muted);
-			gkeyFunctions.SetOutputMute(scHandlerID, !muted);
-		}
+		size_t begin = item.find_first_not_of(' ');
+		if(begin == std::string::npos) continue;
+		result.push_back(item.substr(begin, item.find_last_not_of(' ') - begin + 1));
 	}
-	/***** Server interaction *****/
-	else if(!strcmp(cmd, "TS3_AWAY_ZZZ"))
+}
+
+void InvalidateChannelTargets(uint64 scHandlerID)
+{
+	// Let the channel thread compute the targets again
+	EnterCriticalSection(&csChannels);
+	if(std::find(channelDirty.begin(), channelDirty.end(), scHandlerID) == channelDirty.end())
+		channelDirty.push_back(scHandlerID);
+	LeaveCriticalSection(&csChannels);
+	SetEvent(hChannelEvent);
+}
+
+// Channel names, paths and targets may resolve to different channels after the channel tree changes
+void InvalidateChannelTree(uint64 scHandlerID)
+{
+	gkeyFunctions.InvalidateChannels(scHandlerID);
+	InvalidateChannelTargets(scHandlerID);
+}
+
+/*
+ * Publishes the channel model of a server, or forgets it if the model is NULL.
+ * Lookups still walking the previous model keep it alive until they're done.
+ */
+void StoreChannelModel(uint64 scHandlerID, ChannelModel* model)
+{
+	ChannelModel* previous = NULL;
+	EnterCriticalSection(&csChannels);
+	std::map<uint64, ChannelModel*>::iterator it = channelModels.find(scHandlerID);
+	if(it != channelModels.end())
 	{
-		gkeyFunctions.SetAway(scHandlerID, true, arg);
+		previous = it->second;
+		if(model != NULL) it->second = model;
+		else channelModels.erase(it);
 	}
-	else if(!strcmp(cmd, "TS3_AWAY_NONE"))
+	else if(model != NULL) channelModels[scHandlerID] = model;
+	LeaveCriticalSection(&csChannels);
+
+	if(previous != NULL) previous->Release();
+}
+
+// Returns a reference to the model of a server if it was built against the generation, the caller has to release it
+ChannelModel* FindChannelModel(uint64 scHandlerID, unsigned long generation)
+{
+	ChannelModel* model = NULL;
+	EnterCriticalSection(&csChannels);
+	std::map<uint64, ChannelModel*>::iterator it = channelModels.find(scHandlerID);
+	if(it != channelModels.end() && it->second->generation == generation)
 	{
-		gkeyFunctions.SetAway(scHandlerID, false);
+		model = it->second;
+		model->AddRef();
 	}
-	else if(!strcmp(cmd, "TS3_AWAY_TOGGLE"))
+	LeaveCriticalSection(&csChannels);
+	return model;
+}
+
+// Builds and publishes the model of a server without holding the channels, the caller has to release the reference returned
+ChannelModel* BuildChannelModel(uint64 scHandlerID, unsigned long generation)
+{
+	// Clients moving or subscriptions finishing during the build mark them stale again
+	ChannelModel* model = new ChannelModel();
+	model->occupancy = gkeyFunctions.GetOccupancyGeneration(scHandlerID);
+	model->subscriptions = gkeyFunctions.GetSubscriptionGeneration(scHandlerID);
+	if(!model->Build(scHandlerID))
 	{
-		int away;
-		ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_AWAY, &away);
-		gkeyFunctions.SetAway(scHandlerID, !away, arg);
+		model->Release();
+		return NULL;
 	}
-	else if(!strcmp(cmd, "TS3_GLOBALAWAY_ZZZ"))
+	model->generation = generation;
+
+	model->AddRef();
+	StoreChannelModel(scHandlerID, model);
+	return model;
+}
+
+/*
+ * Reads the subscribed and full channels again if the filter uses them and they changed since the model read them.
+ * Takes over the reference to the model passed and returns a reference to the model to use.
+ */
+ChannelModel* UpdateChannelModel(uint64 scHandlerID, ChannelModel* model, unsigned int filter)
+{
+	// Clients are only known in subscribed channels, so the occupancy depends on the subscriptions
+	unsigned long occupancy = gkeyFunctions.GetOccupancyGeneration(scHandlerID);
+	unsigned long subscriptions = gkeyFunctions.GetSubscriptionGeneration(scHandlerID);
+	bool readSubscriptions = (filter & (CHANNEL_FILTER_SUBSCRIBED | CHANNEL_FILTER_OCCUPANCY)) && model->subscriptions != subscriptions;
+	bool readOccupancy = readSubscriptions || ((filter & CHANNEL_FILTER_OCCUPANCY) && model->occupancy != occupancy);
+	if(!readOccupancy) return model;
+
+	// Update a copy, lookups may still be walking the published model
+	ChannelModel* updated = model->Copy();
+	model->Release();
+	if(readSubscriptions)
+	{
+		updated->subscriptions = subscriptions;
+		updated->ReadSubscriptions(scHandlerID);
+	}
+	updated->occupancy = occupancy;
+	updated->ReadOccupancy(scHandlerID);
+
+	updated->AddRef();
+	StoreChannelModel(scHandlerID, updated);
+	return updated;
+}
+
+// Leaves out the changes that were already requested, and remembers the others as requested
+void TrackSubscriptions(std::vector<uint64>& changes, std::vector<uint64>& requested)
+{
+	std::vector<uint64> unrequested;
+	for(std::vector<uint64>::iterator it=changes.begin(); it!=changes.end(); it++)
 	{
-		gkeyFunctions.SetGlobalAway(true, arg);
+		if(std::find(requested.begin(), requested.end(), *it) != requested.end()) continue;
+		unrequested.push_back(*it);
+		requested.push_back(*it);
 	}
-	else if(!strcmp(cmd, "TS3_GLOBALAWAY_NONE"))
+	changes.swap(unrequested);
+}
+
+/*
+ * Forgets the subscription requests the client answered for a channel. A channel of NULL forgets all requests
+ * of the kind, so a request the server refused doesn't keep its channels from being requested again.
+ */
+void FinishSubscriptions(uint64 scHandlerID, uint64 channelID, bool subscribe)
+{
+	EnterCriticalSection(&csChannels);
+	std::map<uint64, ChannelNeighborhood>::iterator it = channelNeighborhoods.find(scHandlerID);
+	if(it != channelNeighborhoods.end())
 	{
-		gkeyFunctions.SetGlobalAway(false);
+		std::vector<uint64>& requested = subscribe ? it->second.subscribing : it->second.unsubscribing;
+		if(channelID == (uint64)NULL) requested.clear();
+		else requested.erase(std::remove(requested.begin(), requested.end(), channelID), requested.end());
 	}
-	else if(!strcmp(cmd, "TS3_GLOBALAWAY_TOGGLE"))
-	{
-		int away;
-		ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_AWAY, &away);
-		gkeyFunctions.SetGlobalAway(!away, arg);
+	LeaveCriticalSection(&csChannels);
+}
+
+void ComputeChannelTargets(uint64 scHandlerID)
+{
+	// Forget the servers we're no longer connected to
+	if(gkeyFunctions.GetConnectionStatus(scHandlerID) != STATUS_CONNECTION_ESTABLISHED)
+	{
+		StoreChannelModel(scHandlerID, NULL);
+		EnterCriticalSection(&csChannels);
+		channelTargets.erase(scHandlerID);
+		channelNeighborhoods.erase(scHandlerID);
+		LeaveCriticalSection(&csChannels);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_ACTIVATE_SERVER"))
+
+	// Only rebuild the model if the channel tree changed, a change during the build marks the server dirty again
+	unsigned long generation = gkeyFunctions.GetChannelGeneration(scHandlerID);
+	ChannelModel* model = FindChannelModel(scHandlerID, generation);
+	if(model == NULL) model = BuildChannelModel(scHandlerID, generation);
+	if(model == NULL) return;
+
+	// The neighborhood is compared with the subscribed channels
+	EnterCriticalSection(&csChannels);
+	bool subscribing = channelNeighborhoods.find(scHandlerID) != channelNeighborhoods.end();
+	LeaveCriticalSection(&csChannels);
+	model = UpdateChannelModel(scHandlerID, model, channelFilter | (subscribing ? CHANNEL_FILTER_SUBSCRIBED : 0));
+
+	// Find the channels around our own channel, the model can be walked without holding the channels
+	anyID self;
+	ChannelTargets targets;
+	if(ts3Functions.getClientID(scHandlerID, &self) != ERROR_ok || ts3Functions.getChannelOfClient(scHandlerID, self, &targets.channel) != ERROR_ok)
 	{
-		if(!IsArgumentEmpty(scHandlerID, arg))
-		{
-			uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_NAME);
-			if(handle != (uint64)NULL && handle != scHandlerID)
-			{
-				CancelWaitableTimer(hPttDelayTimer);
-				gkeyFunctions.SetActiveServer(handle);
-			}
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
-		}
+		model->Release();
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_ACTIVATE_SERVERID"))
-	{
-		if(!IsArgumentEmpty(scHandlerID, arg))
+	targets.generation = generation;
+	targets.occupancy = model->occupancy;
+	targets.subscriptions = model->subscriptions;
+	targets.next = model->FindNext(targets.channel, true, channelFilter);
+	targets.prev = model->FindNext(targets.channel, false, channelFilter);
+
+	EnterCriticalSection(&csChannels);
+	channelTargets[scHandlerID] = targets;
+	std::map<uint64, ChannelNeighborhood>::iterator neighborhood = channelNeighborhoods.find(scHandlerID);
+	bool update = neighborhood != channelNeighborhoods.end() && (neighborhood->second.channel != targets.channel
+		|| neighborhood->second.generation != generation || neighborhood->second.subscriptions != model->subscriptions);
+	LeaveCriticalSection(&csChannels);
+
+	// Find the subscriptions that changed since the neighborhood was last updated
+	std::vector<uint64> subscribe, unsubscribe;
+	if(update && model->FindSubscriptionChanges(targets.channel, subscribe, unsubscribe))
+	{
+		EnterCriticalSection(&csChannels);
+		neighborhood = channelNeighborhoods.find(scHandlerID);
+		if(neighborhood != channelNeighborhoods.end())
 		{
-			uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_UNIQUE_IDENTIFIER);
-			if(handle != (uint64)NULL)
-			{
-				CancelWaitableTimer(hPttDelayTimer);
-				gkeyFunctions.SetActiveServer(handle);
-			}
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			neighborhood->second.channel = targets.channel;
+			neighborhood->second.generation = generation;
+			neighborhood->second.subscriptions = model->subscriptions;
+
+			// Requests the client hasn't answered yet are not sent again
+			TrackSubscriptions(subscribe, neighborhood->second.subscribing);
+			TrackSubscriptions(unsubscribe, neighborhood->second.unsubscribing);
 		}
-	}
-	else if(!strcmp(cmd, "TS3_ACTIVATE_SERVERIP"))
-	{
-		if(!IsArgumentEmpty(scHandlerID, arg))
+		else
 		{
-			uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_IP);
-			if(handle != (uint64)NULL)
-			{
-				CancelWaitableTimer(hPttDelayTimer);
-				gkeyFunctions.SetActiveServer(handle);
-			}
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			// The neighborhood was disabled meanwhile, the server is already subscribed to everything
+			subscribe.clear();
+			unsubscribe.clear();
 		}
+		LeaveCriticalSection(&csChannels);
 	}
-	else if(!strcmp(cmd, "TS3_ACTIVATE_CURRENT"))
+	model->Release();
+
+	// Subscribe before unsubscribing, so the channels around us never go silent
+	gkeyFunctions.SubscribeChannels(scHandlerID, subscribe, true);
+	gkeyFunctions.SubscribeChannels(scHandlerID, unsubscribe, false);
+}
+
+void SubscribeNeighborhood(uint64 scHandlerID, bool enable)
+{
+	EnterCriticalSection(&csChannels);
+	if(enable)
 	{
-		uint64 handle = ts3Functions.getCurrentServerConnectionHandlerID();
-		if(handle != (uint64)NULL)
-		{
-			CancelWaitableTimer(hPttDelayTimer);
-			gkeyFunctions.SetActiveServer(handle);
-		}
-		else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+		// Let the channel thread update the subscriptions whenever our channel changes
+		ChannelNeighborhood neighborhood;
+		neighborhood.generation = 0;
+		neighborhood.subscriptions = 0;
+		neighborhood.channel = (uint64)NULL;
+		channelNeighborhoods[scHandlerID] = neighborhood;
+	}
+	else channelNeighborhoods.erase(scHandlerID);
+	LeaveCriticalSection(&csChannels);
+
+	if(enable) InvalidateChannelTargets(scHandlerID);
+	else gkeyFunctions.SubscribeAll(scHandlerID);
+}
+
+uint64 FindRelativeChannel(ChannelModel& model, CommandOpcode opcode, uint64 channel, unsigned int filter, unsigned int count)
+{
+	switch(opcode)
+	{
+		case CMD_CHANNEL_NEXT:
+			return model.FindNext(channel, true, filter, count);
+		case CMD_CHANNEL_PREV:
+			return model.FindNext(channel, false, filter, count);
+		case CMD_CHANNEL_PARENT:
+			return model.FindParent(channel);
+		case CMD_CHANNEL_FIRSTCHILD:
+			return model.FindFirstChild(channel);
+		case CMD_CHANNEL_NEXT_SIBLING:
+			return model.FindNextSibling(channel);
+		default:
+			return (uint64)NULL;
 	}
-	else if(!strcmp(cmd, "TS3_SERVER_NEXT"))
+}
+
+/*
+ * Returns a reference to the channel model of a server, the caller has to release it.
+ * Builds the model now if the channel thread has not yet done so. Returns NULL if it can't be built.
+ */
+ChannelModel* AcquireChannelModel(uint64 scHandlerID)
+{
+	unsigned long generation = gkeyFunctions.GetChannelGeneration(scHandlerID);
+	ChannelModel* model = FindChannelModel(scHandlerID, generation);
+	if(model != NULL) return model;
+
+	// Build the model now, and have the targets ready for the next press
+	model = BuildChannelModel(scHandlerID, generation);
+	if(model != NULL) InvalidateChannelTargets(scHandlerID);
+	return model;
+}
+
+void JoinRelativeChannel(uint64 scHandlerID, CommandOpcode opcode, unsigned int filter = channelFilter, unsigned int count = 1)
+{
+	anyID self;
+	uint64 channel;
+	if(ts3Functions.getClientID(scHandlerID, &self) != ERROR_ok || ts3Functions.getChannelOfClient(scHandlerID, self, &channel) != ERROR_ok)
+		return;
+
+	// Use the precomputed target if it was computed for the current tree, occupancy and channel, other jumps search the model
+	unsigned long generation = gkeyFunctions.GetChannelGeneration(scHandlerID);
+	unsigned long occupancy = gkeyFunctions.GetOccupancyGeneration(scHandlerID);
+	unsigned long subscriptions = gkeyFunctions.GetSubscriptionGeneration(scHandlerID);
+	bool valid = false;
+	uint64 target = (uint64)NULL;
+	if((opcode == CMD_CHANNEL_NEXT || opcode == CMD_CHANNEL_PREV) && filter == channelFilter && count == 1)
 	{
-		CancelWaitableTimer(hPttDelayTimer);
-		gkeyFunctions.SetNextActiveServer(scHandlerID);
+		EnterCriticalSection(&csChannels);
+		std::map<uint64, ChannelTargets>::iterator it = channelTargets.find(scHandlerID);
+		valid = it != channelTargets.end() && it->second.generation == generation && it->second.channel == channel
+			&& (!(filter & CHANNEL_FILTER_OCCUPANCY) || it->second.occupancy == occupancy)
+			&& (!(filter & (CHANNEL_FILTER_SUBSCRIBED | CHANNEL_FILTER_OCCUPANCY)) || it->second.subscriptions == subscriptions);
+		if(valid) target = (opcode == CMD_CHANNEL_NEXT) ? it->second.next : it->second.prev;
+		LeaveCriticalSection(&csChannels);
 	}
-	else if(!strcmp(cmd, "TS3_SERVER_PREV"))
+
+	if(!valid)
 	{
-		CancelWaitableTimer(hPttDelayTimer);
-		gkeyFunctions.SetPrevActiveServer(scHandlerID);
+		ChannelModel* model = AcquireChannelModel(scHandlerID);
+		if(model == NULL) return;
+		model = UpdateChannelModel(scHandlerID, model, filter);
+		target = FindRelativeChannel(*model, opcode, channel, filter, count);
+		model->Release();
 	}
-	else if(!strcmp(cmd, "TS3_JOIN_CHANNEL"))
+
+	if(target != (uint64)NULL) MoveToChannel(scHandlerID, target);
+}
+
+uint64 ResolveChannel(uint64 scHandlerID, Command& command)
+{
+	// Reuse the channel found by an earlier execution if no channels changed since
+	ResolvedTarget* target = command.target;
+	unsigned long generation = gkeyFunctions.GetChannelGeneration(scHandlerID);
+	if(target != NULL && target->id != (uint64)NULL && target->scHandlerID == scHandlerID && target->generation == generation)
+		return target->id;
+
+	// The path is split in place, resolve it on a copy so the argument stays intact
+	std::vector<char> path(command.arg, command.arg + strlen(command.arg) + 1);
+	uint64 id = gkeyFunctions.GetChannelIDFromPath(scHandlerID, &path[0]);
+	if(id == (uint64)NULL) id = gkeyFunctions.GetChannelIDByVariable(scHandlerID, command.arg, CHANNEL_NAME);
+
+	if(target != NULL)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			uint64 id = gkeyFunctions.GetChannelIDFromPath(scHandlerID, arg);
-			if(id == (uint64)NULL) id = gkeyFunctions.GetChannelIDByVariable(scHandlerID, arg, CHANNEL_NAME);
-			if(id != (uint64)NULL) gkeyFunctions.JoinChannel(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
-		}
+		target->scHandlerID = scHandlerID;
+		target->generation = generation;
+		target->id = id;
 	}
-	else if(!strcmp(cmd, "TS3_JOIN_CHANNELID"))
+	return id;
+}
+
+anyID ResolveClient(uint64 scHandlerID, Command& command, size_t flag)
+{
+	// Reuse the client found by an earlier execution if no clients changed since
+	ResolvedTarget* target = command.target;
+	unsigned long generation = gkeyFunctions.GetClientGeneration(scHandlerID);
+	if(target != NULL && target->id != (uint64)NULL && target->scHandlerID == scHandlerID && target->generation == generation)
+		return (anyID)target->id;
+
+	anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, command.arg, flag);
+
+	if(target != NULL)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			uint64 id = atoi(arg);
-			if(id != (uint64)NULL) gkeyFunctions.JoinChannel(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
-		}
+		target->scHandlerID = scHandlerID;
+		target->generation = generation;
+		target->id = id;
 	}
-	else if(!strcmp(cmd, "TS3_CHANNEL_NEXT"))
+	return id;
+}
+
+void ExecuteCommand(Command& command)
+{
+	char* cmd = command.cmd;
+	char* arg = command.arg;
+
+	// Voice activation commands that are part of a batch still use the fast lane
+	if(IsFastLaneCommand(command.opcode))
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.JoinNextChannel(scHandlerID);
+		ExecuteFastLane(command);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_CHANNEL_PREV"))
+
+	// Get the active server
+	uint64 scHandlerID = gkeyFunctions.GetActiveServerConnectionHandlerID();
+	if(scHandlerID == NULL)
 	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.JoinPrevChannel(scHandlerID);
+		ts3Functions.logMessage("Failed to get an active server, falling back to current server", LogLevel_DEBUG, "G-Key Plugin", 0);
+		scHandlerID = ts3Functions.getCurrentServerConnectionHandlerID();
 	}
-	else if(!strcmp(cmd, "TS3_KICK_CLIENT"))
+
+	switch(command.opcode)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		/***** Communication *****/
+		case CMD_INPUT_MUTE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetInputMute(scHandlerID, true);
+			break;
+		case CMD_INPUT_UNMUTE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetInputMute(scHandlerID, false);
+			break;
+		case CMD_INPUT_TOGGLE:
+			if(IsConnected(scHandlerID))
+			{
+				int muted;
+				ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_INPUT_MUTED, &muted);
+				gkeyFunctions.SetInputMute(scHandlerID, !muted);
+			}
+			break;
+		case CMD_OUTPUT_MUTE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetOutputMute(scHandlerID, true);
+			break;
+		case CMD_OUTPUT_UNMUTE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetOutputMute(scHandlerID, false);
+			break;
+		case CMD_OUTPUT_TOGGLE:
+			if(IsConnected(scHandlerID))
+			{
+				int muted;
+				ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_OUTPUT_MUTED, &muted);
+				gkeyFunctions.SetOutputMute(scHandlerID, !muted);
+			}
+			break;
+
+		/***** Server interaction *****/
+		case CMD_AWAY_ZZZ:
+			gkeyFunctions.SetAway(scHandlerID, true, arg);
+			break;
+		case CMD_AWAY_NONE:
+			gkeyFunctions.SetAway(scHandlerID, false);
+			break;
+		case CMD_AWAY_TOGGLE:
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL) gkeyFunctions.ServerKickClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			int away;
+			ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_AWAY, &away);
+			gkeyFunctions.SetAway(scHandlerID, !away, arg);
+			break;
 		}
-	}
-	else if(!strcmp(cmd, "TS3_KICK_CLIENTID"))
-	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		case CMD_GLOBALAWAY_ZZZ:
+			gkeyFunctions.SetGlobalAway(true, arg);
+			break;
+		case CMD_GLOBALAWAY_NONE:
+			gkeyFunctions.SetGlobalAway(false);
+			break;
+		case CMD_GLOBALAWAY_TOGGLE:
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL) gkeyFunctions.ServerKickClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			int away;
+			ts3Functions.getClientSelfVariableAsInt(scHandlerID, CLIENT_AWAY, &away);
+			gkeyFunctions.SetGlobalAway(!away, arg);
+			break;
 		}
-	}
-	else if(!strcmp(cmd, "TS3_CHANKICK_CLIENT"))
-	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		case CMD_ACTIVATE_SERVER:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_NAME);
+				if(handle != (uint64)NULL && handle != scHandlerID)
+				{
+					CancelWaitableTimer(hPttDelayTimer);
+					gkeyFunctions.SetActiveServer(handle);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			}
+			break;
+		case CMD_ACTIVATE_SERVERID:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_UNIQUE_IDENTIFIER);
+				if(handle != (uint64)NULL)
+				{
+					CancelWaitableTimer(hPttDelayTimer);
+					gkeyFunctions.SetActiveServer(handle);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			}
+			break;
+		case CMD_ACTIVATE_SERVERIP:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 handle = gkeyFunctions.GetServerHandleByVariable(arg, VIRTUALSERVER_IP);
+				if(handle != (uint64)NULL)
+				{
+					CancelWaitableTimer(hPttDelayTimer);
+					gkeyFunctions.SetActiveServer(handle);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			}
+			break;
+		case CMD_ACTIVATE_CURRENT:
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL) gkeyFunctions.ChannelKickClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			uint64 handle = ts3Functions.getCurrentServerConnectionHandlerID();
+			if(handle != (uint64)NULL)
+			{
+				CancelWaitableTimer(hPttDelayTimer);
+				gkeyFunctions.SetActiveServer(handle);
+			}
+			else gkeyFunctions.ErrorMessage(scHandlerID, "Server not found");
+			break;
 		}
-	}
-	else if(!strcmp(cmd, "TS3_CHANKICK_CLIENTID"))
-	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		case CMD_SERVER_NEXT:
+			CancelWaitableTimer(hPttDelayTimer);
+			gkeyFunctions.SetNextActiveServer(scHandlerID);
+			break;
+		case CMD_SERVER_PREV:
+			CancelWaitableTimer(hPttDelayTimer);
+			gkeyFunctions.SetPrevActiveServer(scHandlerID);
+			break;
+		case CMD_JOIN_CHANNEL:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 id = ResolveChannel(scHandlerID, command);
+				if(id != (uint64)NULL) MoveToChannel(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			}
+			break;
+		case CMD_JOIN_CHANNELID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 id = command.value.integer;
+				if(id != (uint64)NULL) MoveToChannel(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			}
+			break;
+		case CMD_CHANNEL_NEXT:
+		case CMD_CHANNEL_PREV:
+			if(IsConnected(scHandlerID))
+			{
+				// Without an argument move one channel using the filter from the settings
+				unsigned int filter = (arg != NULL) ? command.value.traversal.filter : CHANNEL_FILTER_SETTING;
+				unsigned int count = (arg != NULL) ? command.value.traversal.count : 1;
+				JoinRelativeChannel(scHandlerID, command.opcode, (filter != CHANNEL_FILTER_SETTING) ? filter : channelFilter, count);
+			}
+			break;
+		case CMD_CHANNEL_PARENT:
+		case CMD_CHANNEL_FIRSTCHILD:
+		case CMD_CHANNEL_NEXT_SIBLING:
+			if(IsConnected(scHandlerID))
+				JoinRelativeChannel(scHandlerID, command.opcode);
+			break;
+		case CMD_SUBSCRIBE_NEIGHBORHOOD:
+			if(IsConnected(scHandlerID))
+				SubscribeNeighborhood(scHandlerID, true);
+			break;
+		case CMD_SUBSCRIBE_ALL:
+			if(IsConnected(scHandlerID))
+				SubscribeNeighborhood(scHandlerID, false);
+			break;
+		case CMD_KICK_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL) KickClients(scHandlerID, std::vector<anyID>(1, id), true, PRIORITY_INTERACTIVE);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_KICK_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL) KickClients(scHandlerID, std::vector<anyID>(1, id), true, PRIORITY_INTERACTIVE);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_CHANKICK_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL) KickClients(scHandlerID, std::vector<anyID>(1, id), false, PRIORITY_INTERACTIVE);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_CHANKICK_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL) KickClients(scHandlerID, std::vector<anyID>(1, id), false, PRIORITY_INTERACTIVE);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_KICK_CLIENTS:
+		case CMD_CHANKICK_CLIENTS:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				std::vector<std::string> names;
+				std::vector<anyID> clients;
+				SplitList(arg, names);
+				gkeyFunctions.GetClientIDsByVariable(scHandlerID, names, CLIENT_NICKNAME, clients);
+				if(!clients.empty()) KickClients(scHandlerID, clients, command.opcode == CMD_KICK_CLIENTS, PRIORITY_BULK);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_BOOKMARK_CONNECT:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				// Without a watch on the config path the bookmarks can't be known to be unchanged
+				if(!configWatched) gkeyFunctions.InvalidateBookmarks();
+				gkeyFunctions.ConnectToBookmark(arg, PLUGIN_CONNECT_TAB_NEW_IF_CURRENT_CONNECTED, &scHandlerID);
+			}
+			break;
+		case CMD_BOOKMARK_CONNECT_GROUP:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				if(!configWatched) gkeyFunctions.InvalidateBookmarks();
+				std::vector<std::string> bookmarks;
+				if(gkeyFunctions.GetBookmarkFolder(arg, bookmarks) && !bookmarks.empty()) ConnectBookmarkGroup(bookmarks);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Bookmark folder not found");
+			}
+			break;
+
+		/***** Whispering *****/
+		case CMD_WHISPER_ACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetWhisperList(scHandlerID, TRUE);
+			break;
+		case CMD_WHISPER_DEACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetWhisperList(scHandlerID, FALSE);
+			break;
+		case CMD_WHISPER_TOGGLE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetWhisperList(scHandlerID, !gkeyFunctions.whisperActive);
+			break;
+		case CMD_WHISPER_CLEAR:
+			gkeyFunctions.WhisperListClear(scHandlerID);
+			break;
+		case CMD_WHISPER_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL) gkeyFunctions.WhisperAddClient(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_WHISPER_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL) gkeyFunctions.WhisperAddClient(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_WHISPER_CHANNEL:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 id = ResolveChannel(scHandlerID, command);
+				if(id != (uint64)NULL) gkeyFunctions.WhisperAddChannel(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			}
+			break;
+		case CMD_WHISPER_CHANNELID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 id = command.value.integer;
+				if(id != (uint64)NULL) gkeyFunctions.WhisperAddChannel(scHandlerID, id);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			}
+			break;
+		case CMD_WHISPER_SUBTREE:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				uint64 id = ResolveChannel(scHandlerID, command);
+				std::vector<uint64> subtree;
+				ChannelModel* model = (id != (uint64)NULL) ? AcquireChannelModel(scHandlerID) : NULL;
+				if(model != NULL)
+				{
+					model->FindSubtree(id, subtree);
+					model->Release();
+				}
+
+				if(!subtree.empty()) gkeyFunctions.WhisperAddChannels(scHandlerID, subtree);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			}
+			break;
+		case CMD_WHISPERGROUP_DEFINE:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				// The targets were seperated from the group name when the command was parsed
+				char* targets = arg + command.value.offset;
+				if(!gkeyFunctions.WhisperGroupDefine(scHandlerID, arg, targets))
+					gkeyFunctions.ErrorMessage(scHandlerID, "Invalid whisper group");
+			}
+			break;
+		case CMD_WHISPERGROUP_ACTIVATE:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				if(gkeyFunctions.HasWhisperGroup(arg)) gkeyFunctions.WhisperGroupActivate(scHandlerID, arg);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Whisper group not found");
+			}
+			break;
+		case CMD_REPLY_ACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetReplyList(scHandlerID, TRUE);
+			break;
+		case CMD_REPLY_DEACTIVATE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetReplyList(scHandlerID, FALSE);
+			break;
+		case CMD_REPLY_TOGGLE:
+			if(IsConnected(scHandlerID))
+				gkeyFunctions.SetReplyList(scHandlerID, !gkeyFunctions.replyActive);
+			break;
+		case CMD_REPLY_CLEAR:
+			gkeyFunctions.ReplyListClear(scHandlerID);
+			break;
+
+		/***** Miscellaneous *****/
+		case CMD_MUTE_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, true);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, true);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_UNMUTE_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, false);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_UNMUTE_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, false);
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_TOGGLE_CLIENT:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_NICKNAME);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, !gkeyFunctions.IsClientMuted(scHandlerID, id));
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_TOGGLE_CLIENTID:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				anyID id = ResolveClient(scHandlerID, command, CLIENT_UNIQUE_IDENTIFIER);
+				if(id != (anyID)NULL)
+				{
+					std::vector<anyID> clients(1, id);
+					gkeyFunctions.MuteClients(scHandlerID, clients, !gkeyFunctions.IsClientMuted(scHandlerID, id));
+				}
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_CLIENTS:
+		case CMD_UNMUTE_CLIENTS:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				std::vector<std::string> names;
+				std::vector<anyID> clients;
+				SplitList(arg, names);
+				gkeyFunctions.GetClientIDsByVariable(scHandlerID, names, CLIENT_NICKNAME, clients);
+				if(!clients.empty()) gkeyFunctions.MuteClients(scHandlerID, clients, command.opcode == CMD_MUTE_CLIENTS);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_MATCHING:
+		case CMD_UNMUTE_MATCHING:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				std::vector<anyID> clients;
+				gkeyFunctions.GetClientIDsByPattern(scHandlerID, arg, CLIENT_NICKNAME, clients);
+				if(!clients.empty()) gkeyFunctions.MuteClients(scHandlerID, clients, command.opcode == CMD_MUTE_MATCHING);
+				else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			}
+			break;
+		case CMD_MUTE_CHANNEL:
+		case CMD_UNMUTE_CHANNEL:
+			if(IsConnected(scHandlerID))
+			{
+				// The optional argument lists the nicknames to leave alone
+				std::vector<std::string> except;
+				std::vector<anyID> clients;
+				if(arg != NULL) SplitList(arg, except);
+				if(gkeyFunctions.GetChannelClientIDs(scHandlerID, except, clients))
+					gkeyFunctions.MuteClients(scHandlerID, clients, command.opcode == CMD_MUTE_CHANNEL);
+			}
+			break;
+		case CMD_VOLUME_UP:
+			if(IsConnected(scHandlerID))
+			{
+				float diff = (arg != NULL) ? command.value.real : 1.0f;
+				float value;
+				ts3Functions.getPlaybackConfigValueAsFloat(scHandlerID, "volume_modifier", &value);
+				gkeyFunctions.SetMasterVolume(scHandlerID, value+diff);
+			}
+			break;
+		case CMD_VOLUME_DOWN:
+			if(IsConnected(scHandlerID))
+			{
+				float diff = (arg != NULL) ? command.value.real : 1.0f;
+				float value;
+				ts3Functions.getPlaybackConfigValueAsFloat(scHandlerID, "volume_modifier", &value);
+				gkeyFunctions.SetMasterVolume(scHandlerID, value-diff);
+			}
+			break;
+		case CMD_VOLUME_SET:
+			if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+			{
+				float value = command.value.real;
+				gkeyFunctions.SetMasterVolume(scHandlerID, value);
+			}
+			break;
+		case CMD_PLUGIN_COMMAND:
+			if(!IsArgumentEmpty(scHandlerID, arg))
+			{
+				// The command was seperated from the keyword when the command was parsed
+				char* keyword = arg;
+				if(*keyword == '/') keyword++; // Skip the slash
+				ExecutePluginCommand(scHandlerID, keyword, arg + command.value.offset);
+			}
+			break;
+
+		case CMD_STATS:
+			PrintStatistics();
+			break;
+		case CMD_BENCHMARK_FLOOD:
+			if(IsConnected(scHandlerID))
+				BenchmarkFlood(scHandlerID, (arg != NULL) ? (int)command.value.integer : 100);
+			break;
+
+		/***** Key events *****/
+		case CMD_GKEY:
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL) gkeyFunctions.ChannelKickClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			LARGE_INTEGER start;
+			QueryPerformanceCounter(&start);
+			HandleBinding(arg, start.QuadPart);
+			break;
 		}
+		case CMD_GKEY_DOWN:
+		case CMD_GKEY_UP:
+			HandleKeyEvent(command.opcode, arg);
+			break;
+
+		/***** Error handler *****/
+		default:
+			ts3Functions.logMessage("Command not recognized:", LogLevel_WARNING, "G-Key Plugin", 0);
+			ts3Functions.logMessage(cmd, LogLevel_WARNING, "G-Key Plugin", 0);
+			gkeyFunctions.ErrorMessage(scHandlerID, "Command not recognized");
+			break;
 	}
-	else if(!strcmp(cmd, "TS3_BOOKMARK_CONNECT"))
-	{
-		if(!IsArgumentEmpty(scHandlerID, arg))
-			gkeyFunctions.ConnectToBookmark(arg, PLUGIN_CONNECT_TAB_NEW_IF_CURRENT_CONNECTED, &scHandlerID);
-	}
-	/***** Whispering *****/
-	else if(!strcmp(cmd, "TS3_WHISPER_ACTIVATE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetWhisperList(scHandlerID, TRUE);
-	}
-	else if(!strcmp(cmd, "TS3_WHISPER_DEACTIVATE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetWhisperList(scHandlerID, FALSE);
-	}
-	else if(!strcmp(cmd, "TS3_WHISPER_TOGGLE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetWhisperList(scHandlerID, !gkeyFunctions.whisperActive);
-	}
-	else if(!strcmp(cmd, "TS3_WHISPER_CLEAR"))
-	{
-		gkeyFunctions.WhisperListClear(scHandlerID);
-	}
-	else if(!strcmp(cmd, "TS3_WHISPER_CLIENT"))
+}
+
+// Voice activation commands of a parked batch hold the fast lane, a later press must not overtake them
+bool HasVoiceCommands(const Action& action)
+{
+	for(std::vector<CompiledCommand>::const_iterator it=action.commands.begin(); it!=action.commands.end(); it++)
+		if(IsFastLaneCommand(it->opcode)) return true;
+	return false;
+}
+
+/*
+ * Queues the rest of a parked batch ahead of the commands queued meanwhile, or skips it if its request failed.
+ * Either way the batch no longer holds the fast lane, a resumed batch holds it again until it is executed.
+ */
+void ResumeBatch(const Action& continuation, bool success)
+{
+	if(success)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL) gkeyFunctions.WhisperAddClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+		LARGE_INTEGER now;
+		QueryPerformanceCounter(&now);
+		QueuedCommand queued;
+		queued.action = continuation;
+		queued.bound = NULL;
+		queued.table = NULL;
+		queued.queued = now.QuadPart;
+		PushCommand(queued, true);
 	}
-	else if(!strcmp(cmd, "TS3_WHISPER_CLIENTID"))
+	else ts3Functions.logMessage("Request failed, the remaining commands are skipped", LogLevel_WARNING, "G-Key Plugin", 0);
+
+	if(HasVoiceCommands(continuation)) InterlockedDecrement(&fastLaneHolds);
+}
+
+/*
+ * Parks the rest of the batch on the request, it is resumed once the server answers it.
+ * Returns false if the answer already arrived, success then tells whether the batch continues right away.
+ */
+bool AwaitRequest(const std::string& returnCode, const Action& action, size_t next, bool& success)
+{
+	Action continuation;
+	continuation.text = action.text;
+	continuation.commands.assign(action.commands.begin() + next, action.commands.end());
+	bool holds = HasVoiceCommands(continuation);
+	if(holds) InterlockedIncrement(&fastLaneHolds);
+
+	// The tracker keeps the outcome of an awaited request, so an answer that came first is not lost
+	bool answered = false;
+	EnterCriticalSection(&csInFlight);
+	bool parked = requestTracker.Attach(returnCode.c_str(), continuation);
+	if(!parked) answered = requestTracker.TakeAnswer(returnCode.c_str(), success);
+	LeaveCriticalSection(&csInFlight);
+	if(parked) return true;
+
+	if(holds) InterlockedDecrement(&fastLaneHolds);
+	if(!answered) success = false;
+	if(!success && !continuation.commands.empty())
+		ts3Functions.logMessage("Request failed, the remaining commands are skipped", LogLevel_WARNING, "G-Key Plugin", 0);
+	return false;
+}
+
+void ExecuteCommands(const Action& action, std::vector<Command>& commands)
+{
+	// Acquire the mutex
+	if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL) gkeyFunctions.WhisperAddClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+		ts3Functions.logMessage("Timeout while waiting for mutex", LogLevel_WARNING, "G-Key Plugin", 0);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_WHISPER_CHANNEL"))
+
+	// Execute the commands, self updates are flushed once per server at the end of the batch
+	gkeyFunctions.BeginBatch();
+	for(size_t i=0; i<commands.size(); i++)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			uint64 id = gkeyFunctions.GetChannelIDFromPath(scHandlerID, arg);
-			if(id == (uint64)NULL) id = gkeyFunctions.GetChannelIDByVariable(scHandlerID, arg, CHANNEL_NAME);
-			if(id != (uint64)NULL) gkeyFunctions.WhisperAddChannel(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
-		}
+		awaitedRequest.clear();
+		ExecuteCommand(commands[i]);
+
+		// Continue the batch once the move it started is answered instead of assuming it succeeded, without blocking the queue
+		bool success;
+		if(!awaitedRequest.empty() && (AwaitRequest(awaitedRequest, action, i+1, success) || !success))
+			break;
 	}
-	else if(!strcmp(cmd, "TS3_WHISPER_CHANNELID"))
+	awaitedRequest.clear();
+
+	// Send or schedule the whisper list changes made by these commands
+	ScheduleWhisperFlush();
+	ScheduleReplyExpiry();
+	gkeyFunctions.EndBatch();
+
+	// Release the mutex
+	ReleaseMutex(hMutex);
+}
+
+void ParseCommand(char* str)
+{
+	// Repeats of a command string skip parsing, the string is only compiled the first time
+	CachedCommand* cached = commandCache.Get(str);
+	if(cached == NULL)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		// Parse all commands before executing any of them
+		Action action;
+		if(!CompileAction(str, action))
 		{
-			uint64 id = atoi(arg);
-			if(id != (uint64)NULL) gkeyFunctions.WhisperAddChannel(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Channel not found");
+			gkeyFunctions.ErrorMessage(ts3Functions.getCurrentServerConnectionHandlerID(), "Invalid command, check the clientlog for more info");
+			return;
 		}
+		if(action.commands.empty()) return;
+
+		cached = commandCache.Add(str, action);
 	}
-	else if(!strcmp(cmd, "TS3_REPLY_ACTIVATE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetReplyList(scHandlerID, TRUE);
-	}
-	else if(!strcmp(cmd, "TS3_REPLY_DEACTIVATE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetReplyList(scHandlerID, FALSE);
-	}
-	else if(!strcmp(cmd, "TS3_REPLY_TOGGLE"))
-	{
-		if(IsConnected(scHandlerID))
-			gkeyFunctions.SetReplyList(scHandlerID, !gkeyFunctions.replyActive);
-	}
-	else if(!strcmp(cmd, "TS3_REPLY_CLEAR"))
-	{
-		gkeyFunctions.ReplyListClear(scHandlerID);
+
+	// The commands keep the targets they resolve in the cache entry
+	std::vector<char> text;
+	std::vector<Command> commands;
+	ExpandAction(cached->action, text, commands, &cached->targets[0]);
+	ExecuteCommands(cached->action, commands);
+}
+
+void ExecuteAction(const Action& action)
+{
+	// The commands are already parsed, they only need to point into a copy of the action
+	std::vector<char> text;
+	std::vector<Command> commands;
+	ExpandAction(action, text, commands);
+	ExecuteCommands(action, commands);
+}
+
+void RouteCommand(const char* str, LONGLONG start)
+{
+	// A single voice activation command skips the queue, unless a command queued before it has to run first
+	Command command;
+	std::string cmd;
+	command.opcode = PeekCommand(str, cmd);
+	if(IsFastLaneCommand(command.opcode) && !fastLaneHolds)
+	{
+		command.cmd = (char*)cmd.c_str();
+		command.arg = NULL;
+		command.target = NULL;
+		command.value.integer = 0;
+
+		EnterCriticalSection(&csFastLane);
+		ExecuteFastLane(command);
+		RecordLatency(fastLaneLatency, start);
+		LeaveCriticalSection(&csFastLane);
+		return;
 	}
-	/***** Miscellaneous *****/
-	else if(!strcmp(cmd, "TS3_MUTE_CLIENT"))
+
+	// Everything else is executed in order by the command thread
+	QueuedCommand queued;
+	queued.str = str;
+	queued.bound = NULL;
+	queued.table = NULL;
+	queued.queued = start;
+	PushCommand(queued);
+}
+
+void ReleaseDebounceToggle()
+{
+	// Execute the toggle that was held back, it has not been cancelled
+	if(!debounceToggle.empty())
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL) gkeyFunctions.MuteClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+		std::string toggle = debounceToggle;
+		debounceToggle.clear();
+		RouteCommand(toggle.c_str(), debounceToggleQueued);
 	}
-	else if(!strcmp(cmd, "TS3_MUTE_CLIENTID"))
-	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL) gkeyFunctions.MuteClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+}
+
+void DispatchCommand(const char* str)
+{
+	LARGE_INTEGER start;
+	QueryPerformanceCounter(&start);
+
+	// Key presses run their compiled binding, raw key events are classified by the gesture engine
+	std::string cmd;
+	CommandOpcode opcode = PeekCommand(str, cmd);
+	if(opcode == CMD_GKEY || opcode == CMD_GKEY_DOWN || opcode == CMD_GKEY_UP)
+	{
+		size_t separator = cmd.find(' ');
+		const char* arg = separator != std::string::npos ? cmd.c_str() + separator + 1 : NULL;
+		if(opcode == CMD_GKEY) HandleBinding(arg, start.QuadPart);
+		else HandleKeyEvent(opcode, arg);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_UNMUTE_CLIENT"))
+
+	if(debounceWindow == 0)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL) gkeyFunctions.UnmuteClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+		RouteCommand(str, start.QuadPart);
+		return;
 	}
-	else if(!strcmp(cmd, "TS3_UNMUTE_CLIENTID"))
+
+	// Acquire the debouncer
+	EnterCriticalSection(&csDebounce);
+	DWORD now = GetTickCount();
+
+	if(IsToggleCommand(opcode))
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		if(cmd == debounceToggle)
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL) gkeyFunctions.UnmuteClient(scHandlerID, id);
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			// The toggle was repeated within the window, both cancel out
+			CancelWaitableTimer(hDebounceTimer);
+			debounceToggle.clear();
+			debounceStats.toggles += 2;
 		}
-	}
-	else if(!strcmp(cmd, "TS3_MUTE_TOGGLE_CLIENT"))
-	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
+		else
 		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_NICKNAME);
-			if(id != (anyID)NULL)
+			// Hold the toggle back until the window closes
+			ReleaseDebounceToggle();
+			LARGE_INTEGER debounceDueTime;
+			debounceDueTime.QuadPart = -((LONGLONG)debounceWindow * TIMER_MSEC);
+			if(SetWaitableTimer(hDebounceTimer, &debounceDueTime, 0, NULL, NULL, FALSE))
 			{
-				int muted;
-				ts3Functions.getClientVariableAsInt(scHandlerID, id, CLIENT_IS_MUTED, &muted);
-				if(!muted) gkeyFunctions.MuteClient(scHandlerID, id);
-				else gkeyFunctions.UnmuteClient(scHandlerID, id);
+				debounceToggle = cmd;
+				debounceToggleTick = now;
+				debounceToggleQueued = start.QuadPart;
 			}
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
+			else RouteCommand(str, start.QuadPart);
 		}
+		debounceLast.clear();
 	}
-	else if(!strcmp(cmd, "TS3_MUTE_TOGGLE_CLIENTID"))
+	else if(IsIdempotentCommand(opcode) && cmd == debounceLast && now - debounceLastTick < debounceWindow)
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			anyID id = gkeyFunctions.GetClientIDByVariable(scHandlerID, arg, CLIENT_UNIQUE_IDENTIFIER);
-			if(id != (anyID)NULL)
-			{
-				int muted;
-				ts3Functions.getClientVariableAsInt(scHandlerID, id, CLIENT_IS_MUTED, &muted);
-				if(!muted) gkeyFunctions.MuteClient(scHandlerID, id);
-				else gkeyFunctions.UnmuteClient(scHandlerID, id);
-			}
-			else gkeyFunctions.ErrorMessage(scHandlerID, "Client not found");
-		}
+		// Key repeat, the command has already been executed
+		debounceLastTick = now;
+		debounceStats.repeats++;
 	}
-	else if(!strcmp(cmd, "TS3_VOLUME_UP"))
+	else
 	{
-		if(IsConnected(scHandlerID))
-		{
-			float diff = (arg!=NULL && *arg != (char)NULL)?(float)atof(arg):1.0f;
-			float value;
-			ts3Functions.getPlaybackConfigValueAsFloat(scHandlerID, "volume_modifier", &value);
-			gkeyFunctions.SetMasterVolume(scHandlerID, value+diff);
-		}
+		// Keep the commands in order
+		ReleaseDebounceToggle();
+		RouteCommand(str, start.QuadPart);
+
+		if(IsIdempotentCommand(opcode)) debounceLast = cmd;
+		else debounceLast.clear();
+		debounceLastTick = now;
 	}
-	else if(!strcmp(cmd, "TS3_VOLUME_DOWN"))
+
+	// Release the debouncer
+	LeaveCriticalSection(&csDebounce);
+}
+
+void DebounceTimerCallback()
+{
+	// Acquire the debouncer
+	EnterCriticalSection(&csDebounce);
+
+	// The toggle may have been replaced while waiting, only release it once its own window has closed
+	if(!debounceToggle.empty())
 	{
-		if(IsConnected(scHandlerID))
+		DWORD elapsed = GetTickCount() - debounceToggleTick;
+		if(elapsed >= debounceWindow) ReleaseDebounceToggle();
+		else
 		{
-			float diff = (arg!=NULL && *arg != (char)NULL)?(float)atof(arg):1.0f;
-			float value;
-			ts3Functions.getPlaybackConfigValueAsFloat(scHandlerID, "volume_modifier", &value);
-			gkeyFunctions.SetMasterVolume(scHandlerID, value-diff);
+			LARGE_INTEGER debounceDueTime;
+			debounceDueTime.QuadPart = -((LONGLONG)(debounceWindow - elapsed) * TIMER_MSEC);
+			if(!SetWaitableTimer(hDebounceTimer, &debounceDueTime, 0, NULL, NULL, FALSE))
+				ReleaseDebounceToggle();
 		}
 	}
-	else if(!strcmp(cmd, "TS3_VOLUME_SET"))
+
+	// Release the debouncer
+	LeaveCriticalSection(&csDebounce);
+}
+
+/*
+ * The fast lane waits behind queued commands that switch the server it acts on,
+ * and behind the voice activation commands of a resumed batch that was parked on a move.
+ */
+bool HoldsFastLane(const QueuedCommand& queued)
+{
+	if(!queued.action.commands.empty())
 	{
-		if(IsConnected(scHandlerID) && !IsArgumentEmpty(scHandlerID, arg))
-		{
-			float value = (float)atof(arg);
-			gkeyFunctions.SetMasterVolume(scHandlerID, value);
-		}
+		for(std::vector<CompiledCommand>::const_iterator it=queued.action.commands.begin(); it!=queued.action.commands.end(); it++)
+			if(IsServerSwitchCommand(it->opcode) || IsFastLaneCommand(it->opcode)) return true;
+		return false;
 	}
-	else if(!strcmp(cmd, "TS3_PLUGIN_COMMAND"))
-	{
-		if(!IsArgumentEmpty(scHandlerID, arg))
-		{
-			char* keyword = arg;
-			char* command = strchr(arg, ' ');
-			if(*keyword == '/') keyword++; // Skip the slash
-			if(command != NULL)
-			{
-				// Split the string by inserting a NULL-terminator
-				*command = (char)NULL;
-				command++;
 
-				// Execute the command
-				if(!IsArgumentEmpty(scHandlerID, command))
-					ExecutePluginCommand(scHandlerID, keyword, command);
-			}
-		}
-	}
-	/***** Error handler *****/
-	else
+	if(queued.bound != NULL)
 	{
-		ts3Functions.logMessage("Command not recognized:", LogLevel_WARNING, "G-Key Plugin", 0);
-		ts3Functions.logMessage(cmd, LogLevel_WARNING, "G-Key Plugin", 0);
-		gkeyFunctions.ErrorMessage(scHandlerID, "Command not recognized");
+		for(std::vector<CompiledCommand>::const_iterator it=queued.bound->commands.begin(); it!=queued.bound->commands.end(); it++)
+			if(IsServerSwitchCommand(it->opcode)) return true;
+		return false;
 	}
 
-	// Release the mutex
-	ReleaseMutex(hMutex);
+	// Strings are only split here, their arguments are parsed and reported when they're executed
+	std::vector<CommandOpcode> opcodes;
+	PeekCommands(queued.str.c_str(), opcodes);
+	for(std::vector<CommandOpcode>::iterator it=opcodes.begin(); it!=opcodes.end(); it++)
+		if(IsServerSwitchCommand(*it)) return true;
+	return false;
+}
+
+void PushCommand(QueuedCommand& queued, bool front)
+{
+	// Count the holds before they're visible to the command thread
+	queued.holds = HoldsFastLane(queued);
+	if(queued.holds) InterlockedIncrement(&fastLaneHolds);
+
+	EnterCriticalSection(&csCommandQueue);
+	if(front) commandQueue.push_front(queued);
+	else commandQueue.push_back(queued);
+	LeaveCriticalSection(&csCommandQueue);
+	SetEvent(hCommandEvent);
+}
+
+bool PopCommand(QueuedCommand& result)
+{
+	EnterCriticalSection(&csCommandQueue);
+	bool found = !commandQueue.empty();
+	if(found)
+	{
+		result = commandQueue.front();
+		commandQueue.pop_front();
+	}
+	LeaveCriticalSection(&csCommandQueue);
+	return found;
 }
 
 int GetLogitechProcessId(LPDWORD ProcessId)
@@ -750,7 +2496,7 @@ void DebugMain(DWORD ProcessId, HANDLE hProcess)
 				// If this is a debug message and it uses ANSI
 				if(DebugEv.dwDebugEventCode == OUTPUT_DEBUG_STRING_EVENT && !DebugEv.u.DebugString.fUnicode)
 				{
-					char *DebugStr, *arg;
+					char *DebugStr;
 
 					// Retrieve debug string
 					DebugStr = (char*)malloc(DebugEv.u.DebugString.nDebugStringLength);
@@ -759,17 +2505,8 @@ void DebugMain(DWORD ProcessId, HANDLE hProcess)
 					// Continue the process
 					ContinueDebugEvent(DebugEv.dwProcessId, DebugEv.dwThreadId, DBG_CONTINUE);
 
-					// Seperate the argument from the command
-					arg = strchr(DebugStr, ' ');
-					if(arg != NULL)
-					{
-						// Split the string by inserting a NULL-terminator
-						*arg = (char)NULL;
-						arg++;
-					}
-
-					// Parse debug string
-					ParseCommand(DebugStr, arg);
+					// Dispatch debug string
+					DispatchCommand(DebugStr);
 
 					// Free the debug string
 					free(DebugStr);
@@ -806,7 +2543,6 @@ DWORD WINAPI DebugThread(LPVOID pData)
 	if(GetLogitechProcessId(&ProcessId))
 	{
 		ts3Functions.logMessage("Could not find Logitech software", LogLevel_ERROR, "G-Key Plugin", 0);
-		pluginRunning = FALSE;
 		return PLUGIN_ERROR_NOT_FOUND;
 	}
 
@@ -815,16 +2551,15 @@ DWORD WINAPI DebugThread(LPVOID pData)
 	if(hProcess==NULL)
 	{
 		ts3Functions.logMessage("Failed to open Logitech software for reading", LogLevel_ERROR, "G-Key Plugin", 0);
-		pluginRunning = FALSE;
 		return PLUGIN_ERROR_READ_FAILED;
 	}
 
 	// Attach debugger to Logitech software
 	if(!DebugActiveProcess(ProcessId))
 	{
-		// Could not attach debugger, exit debug thread
+		// Could not attach debugger, exit debug thread, the other threads keep running for the console commands
 		ts3Functions.logMessage("Failed to attach debugger", LogLevel_ERROR, "G-Key Plugin", 0);
-		pluginRunning = FALSE;
+		CloseHandle(hProcess);
 		return PLUGIN_ERROR_HOOK_FAILED;
 	}
 
@@ -841,6 +2576,96 @@ DWORD WINAPI DebugThread(LPVOID pData)
 	return PLUGIN_ERROR_NONE;
 }
 
+DWORD WINAPI TimerThread(LPVOID pData)
+{
+	HANDLE handles[] = { hWhisperTimer, hReplyEvent, hPttDelayTimer, hDebounceTimer, hGestureTimer, hConfigChange, hConnectTimer, hRequestTimer, hReplyTimer, hChordTimer, hExpiryTimer, hWhisperGroupEvent };
+
+	// While the plugin is running
+	while(pluginRunning)
+	{
+		// Wait for a timer or event to be signaled
+		switch(WaitForMultipleObjects(sizeof(handles)/sizeof(HANDLE), handles, FALSE, PLUGIN_THREAD_TIMEOUT))
+		{
+			case WAIT_OBJECT_0: WhisperTimerCallback(); break;
+			case WAIT_OBJECT_0+1: ReplyEventCallback(); break;
+			case WAIT_OBJECT_0+2: PTTDelayCallback(); break;
+			case WAIT_OBJECT_0+3: DebounceTimerCallback(); break;
+			case WAIT_OBJECT_0+4: GestureTimerCallback(); break;
+			case WAIT_OBJECT_0+5: ConfigChangeCallback(); break;
+			case WAIT_OBJECT_0+6: ConnectTimerCallback(); break;
+			case WAIT_OBJECT_0+7: RequestTimerCallback(); break;
+			case WAIT_OBJECT_0+8: ReplyTimerCallback(); break;
+			case WAIT_OBJECT_0+9: ChordTimerCallback(); break;
+			case WAIT_OBJECT_0+10: ExpiryTimerCallback(); break;
+			case WAIT_OBJECT_0+11: WhisperGroupEventCallback(); break;
+		}
+	}
+
+	return PLUGIN_ERROR_NONE;
+}
+
+DWORD WINAPI CommandThread(LPVOID pData)
+{
+	// While the plugin is running
+	while(pluginRunning)
+	{
+		// Wait for commands to be queued
+		if(WaitForSingleObject(hCommandEvent, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0) continue;
+
+		// Execute the queued commands in order
+		QueuedCommand command;
+		while(pluginRunning && PopCommand(command))
+		{
+			// Compiled actions skip parsing
+			if(command.bound != NULL)
+			{
+				ExecuteAction(*command.bound);
+				command.table->Release();
+			}
+			else if(!command.action.commands.empty())
+			{
+				ExecuteAction(command.action);
+			}
+			else
+			{
+				size_t length = command.str.length();
+				char* str = (char*)malloc(length+1);
+				_strcpy(str, length+1, command.str.c_str());
+
+				ParseCommand(str);
+				free(str);
+			}
+			RecordLatency(queueLatency, command.queued);
+
+			// The fast lane no longer has to wait for this command
+			if(command.holds) InterlockedDecrement(&fastLaneHolds);
+		}
+	}
+
+	return PLUGIN_ERROR_NONE;
+}
+
+DWORD WINAPI ChannelThread(LPVOID pData)
+{
+	// While the plugin is running
+	while(pluginRunning)
+	{
+		// Wait for servers to be marked dirty
+		if(WaitForSingleObject(hChannelEvent, PLUGIN_THREAD_TIMEOUT) != WAIT_OBJECT_0) continue;
+
+		EnterCriticalSection(&csChannels);
+		std::vector<uint64> servers;
+		servers.swap(channelDirty);
+		LeaveCriticalSection(&csChannels);
+
+		// Compute the targets off the key path
+		for(std::vector<uint64>::iterator it=servers.begin(); it!=servers.end() && pluginRunning; it++)
+			ComputeChannelTargets(*it);
+	}
+
+	return PLUGIN_ERROR_NONE;
+}
+
 /*********************************** Required functions ************************************/
 /*
  * If any of these required functions is not implemented, TS3 will refuse to load the plugin
@@ -887,6 +2712,64 @@ int ts3plugin_init() {
 	// Create the PTT delay timer
 	hPttDelayTimer = CreateWaitableTimer(NULL, FALSE, NULL);
 
+	// Create the whisper list coalescing timer
+	hWhisperTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	// Create the reply list event and expiry timer
+	hReplyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&csReply);
+	hReplyTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	// Create the whisper group event
+	hWhisperGroupEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	InitializeCriticalSection(&csWhisperGroups);
+
+	// Create the command queue and the PTT fast lane
+	InitializeCriticalSection(&csCommandQueue);
+	InitializeCriticalSection(&csFastLane);
+	hCommandEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+	// Create the channel target worker event
+	InitializeCriticalSection(&csChannels);
+	hChannelEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+	QueryPerformanceFrequency(&counterFrequency);
+	memset(&fastLaneLatency, 0, sizeof(fastLaneLatency));
+	memset(&queueLatency, 0, sizeof(queueLatency));
+
+	// Create the ingestion debouncer
+	InitializeCriticalSection(&csDebounce);
+	hDebounceTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	memset(&debounceStats, 0, sizeof(debounceStats));
+
+	// Create the gesture engine timer
+	InitializeCriticalSection(&csGestures);
+	hGestureTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	// Create the bookmark group connect timer
+	InitializeCriticalSection(&csConnect);
+	hConnectTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	// Create the request scheduler timer and the in-flight request table
+	InitializeCriticalSection(&csRequests);
+	hRequestTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	InitializeCriticalSection(&csInFlight);
+	hExpiryTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+
+	// Compile the key bindings and watch the config path for changes to them
+	char config[MAX_PATH];
+	ts3Functions.getConfigPath(config, MAX_PATH);
+	bindingsPath = std::string(config) + "gkey_bindings.conf";
+	InitializeCriticalSection(&csBindings);
+	hChordTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+	LoadBindings();
+	hConfigChange = FindFirstChangeNotification(config, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+	configWatched = hConfigChange != INVALID_HANDLE_VALUE;
+	if(!configWatched)
+	{
+		ts3Functions.logMessage("Failed to watch the key bindings, changes require a reload", LogLevel_WARNING, "G-Key Plugin", 0);
+		hConfigChange = CreateEvent(NULL, FALSE, FALSE, NULL); // Never signaled
+	}
+
 	// Find and open the settings database
 	char db[MAX_PATH];
 	ts3Functions.getConfigPath(db, MAX_PATH);
@@ -897,19 +2780,24 @@ int ts3plugin_init() {
 	SetErrorSound();
 	SetInfoIcon();
 
+	// Load the plugin settings
+	LoadSettings();
+	LoadPTTDelay();
+	ResolvePTTServers();
+
 	// Start the plugin threads
 	pluginRunning = true;
 	hDebugThread = CreateThread(NULL, (SIZE_T)NULL, DebugThread, 0, 0, NULL);
+	hTimerThread = CreateThread(NULL, (SIZE_T)NULL, TimerThread, 0, 0, NULL);
+	hCommandThread = CreateThread(NULL, (SIZE_T)NULL, CommandThread, 0, 0, NULL);
+	hChannelThread = CreateThread(NULL, (SIZE_T)NULL, ChannelThread, 0, 0, NULL);
 
-	if(hDebugThread==NULL)
+	if(hDebugThread==NULL || hTimerThread==NULL || hCommandThread==NULL || hChannelThread==NULL)
 	{
 		ts3Functions.logMessage("Failed to start threads, unloading plugin", LogLevel_ERROR, "G-Key Plugin", 0);
 		return 1;
 	}
 
-	/* Initialize return codes array for requestClientMove */
-	memset(requestClientMoveReturnCodes, 0, REQUESTCLIENTMOVERETURNCODES_SLOTS * RETURNCODE_BUFSIZE);
-
     return 0;  /* 0 = success, 1 = failure */
 }
 
@@ -924,8 +2812,45 @@ void ts3plugin_shutdown() {
 	// Cancel PTT delay timer
 	CancelWaitableTimer(hPttDelayTimer);
 
-	// Wait for the thread to stop
+	// Cancel whisper list coalescing and reply expiry timers
+	CancelWaitableTimer(hWhisperTimer);
+	CancelWaitableTimer(hReplyTimer);
+
+	// Cancel the debounce, gesture and chord timers
+	CancelWaitableTimer(hDebounceTimer);
+	CancelWaitableTimer(hGestureTimer);
+	CancelWaitableTimer(hChordTimer);
+
+	// Cancel the bookmark group connect timer
+	CancelWaitableTimer(hConnectTimer);
+
+	// Cancel the request scheduler and expiry timers
+	CancelWaitableTimer(hRequestTimer);
+	CancelWaitableTimer(hExpiryTimer);
+
+	// Wait for the threads to stop
 	WaitForSingleObject(hDebugThread, PLUGIN_THREAD_TIMEOUT);
+	WaitForSingleObject(hTimerThread, PLUGIN_THREAD_TIMEOUT);
+	WaitForSingleObject(hCommandThread, PLUGIN_THREAD_TIMEOUT);
+	WaitForSingleObject(hChannelThread, PLUGIN_THREAD_TIMEOUT);
+
+	// Release the key bindings
+	EnterCriticalSection(&csBindings);
+	if(bindingTable != NULL) bindingTable->Release();
+	bindingTable = NULL;
+	LeaveCriticalSection(&csBindings);
+	EnterCriticalSection(&csGestures);
+	gestureEngine.ClearBindings();
+	if(gestureTable != NULL) gestureTable->Release();
+	gestureTable = NULL;
+	LeaveCriticalSection(&csGestures);
+
+	// Release the channel models
+	EnterCriticalSection(&csChannels);
+	for(std::map<uint64, ChannelModel*>::iterator it=channelModels.begin(); it!=channelModels.end(); it++)
+		it->second->Release();
+	channelModels.clear();
+	LeaveCriticalSection(&csChannels);
 
 	/*
 	 * Note:
@@ -983,28 +2908,15 @@ const char* ts3plugin_commandKeyword() {
 
 /* Plugin processes console command. Return 0 if plugin handled the command, 1 if not handled. */
 int ts3plugin_processCommand(uint64 serverConnectionHandlerID, const char* command) {
-	size_t length = strlen(command);
-	char* str = (char*)malloc(length+1);
-	_strcpy(str, length+1, command);
-
-	// Seperate the argument from the command
-	char* arg = strchr(str, ' ');
-	if(arg != NULL)
-	{
-		// Split the string by inserting a NULL-terminator
-		*arg = (char)NULL;
-		arg++;
-	}
-
-	ParseCommand(str, arg);
-
-	free(str);
+	DispatchCommand(command);
 
 	return 0;  /* Plugin did not handle command */
 }
 
 /* Client changed current server connection handler */
 void ts3plugin_currentServerConnectionChanged(uint64 serverConnectionHandlerID) {
+	// The capture device may have followed the tab
+	gkeyFunctions.InvalidateActiveServer();
 }
 
 /*
@@ -1042,26 +2954,227 @@ int ts3plugin_requestAutoload() {
 
 /* Show an error message if the plugin failed to load */
 void ts3plugin_onConnectStatusChangeEvent(uint64 serverConnectionHandlerID, int newStatus, unsigned int errorNumber) {
-    if(newStatus == STATUS_CONNECTION_ESTABLISHED)
+	// The capture device may have moved to or away from this server
+	gkeyFunctions.InvalidateActiveServer();
+
+	// The server registry holds the status and variables of every handler
+	gkeyFunctions.InvalidateServers();
+
+	// Handlers are reused, targets resolved on an earlier connection are no longer valid
+	InvalidateChannelTree(serverConnectionHandlerID);
+	gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+
+	// Track the progress of a bookmark group connect
+	if(newStatus == STATUS_CONNECTION_ESTABLISHED || newStatus == STATUS_DISCONNECTED)
+		UpdateBookmarkGroup(serverConnectionHandlerID, newStatus == STATUS_CONNECTION_ESTABLISHED);
+
+	// The server may have joined or left the PTT server set
+	if(newStatus == STATUS_DISCONNECTED || newStatus == STATUS_CONNECTION_ESTABLISHED)
+		InterlockedExchange(&pttServersDirty, TRUE);
+
+	if(newStatus == STATUS_DISCONNECTED)
 	{
-		if(!pluginRunning) 
+		// The server no longer has our whisper list and self variables
+		gkeyFunctions.InvalidateConnection(serverConnectionHandlerID);
+		if(WaitForSingleObject(hMutex, PLUGIN_THREAD_TIMEOUT) == WAIT_OBJECT_0)
+		{
+			gkeyFunctions.WhisperReset(serverConnectionHandlerID);
+			ReleaseMutex(hMutex);
+		}
+
+		// Queued requests would target whoever gets the client IDs next
+		EnterCriticalSection(&csRequests);
+		requestScheduler.Drop(serverConnectionHandlerID);
+		LeaveCriticalSection(&csRequests);
+		std::vector<Action> skipped;
+		EnterCriticalSection(&csInFlight);
+		requestTracker.Drop(serverConnectionHandlerID, skipped);
+		LeaveCriticalSection(&csInFlight);
+		for(std::vector<Action>::iterator it=skipped.begin(); it!=skipped.end(); it++)
+			ResumeBatch(*it, false);
+		ScheduleRequestExpiry();
+	}
+    else if(newStatus == STATUS_CONNECTION_ESTABLISHED)
+	{
+		// Refresh the PTT delay, the capture profile may have changed since the plugin was loaded
+		InterlockedExchange(&pttDelayDirty, TRUE);
+
+		// The debug thread only exits early if it couldn't hook into the Logitech software
+		DWORD errorCode;
+		if(GetExitCodeThread(hDebugThread, &errorCode) && errorCode != STILL_ACTIVE && errorCode != PLUGIN_ERROR_NONE)
 		{
-			DWORD errorCode;
-			if(GetExitCodeThread(hDebugThread, &errorCode) && errorCode != PLUGIN_ERROR_NONE)
+			switch(errorCode)
 			{
-				switch(errorCode)
-				{
-					case PLUGIN_ERROR_HOOK_FAILED: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Could not hook into Logitech software, make sure you're using the 64-bit version of TeamSpeak 3."); break;
-					case PLUGIN_ERROR_READ_FAILED: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Not enough permissions to hook into Logitech software, try running as as administrator."); break;
-					case PLUGIN_ERROR_NOT_FOUND: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Logitech software not running, start the Logitech software and reload the G-Key Plugin."); break;
-					default: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "G-Key Plugin failed to start, check the clientlog for more info."); break;
-				}
+				case PLUGIN_ERROR_HOOK_FAILED: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Could not hook into Logitech software, make sure you're using the 64-bit version of TeamSpeak 3."); break;
+				case PLUGIN_ERROR_READ_FAILED: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Not enough permissions to hook into Logitech software, try running as as administrator."); break;
+				case PLUGIN_ERROR_NOT_FOUND: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "Logitech software not running, start the Logitech software and reload the G-Key Plugin."); break;
+				default: gkeyFunctions.ErrorMessage(serverConnectionHandlerID, "G-Key Plugin failed to start, check the clientlog for more info."); break;
 			}
 		}
 	}
 }
 
+/* Our own variables may have been changed outside of the plugin, the ones that changed are forgotten on next use */
+void ts3plugin_onUpdateClientEvent(uint64 serverConnectionHandlerID, anyID clientID, anyID invokerID, const char* invokerName, const char* invokerUniqueIdentifier) {
+	anyID self;
+	if(ts3Functions.getClientID(serverConnectionHandlerID, &self) != ERROR_ok || clientID != self) return;
+
+	// The capture device and the transmission baseline may have been changed outside of the plugin
+	gkeyFunctions.InvalidateActiveServer();
+	gkeyFunctions.InvalidateSelfState(serverConnectionHandlerID);
+}
+
+/* The server name, unique identifier or IP may have changed */
+void ts3plugin_onServerEditedEvent(uint64 serverConnectionHandlerID, anyID editerID, const char* editerName, const char* editerUniqueIdentifier) {
+	gkeyFunctions.InvalidateServers();
+	InterlockedExchange(&pttServersDirty, TRUE);
+}
+
+void ts3plugin_onServerUpdatedEvent(uint64 serverConnectionHandlerID) {
+	gkeyFunctions.InvalidateServers();
+	InterlockedExchange(&pttServersDirty, TRUE);
+}
+
+/* Match the server's answers to the requests we sent */
+int ts3plugin_onServerErrorEvent(uint64 serverConnectionHandlerID, const char* errorMessage, unsigned int error, const char* returnCode, const char* extraMessage) {
+	if(returnCode == NULL || *returnCode == (char)NULL) return 0;
+
+	// Joining the channel we're already in leaves us where the batch expects us
+	bool success = error == ERROR_ok || error == ERROR_ok_no_update || error == ERROR_channel_already_in;
+	InFlightRequest request;
+	EnterCriticalSection(&csInFlight);
+	bool found = requestTracker.Complete(returnCode, success, GetMicroseconds(), request);
+	LeaveCriticalSection(&csInFlight);
+	if(!found) return 0;
+
+	// Continue the batch that was parked on this request, ahead of the commands queued meanwhile
+	if(!request.continuation.commands.empty()) ResumeBatch(request.continuation, success);
+
+	// Let the client show the errors, the answers to successful requests are ours
+	return success ? 1 : 0;
+}
+
+/* The whisper groups are resolved again on the timer thread, the client thread never waits for the mutex */
+void InvalidateWhisperGroups(uint64 serverConnectionHandlerID)
+{
+	EnterCriticalSection(&csWhisperGroups);
+	if(std::find(whisperGroupsDirty.begin(), whisperGroupsDirty.end(), serverConnectionHandlerID) == whisperGroupsDirty.end())
+		whisperGroupsDirty.push_back(serverConnectionHandlerID);
+	LeaveCriticalSection(&csWhisperGroups);
+	SetEvent(hWhisperGroupEvent);
+}
+
+/* Keep the whisper groups up to date when clients join or leave the server */
+void UpdateWhisperGroups(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID)
+{
+	// Moves between channels do not change the group members
+	if(oldChannelID != 0 && newChannelID != 0) return;
+	InvalidateWhisperGroups(serverConnectionHandlerID);
+}
+
+/* The channel targets are relative to our own channel, and skip full channels if the filter says so */
+void UpdateOwnChannel(uint64 serverConnectionHandlerID, anyID clientID)
+{
+	gkeyFunctions.InvalidateOccupancy(serverConnectionHandlerID);
+
+	anyID self;
+	if(channelFilter & CHANNEL_FILTER_OCCUPANCY) InvalidateChannelTargets(serverConnectionHandlerID);
+	else if(ts3Functions.getClientID(serverConnectionHandlerID, &self) == ERROR_ok && clientID == self)
+		InvalidateChannelTargets(serverConnectionHandlerID);
+}
+
+void ts3plugin_onClientMoveEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, const char* moveMessage) {
+	if(visibility != RETAIN_VISIBILITY) gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	UpdateOwnChannel(serverConnectionHandlerID, clientID);
+	UpdateWhisperGroups(serverConnectionHandlerID, clientID, oldChannelID, newChannelID);
+}
+
+void ts3plugin_onClientMoveMovedEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, anyID moverID, const char* moverName, const char* moverUniqueIdentifier, const char* moveMessage) {
+	if(visibility != RETAIN_VISIBILITY) gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	UpdateOwnChannel(serverConnectionHandlerID, clientID);
+}
+
+void ts3plugin_onClientKickFromChannelEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, anyID kickerID, const char* kickerName, const char* kickerUniqueIdentifier, const char* kickMessage) {
+	if(visibility != RETAIN_VISIBILITY) gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	UpdateOwnChannel(serverConnectionHandlerID, clientID);
+}
+
+void ts3plugin_onClientMoveTimeoutEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, const char* timeoutMessage) {
+	if(visibility != RETAIN_VISIBILITY) gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	UpdateOwnChannel(serverConnectionHandlerID, clientID);
+	UpdateWhisperGroups(serverConnectionHandlerID, clientID, oldChannelID, newChannelID);
+}
+
+void ts3plugin_onClientKickFromServerEvent(uint64 serverConnectionHandlerID, anyID clientID, uint64 oldChannelID, uint64 newChannelID, int visibility, anyID kickerID, const char* kickerName, const char* kickerUniqueIdentifier, const char* kickMessage) {
+	if(visibility != RETAIN_VISIBILITY) gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	UpdateOwnChannel(serverConnectionHandlerID, clientID);
+	UpdateWhisperGroups(serverConnectionHandlerID, clientID, oldChannelID, newChannelID);
+}
+
+/* Nickname changes can add or remove whisper group members */
+void ts3plugin_onClientDisplayNameChanged(uint64 serverConnectionHandlerID, anyID clientID, const char* displayName, const char* uniqueClientIdentifier) {
+	gkeyFunctions.InvalidateClients(serverConnectionHandlerID);
+	InvalidateWhisperGroups(serverConnectionHandlerID);
+}
+
+/* Channel names and paths may resolve to different channels after the channel tree changes */
+void ts3plugin_onNewChannelEvent(uint64 serverConnectionHandlerID, uint64 channelID, uint64 channelParentID) {
+	InvalidateChannelTree(serverConnectionHandlerID);
+}
+
+void ts3plugin_onNewChannelCreatedEvent(uint64 serverConnectionHandlerID, uint64 channelID, uint64 channelParentID, anyID invokerID, const char* invokerName, const char* invokerUniqueIdentifier) {
+	InvalidateChannelTree(serverConnectionHandlerID);
+}
+
+void ts3plugin_onChannelMoveEvent(uint64 serverConnectionHandlerID, uint64 channelID, uint64 newChannelParentID, anyID invokerID, const char* invokerName, const char* invokerUniqueIdentifier) {
+	InvalidateChannelTree(serverConnectionHandlerID);
+}
+
+void ts3plugin_onUpdateChannelEditedEvent(uint64 serverConnectionHandlerID, uint64 channelID, anyID invokerID, const char* invokerName, const char* invokerUniqueIdentifier) {
+	InvalidateChannelTree(serverConnectionHandlerID);
+}
+
+/* The channel model holds the subscribed channels, the tree itself is unchanged so resolved channels stay valid */
+void UpdateSubscriptions(uint64 serverConnectionHandlerID, bool subscribe)
+{
+	FinishSubscriptions(serverConnectionHandlerID, (uint64)NULL, subscribe);
+	gkeyFunctions.InvalidateSubscriptions(serverConnectionHandlerID);
+	InvalidateChannelTargets(serverConnectionHandlerID);
+}
+
+void ts3plugin_onChannelSubscribeEvent(uint64 serverConnectionHandlerID, uint64 channelID) {
+	FinishSubscriptions(serverConnectionHandlerID, channelID, true);
+	FinishSubscriptions(serverConnectionHandlerID, channelID, false);
+}
+
+void ts3plugin_onChannelUnsubscribeEvent(uint64 serverConnectionHandlerID, uint64 channelID) {
+	FinishSubscriptions(serverConnectionHandlerID, channelID, true);
+	FinishSubscriptions(serverConnectionHandlerID, channelID, false);
+}
+
+void ts3plugin_onChannelSubscribeFinishedEvent(uint64 serverConnectionHandlerID) {
+	UpdateSubscriptions(serverConnectionHandlerID, true);
+}
+
+void ts3plugin_onChannelUnsubscribeFinishedEvent(uint64 serverConnectionHandlerID) {
+	UpdateSubscriptions(serverConnectionHandlerID, false);
+}
+
+/* Remove deleted channels from the whisper groups */
+void ts3plugin_onDelChannelEvent(uint64 serverConnectionHandlerID, uint64 channelID, anyID invokerID, const char* invokerName, const char* invokerUniqueIdentifier) {
+	InvalidateChannelTree(serverConnectionHandlerID);
+	InvalidateWhisperGroups(serverConnectionHandlerID);
+}
+
 /* Add whisper clients to reply list */
 void ts3plugin_onTalkStatusChangeEvent(uint64 serverConnectionHandlerID, int status, int isReceivedWhisper, anyID clientID) {
-	if(isReceivedWhisper) gkeyFunctions.ReplyAddClient(gkeyFunctions.GetActiveServerConnectionHandlerID(), clientID);
+	// This runs on the client thread, the reply list is updated without the mutex and only new clients wake the timer thread
+	if(isReceivedWhisper && gkeyFunctions.ReplyAddClient(serverConnectionHandlerID, clientID))
+	{
+		EnterCriticalSection(&csReply);
+		if(std::find(replyPending.begin(), replyPending.end(), serverConnectionHandlerID) == replyPending.end())
+			replyPending.push_back(serverConnectionHandlerID);
+		LeaveCriticalSection(&csReply);
+		SetEvent(hReplyEvent);
+	}
 }
@@ -0,0 +1,146 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#include <Windows.h>
+#include <string.h>
+
+#include "reply_list.h"
+#include "public_definitions.h"
+
+#include <vector>
+#include <algorithm>
+
+ReplyList::ReplyList(void)
+	: sequence(0)
+{
+	memset(slots, 0, sizeof(slots));
+}
+
+ReplyList::~ReplyList(void)
+{
+}
+
+void ReplyList::BeginWrite()
+{
+	// Spin until we are the one that made the sequence odd, writes are short so this rarely loops
+	for(;;)
+	{
+		long seq = sequence;
+		if(!(seq & 1) && InterlockedCompareExchange(&sequence, seq+1, seq) == seq) return;
+		YieldProcessor();
+	}
+}
+
+void ReplyList::EndWrite()
+{
+	// The interlocked increment is a full barrier, the slots are visible before the sequence is even again
+	InterlockedIncrement(&sequence);
+}
+
+bool ReplyList::Add(uint64 scHandlerID, anyID client)
+{
+	DWORD now = GetTickCount();
+	bool added = true;
+
+	BeginWrite();
+
+	// Refresh the client if it is already in the list, otherwise replace the oldest slot
+	ReplySlot* oldest = &slots[0];
+	ReplySlot* slot;
+	for(slot = slots; slot != slots + REPLY_SLOTS; slot++)
+	{
+		if(slot->client == client && slot->scHandlerID == scHandlerID) break;
+		if(slot->client == (anyID)NULL) oldest = slot; // An empty slot is always the best candidate
+		else if(oldest->client != (anyID)NULL && now - slot->lastWhisper > now - oldest->lastWhisper) oldest = slot;
+	}
+
+	if(slot != slots + REPLY_SLOTS) added = false;
+	else
+	{
+		slot = oldest;
+		slot->scHandlerID = scHandlerID;
+		slot->client = client;
+	}
+	slot->lastWhisper = now;
+
+	EndWrite();
+
+	return added;
+}
+
+void ReplyList::Clear(uint64 scHandlerID)
+{
+	BeginWrite();
+
+	for(ReplySlot* slot = slots; slot != slots + REPLY_SLOTS; slot++)
+		if(slot->scHandlerID == scHandlerID) memset(slot, 0, sizeof(ReplySlot));
+
+	EndWrite();
+}
+
+static bool CompareRecency(const ReplySlot& a, const ReplySlot& b)
+{
+	return a.lastWhisper > b.lastWhisper;
+}
+
+void ReplyList::Copy(ReplySlot* result)
+{
+	long seq;
+
+	// Copy the slots, retry if a writer was active during the copy
+	do
+	{
+		while((seq = sequence) & 1) YieldProcessor();
+		MemoryBarrier();
+		memcpy(result, (const void*)slots, sizeof(slots));
+		MemoryBarrier();
+	}
+	while(seq != sequence);
+}
+
+void ReplyList::GetClients(uint64 scHandlerID, unsigned long maxAge, std::vector<anyID>& result)
+{
+	ReplySlot copy[REPLY_SLOTS];
+	Copy(copy);
+
+	// Most recent whisper first
+	std::sort(copy, copy + REPLY_SLOTS, CompareRecency);
+
+	// Collect the clients of this server that have not expired, a maximum age of zero never expires
+	DWORD now = GetTickCount();
+	for(ReplySlot* slot = copy; slot != copy + REPLY_SLOTS; slot++)
+	{
+		if(slot->client == (anyID)NULL || slot->scHandlerID != scHandlerID) continue;
+		if(maxAge != 0 && now - slot->lastWhisper > maxAge) continue;
+		result.push_back(slot->client);
+	}
+}
+
+/*
+ * Returns the time in milliseconds until the next client of this server expires, 0 if none will.
+ */
+unsigned long ReplyList::GetNextExpiry(uint64 scHandlerID, unsigned long maxAge)
+{
+	if(maxAge == 0) return 0;
+
+	ReplySlot copy[REPLY_SLOTS];
+	Copy(copy);
+
+	DWORD now = GetTickCount();
+	unsigned long next = 0;
+	for(ReplySlot* slot = copy; slot != copy + REPLY_SLOTS; slot++)
+	{
+		if(slot->client == (anyID)NULL || slot->scHandlerID != scHandlerID) continue;
+		unsigned long age = now - slot->lastWhisper;
+		if(age > maxAge) continue;
+
+		// Wake just after the client expired
+		unsigned long left = maxAge - age + 1;
+		if(next == 0 || left < next) next = left;
+	}
+	return next;
+}
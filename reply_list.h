@@ -0,0 +1,50 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef REPLY_LIST_H
+#define REPLY_LIST_H
+
+#include "public_definitions.h"
+
+#include <vector>
+
+#define REPLY_SLOTS 16
+
+typedef struct
+{
+	uint64 scHandlerID;
+	anyID client;
+	unsigned long lastWhisper; // Tick count of the last whisper received from this client
+} ReplySlot;
+
+/*
+ * Bounded list of the clients that most recently whispered to us.
+ *
+ * The talk status callback adds clients without taking the plugin mutex, so the
+ * slots are guarded by a seqlock: writers make the sequence odd while they change
+ * the slots, readers copy the slots and retry if the sequence changed meanwhile.
+ */
+class ReplyList
+{
+private:
+	volatile long sequence;
+	ReplySlot slots[REPLY_SLOTS];
+
+	void BeginWrite();
+	void EndWrite();
+	void Copy(ReplySlot* result);
+public:
+	ReplyList(void);
+	~ReplyList(void);
+
+	bool Add(uint64 scHandlerID, anyID client);
+	void Clear(uint64 scHandlerID);
+	void GetClients(uint64 scHandlerID, unsigned long maxAge, std::vector<anyID>& result);
+	unsigned long GetNextExpiry(uint64 scHandlerID, unsigned long maxAge);
+};
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#include <string.h>
+
+#include "request_scheduler.h"
+
+#include <deque>
+#include <map>
+#include <string>
+
+RequestScheduler::RequestScheduler(void)
+	: interval(1000000), burst(25)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+RequestScheduler::~RequestScheduler(void)
+{
+}
+
+RequestBucket& RequestScheduler::GetBucket(uint64 scHandlerID, long long now)
+{
+	// New servers start with a full bucket
+	std::map<uint64, RequestBucket>::iterator it = buckets.find(scHandlerID);
+	if(it == buckets.end())
+	{
+		RequestBucket& bucket = buckets[scHandlerID];
+		bucket.tokens = burst;
+		bucket.updated = now;
+		return bucket;
+	}
+
+	// Refill the tokens for the time that passed
+	RequestBucket& bucket = it->second;
+	if(interval > 0 && now > bucket.updated)
+	{
+		bucket.tokens += (double)(now - bucket.updated) / interval;
+		if(bucket.tokens > burst) bucket.tokens = burst;
+	}
+	bucket.updated = now;
+	return bucket;
+}
+
+/*
+ * Submits a request, returns true if it should be sent right away.
+ * Otherwise the request is queued and returned by Next once the budget allows it.
+ */
+bool RequestScheduler::Submit(ServerRequest& request, RequestPriority priority, long long now)
+{
+	request.queued = now;
+	if(interval == 0)
+	{
+		stats.sent[priority]++;
+		return true;
+	}
+
+	RequestBucket& bucket = GetBucket(request.scHandlerID, now);
+	if(priority == PRIORITY_INTERACTIVE)
+	{
+		// Never delay a key press, but don't let a burst of them build up an unbounded debt
+		bucket.tokens -= 1;
+		if(bucket.tokens < -burst) bucket.tokens = -burst;
+		stats.sent[priority]++;
+		return true;
+	}
+
+	// Bulk requests keep their order, only skip the queue if it is empty
+	if(bucket.queue.empty() && bucket.tokens >= 1)
+	{
+		bucket.tokens -= 1;
+		stats.sent[priority]++;
+		return true;
+	}
+
+	bucket.queue.push_back(request);
+	stats.delayed++;
+	return false;
+}
+
+/*
+ * Returns the queued request that waited the longest among the servers that have a token.
+ */
+bool RequestScheduler::Next(ServerRequest& result, long long now)
+{
+	RequestBucket* next = NULL;
+	for(std::map<uint64, RequestBucket>::iterator it=buckets.begin(); it!=buckets.end(); it++)
+	{
+		if(it->second.queue.empty()) continue;
+
+		RequestBucket& bucket = GetBucket(it->first, now);
+		if((interval == 0 || bucket.tokens >= 1) && (next == NULL || bucket.queue.front().queued < next->queue.front().queued))
+			next = &bucket;
+	}
+	if(next == NULL) return false;
+
+	result = next->queue.front();
+	next->queue.pop_front();
+	if(interval > 0) next->tokens -= 1;
+
+	stats.sent[PRIORITY_BULK]++;
+	if(now - result.queued > stats.maxWait) stats.maxWait = now - result.queued;
+	return true;
+}
+
+/*
+ * Returns the time in microseconds until the next queued request can be sent, -1 if nothing is queued.
+ */
+long long RequestScheduler::GetDelay(long long now)
+{
+	long long delay = -1;
+	for(std::map<uint64, RequestBucket>::iterator it=buckets.begin(); it!=buckets.end(); it++)
+	{
+		if(it->second.queue.empty()) continue;
+
+		RequestBucket& bucket = GetBucket(it->first, now);
+		long long wait = (interval == 0 || bucket.tokens >= 1) ? 0 : (long long)((1 - bucket.tokens) * interval) + 1;
+		if(delay < 0 || wait < delay) delay = wait;
+	}
+	return delay;
+}
+
+size_t RequestScheduler::GetQueued()
+{
+	size_t queued = 0;
+	for(std::map<uint64, RequestBucket>::iterator it=buckets.begin(); it!=buckets.end(); it++)
+		queued += it->second.queue.size();
+	return queued;
+}
+
+void RequestScheduler::Drop(uint64 scHandlerID)
+{
+	// Client IDs are only valid for the connection they were resolved on
+	std::map<uint64, RequestBucket>::iterator it = buckets.find(scHandlerID);
+	if(it == buckets.end()) return;
+
+	// Keep the tokens, the server still counts the requests that were already sent
+	stats.dropped += it->second.queue.size();
+	it->second.queue.clear();
+}
+
+RequestTracker::RequestTracker(void)
+{
+	memset(&stats, 0, sizeof(stats));
+}
+
+RequestTracker::~RequestTracker(void)
+{
+}
+
+void RequestTracker::Add(const char* returnCode, const ServerRequest& request, long long now, bool awaited)
+{
+	InFlightRequest& entry = requests[returnCode];
+	entry.request = request;
+	entry.sent = now;
+	entry.awaited = awaited;
+	entry.continuation = Action();
+}
+
+/*
+ * Attaches the rest of the batch to an awaited request, an empty continuation stops awaiting it.
+ * Returns false if the request was already answered, its outcome is then taken with TakeAnswer.
+ */
+bool RequestTracker::Attach(const char* returnCode, const Action& continuation)
+{
+	std::map<std::string, InFlightRequest>::iterator it = requests.find(returnCode);
+	if(it == requests.end()) return false;
+
+	it->second.continuation = continuation;
+	it->second.awaited = !continuation.commands.empty();
+	return true;
+}
+
+// Removes a request, keeping the outcome for a batch that hasn't attached to it yet
+void RequestTracker::Answer(std::map<std::string, InFlightRequest>::iterator it, bool success, std::vector<Action>* skipped)
+{
+	if(it->second.awaited && it->second.continuation.commands.empty()) answers[it->first] = success;
+	if(skipped != NULL && !it->second.continuation.commands.empty()) skipped->push_back(it->second.continuation);
+	requests.erase(it);
+}
+
+/*
+ * Removes an answered request and records its round trip, returns false if the return code is unknown.
+ */
+bool RequestTracker::Complete(const char* returnCode, bool success, long long now, InFlightRequest& result)
+{
+	std::map<std::string, InFlightRequest>::iterator it = requests.find(returnCode);
+	if(it == requests.end()) return false;
+
+	long long roundTrip = now - it->second.sent;
+	stats.totalRoundTrip += roundTrip;
+	if(roundTrip > stats.maxRoundTrip) stats.maxRoundTrip = roundTrip;
+	if(success) stats.completed++;
+	else stats.failed++;
+
+	result = it->second;
+	Answer(it, success);
+	return true;
+}
+
+/*
+ * Takes the outcome of an awaited request, returns false if it is still waiting for an answer.
+ */
+bool RequestTracker::TakeAnswer(const char* returnCode, bool& success)
+{
+	std::map<std::string, bool>::iterator it = answers.find(returnCode);
+	if(it == answers.end()) return false;
+
+	success = it->second;
+	answers.erase(it);
+	return true;
+}
+
+void RequestTracker::Remove(const char* returnCode)
+{
+	requests.erase(returnCode);
+	answers.erase(returnCode);
+}
+
+/*
+ * Forgets the requests the server will no longer answer, the continuations waiting for them are skipped.
+ * Returns the number of requests that expired.
+ */
+size_t RequestTracker::Expire(long long now, long long timeout, std::vector<Action>& skipped)
+{
+	size_t expired = 0;
+	for(std::map<std::string, InFlightRequest>::iterator it=requests.begin(); it!=requests.end();)
+	{
+		if(now - it->second.sent >= timeout)
+		{
+			Answer(it++, false, &skipped);
+			expired++;
+		}
+		else it++;
+	}
+	stats.expired += expired;
+	return expired;
+}
+
+/*
+ * Returns the time in microseconds until the oldest request expires, -1 if none are waiting for an answer.
+ */
+long long RequestTracker::GetExpiry(long long now, long long timeout)
+{
+	long long expiry = -1;
+	for(std::map<std::string, InFlightRequest>::iterator it=requests.begin(); it!=requests.end(); it++)
+	{
+		long long wait = it->second.sent + timeout - now;
+		if(wait < 0) wait = 0;
+		if(expiry < 0 || wait < expiry) expiry = wait;
+	}
+	return expiry;
+}
+
+void RequestTracker::Drop(uint64 scHandlerID, std::vector<Action>& skipped)
+{
+	// A lost connection never answers its requests
+	for(std::map<std::string, InFlightRequest>::iterator it=requests.begin(); it!=requests.end();)
+	{
+		if(it->second.request.scHandlerID == scHandlerID) Answer(it++, false, &skipped);
+		else it++;
+	}
+}
@@ -0,0 +1,136 @@
+/*
+ * TeamSpeak 3 G-key plugin
+ * Author: Jules Blok (jules@aerix.nl)
+ *
+ * Copyright (c) 2010-2012 Jules Blok
+ */
+
+#ifndef REQUEST_SCHEDULER_H
+#define REQUEST_SCHEDULER_H
+
+#include "public_definitions.h"
+#include "commands.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+enum RequestType
+{
+	REQUEST_MOVE = 0,
+	REQUEST_KICK_CHANNEL,
+	REQUEST_KICK_SERVER
+};
+
+/*
+ * Self updates and whisper lists are never scheduled, they are sent by the key path directly.
+ */
+enum RequestPriority
+{
+	PRIORITY_INTERACTIVE = 0, // Sent right away, but uses up the budget of the bulk requests
+	PRIORITY_BULK, // Queued until the budget allows it
+
+	PRIORITY_COUNT
+};
+
+typedef struct
+{
+	RequestType type;
+	uint64 scHandlerID;
+	anyID client;
+	uint64 channel; // Target of REQUEST_MOVE
+	long long queued; // Time the request was submitted, in microseconds
+	std::string uid; // Unique identifier of the client of a queued kick, the server reuses the IDs of clients that left
+} ServerRequest;
+
+typedef struct
+{
+	ServerRequest request;
+	long long sent; // In microseconds
+	bool awaited; // A command batch waits for the answer, it is kept until the batch takes it or attaches its continuation
+	Action continuation; // Rest of the command batch, queued once the request succeeded
+} InFlightRequest;
+
+typedef struct
+{
+	unsigned long completed;
+	unsigned long failed;
+	unsigned long expired; // Requests the server never answered
+	long long totalRoundTrip; // Of the answered requests, in microseconds
+	long long maxRoundTrip;
+} TrackerStatistics;
+
+typedef struct
+{
+	double tokens;
+	long long updated; // Time the tokens were last refilled, in microseconds
+	std::deque<ServerRequest> queue; // Bulk requests waiting for a token, oldest first
+} RequestBucket;
+
+typedef struct
+{
+	unsigned long sent[PRIORITY_COUNT];
+	unsigned long delayed; // Bulk requests that had to wait for a token
+	unsigned long dropped; // Queued requests of servers that disconnected or clients that left
+	long long maxWait; // Longest a bulk request waited, in microseconds
+} SchedulerStatistics;
+
+/*
+ * Token bucket per server that keeps the requests below the server's flood protection.
+ *
+ * Every request takes one token, tokens refill at one per interval up to the burst size.
+ * Interactive requests are never held back, they may take the bucket below zero so the
+ * bulk requests make up for them. Not thread-safe, the caller holds the scheduler lock.
+ */
+class RequestScheduler
+{
+private:
+	std::map<uint64, RequestBucket> buckets;
+
+	RequestBucket& GetBucket(uint64 scHandlerID, long long now);
+public:
+	long long interval; // Microseconds per token, 0 never holds requests back
+	double burst;
+	SchedulerStatistics stats;
+
+	RequestScheduler(void);
+	~RequestScheduler(void);
+
+	bool Submit(ServerRequest& request, RequestPriority priority, long long now);
+	bool Next(ServerRequest& result, long long now);
+	long long GetDelay(long long now);
+	size_t GetQueued();
+	void Drop(uint64 scHandlerID);
+};
+
+/*
+ * Requests sent with a return code, matched to the answer of the server by that code.
+ * Awaited requests are added before they are sent, so an answer arriving before the
+ * batch starts waiting is kept. Not thread-safe, the caller holds the tracker lock.
+ */
+class RequestTracker
+{
+private:
+	std::map<std::string, InFlightRequest> requests;
+	std::map<std::string, bool> answers; // Outcome of the awaited requests answered before their batch attached to them
+
+	void Answer(std::map<std::string, InFlightRequest>::iterator it, bool success, std::vector<Action>* skipped = NULL);
+public:
+	TrackerStatistics stats;
+
+	RequestTracker(void);
+	~RequestTracker(void);
+
+	void Add(const char* returnCode, const ServerRequest& request, long long now, bool awaited);
+	bool Attach(const char* returnCode, const Action& continuation);
+	bool Complete(const char* returnCode, bool success, long long now, InFlightRequest& result);
+	bool TakeAnswer(const char* returnCode, bool& success);
+	void Remove(const char* returnCode);
+	size_t Expire(long long now, long long timeout, std::vector<Action>& skipped);
+	long long GetExpiry(long long now, long long timeout);
+	void Drop(uint64 scHandlerID, std::vector<Action>& skipped);
+	inline size_t GetPending() { return requests.size(); }
+};
+
+#endif